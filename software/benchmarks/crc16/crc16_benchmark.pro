@@ -0,0 +1,20 @@
+# Throughput benchmark for the CRC16 implementation used by the modbus code.
+# Not part of the application build.
+
+QT += core
+QT -= gui
+
+TARGET = crc16_benchmark
+CONFIG += console release
+CONFIG -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+SOURCES += \
+    main.cpp \
+    ../../src/crc16.cpp
+
+HEADERS += \
+    ../../src/crc16.h
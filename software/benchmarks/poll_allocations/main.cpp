@@ -0,0 +1,253 @@
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QsLog.h>
+#include <QTimer>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "battery_controller_updater.h"
+#include "bus_scheduler.h"
+#include "crc16.h"
+#include "defines.h"
+#include "modbus_rtu.h"
+#include "read_planner.h"
+#include "replay_port.h"
+#include "trace_recorder.h"
+#include "zbm_registers.h"
+
+// Replays a battery which answers every poll, and counts the heap allocations
+// made while the updater polls it. Once the updater has warmed up, a poll
+// cycle should not allocate at all. The program exits with 1 if it does, and
+// prints the call stack of the first allocations.
+//
+// Qt 4 allocates each time a timer is started and each time an event is
+// posted (for example by QMetaObject::invokeMethod). Those allocations are
+// made by the event loop, which the application cannot avoid, so they are
+// counted separately. They are recognized by the Qt functions below on the
+// call stack.
+
+static const char *const EventLoopFunctions[] = {
+	"_ZN7QObject10startTimer",
+	"_ZN16QCoreApplication9postEvent",
+	"_ZNK11QMetaMethod6invoke"
+};
+
+static const quint8 SlaveAddress = 1;
+static const int BaudRate = 115200;
+// Time (µs) between a request and its reply in the capture.
+static const int ReplyDelay = 1000;
+// Below the slack allowed by the updater, so each poll retrieves all tiers
+// using the same requests.
+static const int PollInterval = 10;
+// Allows the containers used by the updater and by Qt to reach their final
+// capacity.
+static const int WarmUpPolls = 50;
+static const int MeasuredPolls = 200;
+static const int TestTimeout = 60 * 1000;
+static const int MaxReportedAllocations = 3;
+
+static bool countAllocations = false;
+static bool inAllocationHook = false;
+static int pollAllocations = 0;
+static int eventLoopAllocations = 0;
+
+static bool isEventLoopAllocation(void **frames, int count)
+{
+	for (int i=0; i<count; ++i) {
+		Dl_info info;
+		if (dladdr(frames[i], &info) == 0 || info.dli_sname == 0)
+			continue;
+		for (size_t j=0; j<sizeof(EventLoopFunctions)/sizeof(EventLoopFunctions[0]); ++j) {
+			const char *f = EventLoopFunctions[j];
+			if (strncmp(info.dli_sname, f, strlen(f)) == 0)
+				return true;
+		}
+	}
+	return false;
+}
+
+static void onAllocation()
+{
+	if (!countAllocations || inAllocationHook)
+		return;
+	inAllocationHook = true;
+	void *frames[64];
+	int count = backtrace(frames, 64);
+	if (isEventLoopAllocation(frames, count)) {
+		++eventLoopAllocations;
+	} else {
+		++pollAllocations;
+		if (pollAllocations <= MaxReportedAllocations) {
+			// Does not allocate, unlike backtrace_symbols.
+			fprintf(stderr, "Allocation in poll path:\n");
+			backtrace_symbols_fd(frames, count, STDERR_FILENO);
+		}
+	}
+	inAllocationHook = false;
+}
+
+// Replace the allocator of glibc. operator new uses malloc as well.
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void __libc_free(void *p);
+
+void *malloc(size_t size) __THROW
+{
+	onAllocation();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) __THROW
+{
+	onAllocation();
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *p, size_t size) __THROW
+{
+	if (size > 0)
+		onAllocation();
+	return __libc_realloc(p, size);
+}
+
+void free(void *p) __THROW
+{
+	__libc_free(p);
+}
+
+}
+
+class PollCounter : public QObject
+{
+	Q_OBJECT
+public:
+	PollCounter():
+		mPolls(0)
+	{
+	}
+
+	int polls() const
+	{
+		return mPolls;
+	}
+
+public slots:
+	void onValuesRead(const RegisterValues &values)
+	{
+		Q_UNUSED(values);
+		++mPolls;
+		if (mPolls == WarmUpPolls) {
+			pollAllocations = 0;
+			eventLoopAllocations = 0;
+			countAllocations = true;
+		} else if (mPolls == WarmUpPolls + MeasuredPolls) {
+			countAllocations = false;
+			QCoreApplication::quit();
+		}
+	}
+
+private:
+	int mPolls;
+};
+
+static int appendCrc(quint8 *frame, int length)
+{
+	quint16 crc = Crc16::getValue(frame, length);
+	frame[length] = msb(crc);
+	frame[length + 1] = lsb(crc);
+	return length + 2;
+}
+
+static void recordRead(TraceRecorder &recorder, qint64 &time, quint16 start,
+					   quint16 count)
+{
+	quint8 request[8] = {
+		SlaveAddress, ModbusRtu::ReadHoldingRegisters,
+		msb(start), lsb(start), msb(count), lsb(count)
+	};
+	int requestLength = appendCrc(request, 6);
+	quint8 reply[256];
+	reply[0] = SlaveAddress;
+	reply[1] = ModbusRtu::ReadHoldingRegisters;
+	reply[2] = static_cast<quint8>(2 * count);
+	for (int i=0; i<count; ++i) {
+		quint16 value = static_cast<quint16>(start + i);
+		reply[3 + 2 * i] = msb(value);
+		reply[4 + 2 * i] = lsb(value);
+	}
+	int replyLength = appendCrc(reply, 3 + 2 * count);
+	recorder.record(TraceTransmit, time, request, requestLength);
+	recorder.record(TraceReceive, time + ReplyDelay, reply, replyLength);
+	time += 2 * ReplyDelay;
+}
+
+static bool writeCapture(const QString &fileName)
+{
+	TraceRecorder recorder(fileName, 1 << 20);
+	if (!recorder.isOpen())
+		return false;
+	qint64 time = 0;
+	recorder.recordBaudRate(time, BaudRate);
+	recordRead(recorder, time, RegSerial, 1);
+	recordRead(recorder, time, RegFirmwareVersion, 2);
+	// The reads planned by the updater when all tiers are due.
+	QList<RegisterRange> ranges;
+	for (int i=0; i<ZbmRegisterCount; ++i)
+		ranges.append(RegisterRange(ZbmRegisters[i].address, 1));
+	ReadPlanner planner(BatteryControllerUpdater::defaultGapTolerance());
+	foreach (const RegisterRange &r, planner.plan(ranges))
+		recordRead(recorder, time, r.start, r.count);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	// The glib event loop may allocate while waiting for events.
+	qputenv("QT_NO_GLIB", "1");
+	QCoreApplication app(argc, argv);
+	QsLogging::Logger::instance().setLoggingLevel(QsLogging::WarnLevel);
+
+	QString capture = QDir::temp().filePath("poll_allocations.trace");
+	if (!writeCapture(capture)) {
+		printf("Could not write %s\n", qPrintable(capture));
+		return 1;
+	}
+	ModbusRtu modbus(new ReplayPort(capture, 1));
+	BusScheduler scheduler(&modbus);
+	BatteryControllerUpdater updater(SlaveAddress, &scheduler);
+	for (int i=0; i<PollTierCount; ++i)
+		updater.setPollInterval(static_cast<PollTier>(i), PollInterval);
+	PollCounter counter;
+	QObject::connect(&updater, SIGNAL(valuesRead(RegisterValues)),
+					 &counter, SLOT(onValuesRead(RegisterValues)));
+
+	// The first call loads the unwinder, which allocates.
+	void *frames[4];
+	backtrace(frames, 4);
+
+	QTimer::singleShot(TestTimeout, &app, SLOT(quit()));
+	updater.start();
+	app.exec();
+	countAllocations = false;
+	QFile::remove(capture);
+
+	if (counter.polls() < WarmUpPolls + MeasuredPolls) {
+		printf("Only %d of %d polls completed\n", counter.polls(),
+			   WarmUpPolls + MeasuredPolls);
+		return 1;
+	}
+	printf("%d polls: %d allocations in the poll path, %d in the event loop "
+		   "(%.1f per poll)\n", MeasuredPolls, pollAllocations,
+		   eventLoopAllocations,
+		   static_cast<double>(eventLoopAllocations) / MeasuredPolls);
+	return pollAllocations == 0 ? 0 : 1;
+}
+
+#include "main.moc"
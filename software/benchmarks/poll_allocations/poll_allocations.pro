@@ -0,0 +1,56 @@
+# Counts the heap allocations made by a poll cycle of a replayed battery, and
+# fails if there are any once the updater has warmed up. Requires glibc.
+# Not part of the application build.
+
+QT += core
+QT -= gui
+
+TARGET = poll_allocations
+CONFIG += console release
+CONFIG -= app_bundle
+
+TEMPLATE = app
+
+# Allows the backtraces of unexpected allocations to show function names.
+QMAKE_LFLAGS += -rdynamic
+LIBS += -ldl
+
+include(../../ext/qslog/QsLog.pri)
+
+INCLUDEPATH += \
+    ../../ext/qslog \
+    ../../ext/velib/inc \
+    ../../ext/velib/inc/velib/platform \
+    ../../src
+
+SOURCES += \
+    main.cpp \
+    ../../ext/velib/src/plt/serial.c \
+    ../../ext/velib/src/plt/posix_serial.c \
+    ../../ext/velib/src/plt/posix_ctx.c \
+    ../../src/battery_bank.cpp \
+    ../../src/battery_controller.cpp \
+    ../../src/battery_controller_updater.cpp \
+    ../../src/bus_metrics.cpp \
+    ../../src/bus_scheduler.cpp \
+    ../../src/crc16.cpp \
+    ../../src/modbus_rtu.cpp \
+    ../../src/monotonic_clock.cpp \
+    ../../src/read_planner.cpp \
+    ../../src/replay_port.cpp \
+    ../../src/trace_recorder.cpp \
+    ../../src/zbm_registers.cpp
+
+HEADERS += \
+    ../../src/battery_bank.h \
+    ../../src/battery_controller.h \
+    ../../src/battery_controller_updater.h \
+    ../../src/bus_metrics.h \
+    ../../src/bus_scheduler.h \
+    ../../src/crc16.h \
+    ../../src/modbus_rtu.h \
+    ../../src/monotonic_clock.h \
+    ../../src/read_planner.h \
+    ../../src/replay_port.h \
+    ../../src/trace_recorder.h \
+    ../../src/zbm_registers.h
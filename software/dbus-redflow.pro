@@ -24,6 +24,9 @@ QMAKE_CXXFLAGS += -Wno-psabi
 # solved in newer QT versions.
 QMAKE_CXXFLAGS += -Wno-unused-local-typedefs
 
+# Uncomment to use a smaller (but slower) table for CRC16 computation.
+# DEFINES += CRC16_SINGLE_TABLE
+
 # Add more folders to ship with the application here
 unix {
     bindir = $$(bindir)
@@ -75,7 +78,22 @@ SOURCES += \
     src/battery_summary.cpp \
     src/abstract_monitor_service.cpp \
     src/device_scanner.cpp \
-    src/battery_summary_bridge.cpp
+    src/battery_summary_bridge.cpp \
+    src/read_planner.cpp \
+    src/zbm_registers.cpp \
+    src/bus_scheduler.cpp \
+    src/port_worker.cpp \
+    src/battery_controller_link.cpp \
+    src/broadcast_writer.cpp \
+    src/baud_rate_selector.cpp \
+    src/trace_recorder.cpp \
+    src/replay_port.cpp \
+    src/bus_metrics.cpp \
+    src/bus_diagnostics.cpp \
+    src/bus_diagnostics_bridge.cpp \
+    src/monotonic_clock.cpp \
+    src/age_statistics.cpp \
+    src/battery_bank.cpp
 
 HEADERS += \
     ext/velib/src/qt/v_busitem_adaptor.h \
@@ -99,4 +117,20 @@ HEADERS += \
     src/battery_summary.h \
     src/abstract_monitor_service.h \
     src/device_scanner.h \
-    src/battery_summary_bridge.h
+    src/battery_summary_bridge.h \
+    src/read_planner.h \
+    src/zbm_registers.h \
+    src/bus_scheduler.h \
+    src/port_worker.h \
+    src/battery_controller_link.h \
+    src/broadcast_writer.h \
+    src/baud_rate_selector.h \
+    src/trace_format.h \
+    src/trace_recorder.h \
+    src/replay_port.h \
+    src/bus_metrics.h \
+    src/bus_diagnostics.h \
+    src/bus_diagnostics_bridge.h \
+    src/monotonic_clock.h \
+    src/age_statistics.h \
+    src/battery_bank.h
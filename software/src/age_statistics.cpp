@@ -0,0 +1,69 @@
+#include <qnumeric.h>
+#include <QTimer>
+#include "age_statistics.h"
+#include "monotonic_clock.h"
+
+static double toMilliseconds(int p)
+{
+	return p < 0 ? qQNaN() : p;
+}
+
+AgeStatistics::AgeStatistics(QObject *parent):
+	QObject(parent),
+	mWindowTimer(new QTimer(this)),
+	mSampleTime(-1),
+	mP50(-1),
+	mP90(-1),
+	mP99(-1)
+{
+	mWindowTimer->setInterval(WindowLength);
+	connect(mWindowTimer, SIGNAL(timeout()), this, SLOT(onWindowTimeout()));
+	mWindowTimer->start();
+}
+
+void AgeStatistics::add(qint64 age)
+{
+	mHistogram.add(static_cast<int>(qBound<qint64>(0, age, 0x7FFFFFFF)));
+}
+
+double AgeStatistics::age() const
+{
+	if (mSampleTime < 0)
+		return qQNaN();
+	return (monotonicTime() - mSampleTime) / 1e6;
+}
+
+void AgeStatistics::setSampleTime(qint64 t)
+{
+	mSampleTime = t;
+	emit ageChanged();
+}
+
+double AgeStatistics::p50() const
+{
+	return toMilliseconds(mP50);
+}
+
+double AgeStatistics::p90() const
+{
+	return toMilliseconds(mP90);
+}
+
+double AgeStatistics::p99() const
+{
+	return toMilliseconds(mP99);
+}
+
+void AgeStatistics::onWindowTimeout()
+{
+	int p50 = mHistogram.percentile(50);
+	int p90 = mHistogram.percentile(90);
+	int p99 = mHistogram.percentile(99);
+	mHistogram = LatencyHistogram();
+	if (p50 == mP50 && p90 == mP90 && p99 == mP99)
+		return;
+	mP50 = p50;
+	mP90 = p90;
+	mP99 = p99;
+	emit percentilesChanged();
+}
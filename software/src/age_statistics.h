@@ -0,0 +1,70 @@
+#ifndef AGE_STATISTICS_H
+#define AGE_STATISTICS_H
+
+#include <QObject>
+#include "bus_metrics.h"
+
+class QTimer;
+
+/*!
+ * Keeps track of the age of the values published by a `DBusBridge`. The age
+ * of a value is the time between the reception of the Modbus reply it was
+ * decoded from, and the moment it is sent to the D-Bus.
+ *
+ * The percentiles are computed over the values published during the last
+ * `WindowLength` ms, and are NaN if no values were published.
+ */
+class AgeStatistics : public QObject
+{
+	Q_OBJECT
+	Q_PROPERTY(double age READ age NOTIFY ageChanged)
+	Q_PROPERTY(double p50 READ p50 NOTIFY percentilesChanged)
+	Q_PROPERTY(double p90 READ p90 NOTIFY percentilesChanged)
+	Q_PROPERTY(double p99 READ p99 NOTIFY percentilesChanged)
+public:
+	static const int WindowLength = 60000;
+
+	explicit AgeStatistics(QObject *parent = 0);
+
+	/// Adds the age (µs) of a published value.
+	void add(qint64 age);
+
+	/*!
+	 * Returns the current age (s) of the sample set with `setSampleTime`, or
+	 * NaN if there is no sample. The age is computed when this function is
+	 * called, so it grows even if no new samples are set.
+	 */
+	double age() const;
+
+	/*!
+	 * Sets the time (µs, see `monotonicTime`) at which the sample used to
+	 * compute `age` was received, or -1 if there is no sample. Always emits
+	 * `ageChanged`, because the age changes with time.
+	 */
+	void setSampleTime(qint64 t);
+
+	double p50() const;
+
+	double p90() const;
+
+	double p99() const;
+
+signals:
+	void ageChanged();
+
+	void percentilesChanged();
+
+private slots:
+	void onWindowTimeout();
+
+private:
+	QTimer *mWindowTimer;
+	LatencyHistogram mHistogram;
+	qint64 mSampleTime;
+	// Percentiles (ms) of the last window, -1 if not available.
+	int mP50;
+	int mP90;
+	int mP99;
+};
+
+#endif // AGE_STATISTICS_H
@@ -0,0 +1,225 @@
+#include "battery_bank.h"
+#include "zbm_registers.h"
+
+// Sources of an alarm, see `AlarmRule`.
+enum AlarmSource {
+	HardwareFailureBit = 0x01,
+	OperationalFailureBit = 0x02,
+	WarningBit = 0x04
+};
+
+/*!
+ * Derives an alarm from a single bit of the status words. The alarm is 2 if
+ * the bit is set in one of the failure words selected by `sources`, or 1 if
+ * it is only set in the warning word (if selected).
+ */
+struct AlarmRule
+{
+	BatteryBank::Alarm alarm;
+	int sources;
+	int bit;
+};
+
+static const AlarmRule AlarmRules[] = {
+	{ BatteryBank::MaintenanceAlarm, WarningBit, 11 },
+	{ BatteryBank::MaintenanceActiveAlarm, WarningBit, 10 },
+	{ BatteryBank::OverCurrentAlarm, OperationalFailureBit | WarningBit, 15 },
+	{ BatteryBank::OverVoltageAlarm, OperationalFailureBit | WarningBit, 14 },
+	{ BatteryBank::BatteryTemperatureAlarm, OperationalFailureBit | WarningBit, 13 },
+	{ BatteryBank::ZincPumpAlarm, HardwareFailureBit, 15 },
+	{ BatteryBank::BromidePumpAlarm, HardwareFailureBit, 14 },
+	{ BatteryBank::LeakSensorsAlarm, HardwareFailureBit, 11 },
+	{ BatteryBank::InternalFailureAlarm, HardwareFailureBit, 9 },
+	{ BatteryBank::ElectricBoardAlarm, HardwareFailureBit, 8 },
+	{ BatteryBank::BatteryTemperatureSensorAlarm, HardwareFailureBit, 7 },
+	{ BatteryBank::AirTemperatureSensorAlarm, HardwareFailureBit, 6 },
+	{ BatteryBank::StateOfHealthAlarm, HardwareFailureBit, 5 },
+	{ BatteryBank::Leak1TripAlarm, HardwareFailureBit, 4 },
+	{ BatteryBank::Leak2TripAlarm, HardwareFailureBit, 3 },
+	{ BatteryBank::UnknownAlarm, HardwareFailureBit | OperationalFailureBit | WarningBit, 0 }
+};
+
+static const int AlarmRuleCount = sizeof(AlarmRules) / sizeof(AlarmRules[0]);
+
+BatteryBank::BatteryBank():
+	mSampleTimes(ZbmRegisterCount)
+{
+}
+
+int BatteryBank::allocate()
+{
+	int slot = 0;
+	if (mFreeSlots.isEmpty()) {
+		slot = mConnected.size();
+		for (int i=0; i<MeasurementCount; ++i)
+			mMeasurements[i].append(0);
+		for (int i=0; i<WordCount; ++i)
+			mWords[i].append(0);
+		for (int i=0; i<AlarmCount; ++i)
+			mAlarms[i].append(0);
+		mConnected.append(0);
+		for (int i=0; i<ZbmRegisterCount; ++i)
+			mSampleTimes[i].append(-1);
+	} else {
+		slot = mFreeSlots.takeLast();
+		for (int i=0; i<MeasurementCount; ++i)
+			mMeasurements[i][slot] = 0;
+		for (int i=0; i<WordCount; ++i)
+			mWords[i][slot] = 0;
+		for (int i=0; i<AlarmCount; ++i)
+			mAlarms[i][slot] = 0;
+		for (int i=0; i<ZbmRegisterCount; ++i)
+			mSampleTimes[i][slot] = -1;
+	}
+	return slot;
+}
+
+void BatteryBank::release(int slot)
+{
+	mConnected[slot] = 0;
+	mFreeSlots.append(slot);
+}
+
+double BatteryBank::measurement(Measurement m, int slot) const
+{
+	return mMeasurements[m][slot];
+}
+
+bool BatteryBank::setMeasurement(Measurement m, int slot, double v)
+{
+	double &value = mMeasurements[m][slot];
+	if (value == v)
+		return false;
+	value = v;
+	return true;
+}
+
+int BatteryBank::word(Word w, int slot) const
+{
+	return mWords[w][slot];
+}
+
+bool BatteryBank::setWord(Word w, int slot, int v)
+{
+	int &value = mWords[w][slot];
+	if (value == v)
+		return false;
+	value = v;
+	return true;
+}
+
+int BatteryBank::alarm(Alarm a, int slot) const
+{
+	return mAlarms[a][slot];
+}
+
+bool BatteryBank::setAlarm(Alarm a, int slot, int v)
+{
+	quint8 &value = mAlarms[a][slot];
+	if (value == v)
+		return false;
+	value = static_cast<quint8>(v);
+	return true;
+}
+
+bool BatteryBank::updateAlarms(int slot)
+{
+	quint16 summary = mWords[StatusSummary][slot];
+	quint16 hwFailure = mWords[HardwareFailure][slot];
+	quint16 opFailure = mWords[OperationalFailure][slot];
+	quint16 warning = mWords[WarningIndicator][slot];
+	bool changed = setAlarm(HasAlarm, slot, (summary & 0xE000) == 0 ? 0 : 1);
+	for (int i=0; i<AlarmRuleCount; ++i) {
+		const AlarmRule &r = AlarmRules[i];
+		quint16 errors = 0;
+		if ((r.sources & HardwareFailureBit) != 0)
+			errors |= hwFailure;
+		if ((r.sources & OperationalFailureBit) != 0)
+			errors |= opFailure;
+		quint16 warnings = (r.sources & WarningBit) != 0 ? warning : 0;
+		int v = 0;
+		if ((errors & (1 << r.bit)) != 0)
+			v = 2;
+		else if ((warnings & (1 << r.bit)) != 0)
+			v = 1;
+		changed = setAlarm(r.alarm, slot, v) || changed;
+	}
+	return changed;
+}
+
+bool BatteryBank::isConnected(int slot) const
+{
+	return mConnected[slot] != 0;
+}
+
+void BatteryBank::setConnected(int slot, bool connected)
+{
+	mConnected[slot] = connected ? 1 : 0;
+}
+
+qint64 BatteryBank::sampleTime(int index, int slot) const
+{
+	return mSampleTimes[index][slot];
+}
+
+void BatteryBank::setSampleTime(int index, int slot, qint64 t)
+{
+	mSampleTimes[index][slot] = t;
+}
+
+qint64 BatteryBank::oldestSampleTime(int index) const
+{
+	const quint8 *connected = mConnected.constData();
+	const qint64 *times = mSampleTimes[index].constData();
+	int n = mConnected.size();
+	qint64 t = -1;
+	for (int i=0; i<n; ++i) {
+		if (connected[i] == 0)
+			continue;
+		if (times[i] < 0)
+			return -1;
+		if (t < 0 || times[i] < t)
+			t = times[i];
+	}
+	return t;
+}
+
+BatteryBank::Totals BatteryBank::totals() const
+{
+	const quint8 *connected = mConnected.constData();
+	const double *volts = mMeasurements[BattVolts].constData();
+	const double *amps = mMeasurements[BattAmps].constData();
+	const double *soc = mMeasurements[StateOfCharge].constData();
+	const quint8 *maintenance = mAlarms[MaintenanceAlarm].constData();
+	const quint8 *maintenanceActive = mAlarms[MaintenanceActiveAlarm].constData();
+	int n = mConnected.size();
+	Totals t;
+	t.count = 0;
+	t.voltage = 0;
+	t.voltageCount = 0;
+	t.current = 0;
+	t.power = 0;
+	t.stateOfCharge = 0;
+	t.maintenanceNeeded = true;
+	t.maintenanceActive = true;
+	for (int i=0; i<n; ++i) {
+		if (connected[i] == 0)
+			continue;
+		++t.count;
+		if (volts[i] > 0) {
+			t.voltage += volts[i];
+			++t.voltageCount;
+		}
+		t.current += amps[i];
+		t.power += volts[i] * amps[i];
+		t.stateOfCharge += soc[i];
+		// The maintenance flags are cleared if any battery has not been put
+		// in maintenance mode yet, so the GUI can use them to force the
+		// remaining batteries into maintenance mode.
+		t.maintenanceNeeded = t.maintenanceNeeded && maintenance[i] != 0;
+		t.maintenanceActive = t.maintenanceActive && maintenanceActive[i] != 0;
+	}
+	t.maintenanceNeeded = t.maintenanceNeeded && t.count > 0;
+	t.maintenanceActive = t.maintenanceActive && t.count > 0;
+	return t;
+}
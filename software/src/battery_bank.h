@@ -0,0 +1,149 @@
+#ifndef BATTERY_BANK_H
+#define BATTERY_BANK_H
+
+#include <QList>
+#include <QVector>
+
+/*!
+ * @brief Stores the values of all batteries.
+ * Each battery occupies a slot, allocated by its `BatteryController`. The
+ * values are kept in one array per field, indexed by slot, so computations
+ * over all batteries (such as the totals used by `BatterySummary`) are linear
+ * scans over contiguous memory. `BatteryController` is a view on a single
+ * slot, which provides the properties and change notifications needed to
+ * publish the values on the D-Bus.
+ *
+ * Slots of removed batteries are reused. They are never connected, so they
+ * do not contribute to `totals` or `oldestSampleTime`.
+ */
+class BatteryBank
+{
+public:
+	enum Measurement {
+		BattVolts,
+		BusVolts,
+		BattAmps,
+		BattTemp,
+		AirTemp,
+		StateOfCharge,
+		ConsumedAmpHours,
+		HealthIndication,
+		MeasurementCount
+	};
+
+	enum Word {
+		DeviceType,
+		DeviceAddress,
+		OperationalMode,
+		BatteryState,
+		StatusSummary,
+		HardwareFailure,
+		OperationalFailure,
+		WarningIndicator,
+		ClearStatusRegisterFlags,
+		RequestDelayedSelfMaintenance,
+		RequestImmediateSelfMaintenance,
+		WordCount
+	};
+
+	/*!
+	 * Alarms derived from the status words by `updateAlarms`. The value of
+	 * an alarm is 0 (ok), 1 (warning), or 2 (alarm).
+	 */
+	enum Alarm {
+		HasAlarm,
+		MaintenanceAlarm,
+		MaintenanceActiveAlarm,
+		OverCurrentAlarm,
+		OverVoltageAlarm,
+		BatteryTemperatureAlarm,
+		ZincPumpAlarm,
+		BromidePumpAlarm,
+		LeakSensorsAlarm,
+		InternalFailureAlarm,
+		ElectricBoardAlarm,
+		BatteryTemperatureSensorAlarm,
+		AirTemperatureSensorAlarm,
+		StateOfHealthAlarm,
+		Leak1TripAlarm,
+		Leak2TripAlarm,
+		UnknownAlarm,
+		AlarmCount
+	};
+
+	/// Sums over all connected batteries, as computed by `totals`.
+	struct Totals
+	{
+		int count;
+		/// Sum of the positive battery voltages, and the number of batteries
+		/// with a positive voltage.
+		double voltage;
+		int voltageCount;
+		double current;
+		double power;
+		double stateOfCharge;
+		/// Set if there is at least one battery, and the maintenance alarm
+		/// of all batteries is set.
+		bool maintenanceNeeded;
+		/// Set if there is at least one battery, and the maintenance active
+		/// alarm of all batteries is set.
+		bool maintenanceActive;
+	};
+
+	BatteryBank();
+
+	/// Returns a new slot, with all values set to 0.
+	int allocate();
+
+	void release(int slot);
+
+	double measurement(Measurement m, int slot) const;
+
+	/// Returns true if the value has changed.
+	bool setMeasurement(Measurement m, int slot, double v);
+
+	int word(Word w, int slot) const;
+
+	/// Returns true if the value has changed.
+	bool setWord(Word w, int slot, int v);
+
+	int alarm(Alarm a, int slot) const;
+
+	/// Returns true if the value has changed.
+	bool setAlarm(Alarm a, int slot, int v);
+
+	/*!
+	 * Recomputes the alarms of the given slot from its status words.
+	 * Returns true if any of the alarms has changed.
+	 */
+	bool updateAlarms(int slot);
+
+	bool isConnected(int slot) const;
+
+	void setConnected(int slot, bool connected);
+
+	/// See `BatteryController::sampleTime`.
+	qint64 sampleTime(int index, int slot) const;
+
+	void setSampleTime(int index, int slot, qint64 t);
+
+	/*!
+	 * Returns the oldest sample time of the given register (index in
+	 * `ZbmRegisters`) of all connected batteries, or -1 if the value of one
+	 * of the batteries has not been received yet.
+	 */
+	qint64 oldestSampleTime(int index) const;
+
+	Totals totals() const;
+
+private:
+	QVector<double> mMeasurements[MeasurementCount];
+	QVector<int> mWords[WordCount];
+	QVector<quint8> mAlarms[AlarmCount];
+	QVector<quint8> mConnected;
+	// Indexed like `ZbmRegisters`.
+	QVector<QVector<qint64> > mSampleTimes;
+	QList<int> mFreeSlots;
+};
+
+#endif // BATTERY_BANK_H
@@ -1,32 +1,20 @@
 #include <QsLog.h>
 #include "battery_controller.h"
 
-BatteryController::BatteryController(const QString &portName, int deviceAddress,
-									 QObject *parent) :
+BatteryController::BatteryController(BatteryBank *bank, const QString &portName,
+									 int deviceAddress, QObject *parent) :
 	QObject(parent),
+	mBank(bank),
+	mSlot(bank->allocate()),
 	mConnectionState(Disconnected),
-	mDeviceType(0),
-	mPortName(portName),
-	mBattVolts(0),
-	mBusVolts(0),
-	mBattAmps(0),
-	mBattTemp(0),
-	mAirTemp(0),
-	mSOC(0),
-	mStsRegSummary(0),
-	mStsRegHardwareFailure(0),
-	mStsRegOperationalFailure(0),
-	mStsRegWarning(0),
-	mOperationalMode(0),
-	mSOCAmpHrs(0),
-	mHealthIndication(0),
-	mState(0),
-	mDeviceAddress(deviceAddress),
-	mClearStatusRegisterFlags(0),
-	mRequestDelayedSelfMaintenance(0),
-	mRequestImmediateSelfMaintenance(0),
-	mHasAlarm(0)
+	mPortName(portName)
 {
+	mBank->setWord(BatteryBank::DeviceAddress, mSlot, deviceAddress);
+}
+
+BatteryController::~BatteryController()
+{
+	mBank->release(mSlot);
 }
 
 ConnectionState BatteryController::connectionState() const
@@ -39,19 +27,19 @@ void BatteryController::setConnectionState(ConnectionState state)
 	if (mConnectionState == state)
 		return;
 	mConnectionState = state;
+	mBank->setConnected(mSlot, state == Connected);
 	emit connectionStateChanged();
 }
 
 int BatteryController::deviceType() const
 {
-	return mDeviceType;
+	return mBank->word(BatteryBank::DeviceType, mSlot);
 }
 
 void BatteryController::setDeviceType(int t)
 {
-	if (mDeviceType == t)
+	if (!mBank->setWord(BatteryBank::DeviceType, mSlot, t))
 		return;
-	mDeviceType = t;
 	emit deviceTypeChanged();
 }
 
@@ -65,6 +53,16 @@ QString BatteryController::portName() const
 	return mPortName;
 }
 
+qint64 BatteryController::sampleTime(int index) const
+{
+	return mBank->sampleTime(index, mSlot);
+}
+
+void BatteryController::setSampleTime(int index, qint64 t)
+{
+	mBank->setSampleTime(index, mSlot, t);
+}
+
 QString BatteryController::serial() const
 {
 	return mSerial;
@@ -94,410 +92,433 @@ void BatteryController::setFirmwareVersion(const QString &v)
 
 double BatteryController::BattVolts() const
 {
-	return mBattVolts;
+	return mBank->measurement(BatteryBank::BattVolts, mSlot);
 }
 
 void BatteryController::setBattVolts(double t)
 {
-	if (mBattVolts == t)
+	if (!mBank->setMeasurement(BatteryBank::BattVolts, mSlot, t))
 		return;
-	mBattVolts = t;
 	emit battVoltsChanged();
 	emit battPowerChanged();
 }
 
 double BatteryController::BusVolts() const
 {
-	return mBusVolts;
+	return mBank->measurement(BatteryBank::BusVolts, mSlot);
 }
 
 void BatteryController::setBusVolts(double t)
 {
-	if (mBusVolts == t)
+	if (!mBank->setMeasurement(BatteryBank::BusVolts, mSlot, t))
 		return;
-	mBusVolts = t;
 	emit busVoltsChanged();
 }
 
 double BatteryController::BattAmps() const
 {
-	return mBattAmps;
+	return mBank->measurement(BatteryBank::BattAmps, mSlot);
 }
 
 void BatteryController::setBattAmps(double t)
 {
-	if (mBattAmps == t)
+	if (!mBank->setMeasurement(BatteryBank::BattAmps, mSlot, t))
 		return;
-	mBattAmps = t;
 	emit battAmpsChanged();
 	emit battPowerChanged();
 }
 
 double BatteryController::BattTemp() const
 {
-	return mBattTemp;
+	return mBank->measurement(BatteryBank::BattTemp, mSlot);
 }
 
 void BatteryController::setBattTemp(double t)
 {
-	if (mBattTemp == t)
+	if (!mBank->setMeasurement(BatteryBank::BattTemp, mSlot, t))
 		return;
-	mBattTemp = t;
 	emit battTempChanged();
 }
 
 double BatteryController::AirTemp() const
 {
-	return mAirTemp;
+	return mBank->measurement(BatteryBank::AirTemp, mSlot);
 }
 
 void BatteryController::setAirTemp(double t)
 {
-	if (mAirTemp == t)
+	if (!mBank->setMeasurement(BatteryBank::AirTemp, mSlot, t))
 		return;
-	mAirTemp = t;
 	emit airTempChanged();
 }
 
 double BatteryController::SOC() const
 {
-	return mSOC;
+	return mBank->measurement(BatteryBank::StateOfCharge, mSlot);
 }
 
 void BatteryController::setSOC(double t)
 {
-	if (mSOC == t)
+	if (!mBank->setMeasurement(BatteryBank::StateOfCharge, mSlot, t))
 		return;
-	mSOC = t;
 	emit socChanged();
 }
 
 double BatteryController::BattPower() const
 {
-	return mBattAmps * mBattVolts;
+	return BattAmps() * BattVolts();
 }
 
 int BatteryController::operationalMode() const
 {
-	return mOperationalMode;
+	return mBank->word(BatteryBank::OperationalMode, mSlot);
 }
 
 void BatteryController::setOperationalMode(int t)
 {
-	if (mOperationalMode == t)
+	if (!mBank->setWord(BatteryBank::OperationalMode, mSlot, t))
 		return;
-	mOperationalMode = t;
 	emit operationalModeChanged();
 }
 
 double BatteryController::SOCAmpHrs() const
 {
-	return mSOCAmpHrs;
+	return mBank->measurement(BatteryBank::ConsumedAmpHours, mSlot);
 }
 
 void BatteryController::setSOCAmpHrs(double t)
 {
-	if (mSOCAmpHrs == t)
+	if (!mBank->setMeasurement(BatteryBank::ConsumedAmpHours, mSlot, t))
 		return;
-	mSOCAmpHrs = t;
 	emit socAmpHrsChanged();
 }
 
 double BatteryController::HealthIndication() const
 {
-	return mHealthIndication;
+	return mBank->measurement(BatteryBank::HealthIndication, mSlot);
 }
 
 void BatteryController::setHealthIndication(double t)
 {
-	if (mHealthIndication == t)
+	if (!mBank->setMeasurement(BatteryBank::HealthIndication, mSlot, t))
 		return;
-	mHealthIndication = t;
 	emit healthIndicationChanged();
 }
 
 int BatteryController::State() const
 {
-	return mState;
+	return mBank->word(BatteryBank::BatteryState, mSlot);
 }
 
 void BatteryController::setState(int t)
 {
-	if (mState == t)
+	if (!mBank->setWord(BatteryBank::BatteryState, mSlot, t))
 		return;
-	mState = t;
 	emit stateChanged();
 }
 
 int BatteryController::DeviceAddress() const
 {
-	return mDeviceAddress;
+	return mBank->word(BatteryBank::DeviceAddress, mSlot);
 }
 
 void BatteryController::setDeviceAddress(int t)
 {
-	if (mDeviceAddress == t)
+	if (!mBank->setWord(BatteryBank::DeviceAddress, mSlot, t))
 		return;
-	mDeviceAddress = t;
 	emit deviceAddressChanged();
 }
 
 int BatteryController::ClearStatusRegisterFlags() const
 {
-	return mClearStatusRegisterFlags;
+	return mBank->word(BatteryBank::ClearStatusRegisterFlags, mSlot);
 }
 
 void BatteryController::setClearStatusRegisterFlags(int t)
 {
-	if (mClearStatusRegisterFlags == t)
+	if (!mBank->setWord(BatteryBank::ClearStatusRegisterFlags, mSlot, t))
 		return;
-	mClearStatusRegisterFlags = t;
 	emit clearStatusRegisterFlagsChanged();
 }
 
 int BatteryController::RequestDelayedSelfMaintenance() const
 {
-	return mRequestDelayedSelfMaintenance;
+	return mBank->word(BatteryBank::RequestDelayedSelfMaintenance, mSlot);
 }
 
 void BatteryController::setRequestDelayedSelfMaintenance(int t)
 {
-	if (mRequestDelayedSelfMaintenance == t)
+	if (!mBank->setWord(BatteryBank::RequestDelayedSelfMaintenance, mSlot, t))
 		return;
-	mRequestDelayedSelfMaintenance = t;
 	emit requestDelayedSelfMaintenanceChanged();
 }
 
 int BatteryController::RequestImmediateSelfMaintenance() const
 {
-	return mRequestImmediateSelfMaintenance;
+	return mBank->word(BatteryBank::RequestImmediateSelfMaintenance, mSlot);
 }
 
 void BatteryController::setRequestImmediateSelfMaintenance(int t)
 {
-	if (mRequestImmediateSelfMaintenance == t)
+	if (!mBank->setWord(BatteryBank::RequestImmediateSelfMaintenance, mSlot, t))
 		return;
-	mRequestImmediateSelfMaintenance = t;
 	emit requestImmediateSelfMaintenanceChanged();
 }
 
+int BatteryController::StsRegSummary() const
+{
+	return mBank->word(BatteryBank::StatusSummary, mSlot);
+}
+
+void BatteryController::setStsRegSummary(int v)
+{
+	if (!mBank->setWord(BatteryBank::StatusSummary, mSlot, v))
+		return;
+	emit stsRegSummaryChanged();
+}
+
+int BatteryController::StsRegHardwareFailure() const
+{
+	return mBank->word(BatteryBank::HardwareFailure, mSlot);
+}
+
+void BatteryController::setStsRegHardwareFailure(int v)
+{
+	if (!mBank->setWord(BatteryBank::HardwareFailure, mSlot, v))
+		return;
+	emit stsRegHardwareFailureChanged();
+}
+
+int BatteryController::StsRegOperationalFailure() const
+{
+	return mBank->word(BatteryBank::OperationalFailure, mSlot);
+}
+
+void BatteryController::setStsRegOperationalFailure(int v)
+{
+	if (!mBank->setWord(BatteryBank::OperationalFailure, mSlot, v))
+		return;
+	emit stsRegOperationalFailureChanged();
+}
+
+int BatteryController::StsRegWarning() const
+{
+	return mBank->word(BatteryBank::WarningIndicator, mSlot);
+}
+
+void BatteryController::setStsRegWarning(int v)
+{
+	if (!mBank->setWord(BatteryBank::WarningIndicator, mSlot, v))
+		return;
+	emit stsRegWarningChanged();
+}
+
 int BatteryController::hasAlarm() const
 {
-	return mHasAlarm;
+	return mBank->alarm(BatteryBank::HasAlarm, mSlot);
 }
 
 void BatteryController::setHasAlarm(int a)
 {
-	if (mHasAlarm == a)
+	if (!mBank->setAlarm(BatteryBank::HasAlarm, mSlot, a))
 		return;
-	mHasAlarm = a;
-	emit hasAlarmChanged();
+	emit alarmsChanged();
 }
 
 int BatteryController::maintenanceAlarm() const
 {
-	return mMaintenanceAlarm;
+	return mBank->alarm(BatteryBank::MaintenanceAlarm, mSlot);
 }
 
 void BatteryController::setMaintenanceAlarm(int v)
 {
-	if (mMaintenanceAlarm == v)
+	if (!mBank->setAlarm(BatteryBank::MaintenanceAlarm, mSlot, v))
 		return;
-	mMaintenanceAlarm = v;
-	emit maintenanceAlarmChanged();
+	emit alarmsChanged();
 }
 
 int BatteryController::maintenanceActiveAlarm() const
 {
-	return mMaintenanceActiveAlarm;
+	return mBank->alarm(BatteryBank::MaintenanceActiveAlarm, mSlot);
 }
 
 void BatteryController::setMaintenanceActiveAlarm(int v)
 {
-	if (mMaintenanceActiveAlarm == v)
+	if (!mBank->setAlarm(BatteryBank::MaintenanceActiveAlarm, mSlot, v))
 		return;
-	mMaintenanceActiveAlarm = v;
-	emit maintenanceActiveAlarmChanged();
+	emit alarmsChanged();
 }
 
 int BatteryController::overCurrentAlarm() const
 {
-	return mOverCurrentAlarm;
+	return mBank->alarm(BatteryBank::OverCurrentAlarm, mSlot);
 }
 
 void BatteryController::setOverCurrentAlarm(int v)
 {
-	if (mOverCurrentAlarm == v)
+	if (!mBank->setAlarm(BatteryBank::OverCurrentAlarm, mSlot, v))
 		return;
-	mOverCurrentAlarm = v;
-	emit overCurrentAlarmChanged();
+	emit alarmsChanged();
 }
 
 int BatteryController::overVoltageAlarm() const
 {
-	return mOverVoltageAlarm;
+	return mBank->alarm(BatteryBank::OverVoltageAlarm, mSlot);
 }
 
 void BatteryController::setOverVoltageAlarm(int v)
 {
-	if (mOverVoltageAlarm == v)
+	if (!mBank->setAlarm(BatteryBank::OverVoltageAlarm, mSlot, v))
 		return;
-	mOverVoltageAlarm = v;
-	emit overVoltageAlarmChanged();
+	emit alarmsChanged();
 }
 
 int BatteryController::batteryTemperatureAlarm() const
 {
-	return mBatteryTemperatureAlarm;
+	return mBank->alarm(BatteryBank::BatteryTemperatureAlarm, mSlot);
 }
 
 void BatteryController::setBatteryTemperatureAlarm(int v)
 {
-	if (mBatteryTemperatureAlarm == v)
+	if (!mBank->setAlarm(BatteryBank::BatteryTemperatureAlarm, mSlot, v))
 		return;
-	mBatteryTemperatureAlarm = v;
-	emit batteryTemperatureAlarmChanged();
+	emit alarmsChanged();
 }
 
 int BatteryController::zincPumpAlarm() const
 {
-	return mZincPumpAlarm;
+	return mBank->alarm(BatteryBank::ZincPumpAlarm, mSlot);
 }
 
 void BatteryController::setZincPumpAlarm(int v)
 {
-	if (mZincPumpAlarm == v)
+	if (!mBank->setAlarm(BatteryBank::ZincPumpAlarm, mSlot, v))
 		return;
-	mZincPumpAlarm = v;
-	emit zincPumpAlarmChanged();
+	emit alarmsChanged();
 }
 
 int BatteryController::bromidePumpAlarm() const
 {
-	return mBromidePumpAlarm;
+	return mBank->alarm(BatteryBank::BromidePumpAlarm, mSlot);
 }
 
 void BatteryController::setBromidePumpAlarm(int v)
 {
-	if (mBromidePumpAlarm == v)
+	if (!mBank->setAlarm(BatteryBank::BromidePumpAlarm, mSlot, v))
 		return;
-	mBromidePumpAlarm = v;
-	emit bromidePumpAlarmChanged();
+	emit alarmsChanged();
 }
 
 int BatteryController::leakSensorsAlarm() const
 {
-	return mLeakSensorsAlarm;
+	return mBank->alarm(BatteryBank::LeakSensorsAlarm, mSlot);
 }
 
 void BatteryController::setLeakSensorsAlarm(int v)
 {
-	if (mLeakSensorsAlarm == v)
+	if (!mBank->setAlarm(BatteryBank::LeakSensorsAlarm, mSlot, v))
 		return;
-	mLeakSensorsAlarm = v;
-	emit leakSensorsAlarmChanged();
+	emit alarmsChanged();
 }
 
 int BatteryController::internalFailureAlarm() const
 {
-	return mInternalFailureAlarm;
+	return mBank->alarm(BatteryBank::InternalFailureAlarm, mSlot);
 }
 
 void BatteryController::setInternalFailureAlarm(int v)
 {
-	if (mInternalFailureAlarm == v)
+	if (!mBank->setAlarm(BatteryBank::InternalFailureAlarm, mSlot, v))
 		return;
-	mInternalFailureAlarm = v;
-	emit internalFailureAlarmChanged();
+	emit alarmsChanged();
 }
 
 int BatteryController::electricBoardAlarm() const
 {
-	return mElectricBoardAlarm;
+	return mBank->alarm(BatteryBank::ElectricBoardAlarm, mSlot);
 }
 
 void BatteryController::setElectricBoardAlarm(int v)
 {
-	if (mElectricBoardAlarm == v)
+	if (!mBank->setAlarm(BatteryBank::ElectricBoardAlarm, mSlot, v))
 		return;
-	mElectricBoardAlarm = v;
-	emit electricBoardAlarmChanged();
+	emit alarmsChanged();
 }
 
 int BatteryController::batteryTemperatureSensorAlarm() const
 {
-	return mBatteryTemperatureSensorAlarm;
+	return mBank->alarm(BatteryBank::BatteryTemperatureSensorAlarm, mSlot);
 }
 
 void BatteryController::setBatteryTemperatureSensorAlarm(int v)
 {
-	if (mBatteryTemperatureSensorAlarm == v)
+	if (!mBank->setAlarm(BatteryBank::BatteryTemperatureSensorAlarm, mSlot, v))
 		return;
-	mBatteryTemperatureSensorAlarm = v;
-	emit batteryTemperatureSensorAlarmChanged();
+	emit alarmsChanged();
 }
 
 int BatteryController::airTemperatureSensorAlarm() const
 {
-	return mAirTemperatureSensorAlarm;
+	return mBank->alarm(BatteryBank::AirTemperatureSensorAlarm, mSlot);
 }
 
 void BatteryController::setAirTemperatureSensorAlarm(int v)
 {
-	if (mAirTemperatureSensorAlarm == v)
+	if (!mBank->setAlarm(BatteryBank::AirTemperatureSensorAlarm, mSlot, v))
 		return;
-	mAirTemperatureSensorAlarm = v;
-	emit airTemperatureSensorAlarmChanged();
+	emit alarmsChanged();
 }
 
 int BatteryController::stateOfHealthAlarm() const
 {
-	return mStateOfHealthAlarm;
+	return mBank->alarm(BatteryBank::StateOfHealthAlarm, mSlot);
 }
 
 void BatteryController::setStateOfHealthAlarm(int v)
 {
-	if (mStateOfHealthAlarm == v)
+	if (!mBank->setAlarm(BatteryBank::StateOfHealthAlarm, mSlot, v))
 		return;
-	mStateOfHealthAlarm = v;
-	emit stateOfHealthAlarmChanged();
+	emit alarmsChanged();
 }
 
 int BatteryController::leak1TripAlarm() const
 {
-	return mLeak1TripAlarm;
+	return mBank->alarm(BatteryBank::Leak1TripAlarm, mSlot);
 }
 
 void BatteryController::setLeak1TripAlarm(int v)
 {
-	if (mLeak1TripAlarm == v)
+	if (!mBank->setAlarm(BatteryBank::Leak1TripAlarm, mSlot, v))
 		return;
-	mLeak1TripAlarm = v;
-	emit leak1TripAlarmChanged();
+	emit alarmsChanged();
 }
 
 int BatteryController::leak2TripAlarm() const
 {
-	return mLeak2TripAlarm;
+	return mBank->alarm(BatteryBank::Leak2TripAlarm, mSlot);
 }
 
 void BatteryController::setLeak2TripAlarm(int v)
 {
-	if (mLeak2TripAlarm == v)
+	if (!mBank->setAlarm(BatteryBank::Leak2TripAlarm, mSlot, v))
 		return;
-	mLeak2TripAlarm = v;
-	emit leak2TripAlarmChanged();
+	emit alarmsChanged();
 }
 
 int BatteryController::unknownAlarm() const
 {
-	return mUnknownAlarm;
+	return mBank->alarm(BatteryBank::UnknownAlarm, mSlot);
 }
 
 void BatteryController::setUnknownAlarm(int v)
 {
-	if (mUnknownAlarm == v)
+	if (!mBank->setAlarm(BatteryBank::UnknownAlarm, mSlot, v))
 		return;
-	mUnknownAlarm = v;
-	emit unknownAlarmChanged();
+	emit alarmsChanged();
+}
+
+void BatteryController::updateAlarms()
+{
+	if (mBank->updateAlarms(mSlot))
+		emit alarmsChanged();
 }
@@ -3,6 +3,7 @@
 
 #include <QMetaType>
 #include <QObject>
+#include "battery_bank.h"
 #include "defines.h"
 
 enum ConnectionState {
@@ -14,6 +15,11 @@ enum ConnectionState {
 
 Q_DECLARE_METATYPE(ConnectionState)
 
+/*!
+ * Values of a single battery. The measurements and status registers are
+ * stored in a slot of a `BatteryBank`. This class adds the properties and
+ * change notifications used to publish them on the D-Bus.
+ */
 class BatteryController : public QObject
 {
 	Q_OBJECT
@@ -38,24 +44,28 @@ class BatteryController : public QObject
 	Q_PROPERTY(int ClearStatusRegisterFlags READ ClearStatusRegisterFlags WRITE setClearStatusRegisterFlags NOTIFY clearStatusRegisterFlagsChanged)
 	Q_PROPERTY(int RequestDelayedSelfMaintenance READ RequestDelayedSelfMaintenance WRITE setRequestDelayedSelfMaintenance NOTIFY requestDelayedSelfMaintenanceChanged)
 	Q_PROPERTY(int RequestImmediateSelfMaintenance READ RequestImmediateSelfMaintenance WRITE setRequestImmediateSelfMaintenance NOTIFY requestImmediateSelfMaintenanceChanged)
-
-	Q_PROPERTY(int hasAlarm READ hasAlarm WRITE setHasAlarm NOTIFY hasAlarmChanged)
-	Q_PROPERTY(int maintenanceAlarm READ maintenanceAlarm WRITE setMaintenanceAlarm NOTIFY maintenanceAlarmChanged)
-	Q_PROPERTY(int maintenanceActiveAlarm READ maintenanceActiveAlarm WRITE setMaintenanceActiveAlarm NOTIFY maintenanceActiveAlarmChanged)
-	Q_PROPERTY(int overCurrentAlarm READ overCurrentAlarm WRITE setOverCurrentAlarm NOTIFY overCurrentAlarmChanged)
-	Q_PROPERTY(int overVoltageAlarm READ overVoltageAlarm WRITE setOverVoltageAlarm NOTIFY overVoltageAlarmChanged)
-	Q_PROPERTY(int batteryTemperatureAlarm READ batteryTemperatureAlarm WRITE setBatteryTemperatureAlarm NOTIFY batteryTemperatureAlarmChanged)
-	Q_PROPERTY(int zincPumpAlarm READ zincPumpAlarm WRITE setZincPumpAlarm NOTIFY zincPumpAlarmChanged)
-	Q_PROPERTY(int bromidePumpAlarm READ bromidePumpAlarm WRITE setBromidePumpAlarm NOTIFY bromidePumpAlarmChanged)
-	Q_PROPERTY(int leakSensorsAlarm READ leakSensorsAlarm WRITE setLeakSensorsAlarm NOTIFY leakSensorsAlarmChanged)
-	Q_PROPERTY(int internalFailureAlarm READ internalFailureAlarm WRITE setInternalFailureAlarm NOTIFY internalFailureAlarmChanged)
-	Q_PROPERTY(int electricBoardAlarm READ electricBoardAlarm WRITE setElectricBoardAlarm NOTIFY electricBoardAlarmChanged)
-	Q_PROPERTY(int batteryTemperatureSensorAlarm READ batteryTemperatureSensorAlarm WRITE setBatteryTemperatureSensorAlarm NOTIFY batteryTemperatureSensorAlarmChanged)
-	Q_PROPERTY(int airTemperatureSensorAlarm READ airTemperatureSensorAlarm WRITE setAirTemperatureSensorAlarm NOTIFY airTemperatureSensorAlarmChanged)
-	Q_PROPERTY(int stateOfHealthAlarm READ stateOfHealthAlarm WRITE setStateOfHealthAlarm)
-	Q_PROPERTY(int leak1TripAlarm READ leak1TripAlarm WRITE setLeak1TripAlarm)
-	Q_PROPERTY(int leak2TripAlarm READ leak2TripAlarm WRITE setLeak2TripAlarm)
-	Q_PROPERTY(int unknownAlarm READ unknownAlarm WRITE setUnknownAlarm)
+	Q_PROPERTY(int StsRegSummary READ StsRegSummary WRITE setStsRegSummary NOTIFY stsRegSummaryChanged)
+	Q_PROPERTY(int StsRegHardwareFailure READ StsRegHardwareFailure WRITE setStsRegHardwareFailure NOTIFY stsRegHardwareFailureChanged)
+	Q_PROPERTY(int StsRegOperationalFailure READ StsRegOperationalFailure WRITE setStsRegOperationalFailure NOTIFY stsRegOperationalFailureChanged)
+	Q_PROPERTY(int StsRegWarning READ StsRegWarning WRITE setStsRegWarning NOTIFY stsRegWarningChanged)
+
+	Q_PROPERTY(int hasAlarm READ hasAlarm WRITE setHasAlarm NOTIFY alarmsChanged)
+	Q_PROPERTY(int maintenanceAlarm READ maintenanceAlarm WRITE setMaintenanceAlarm NOTIFY alarmsChanged)
+	Q_PROPERTY(int maintenanceActiveAlarm READ maintenanceActiveAlarm WRITE setMaintenanceActiveAlarm NOTIFY alarmsChanged)
+	Q_PROPERTY(int overCurrentAlarm READ overCurrentAlarm WRITE setOverCurrentAlarm NOTIFY alarmsChanged)
+	Q_PROPERTY(int overVoltageAlarm READ overVoltageAlarm WRITE setOverVoltageAlarm NOTIFY alarmsChanged)
+	Q_PROPERTY(int batteryTemperatureAlarm READ batteryTemperatureAlarm WRITE setBatteryTemperatureAlarm NOTIFY alarmsChanged)
+	Q_PROPERTY(int zincPumpAlarm READ zincPumpAlarm WRITE setZincPumpAlarm NOTIFY alarmsChanged)
+	Q_PROPERTY(int bromidePumpAlarm READ bromidePumpAlarm WRITE setBromidePumpAlarm NOTIFY alarmsChanged)
+	Q_PROPERTY(int leakSensorsAlarm READ leakSensorsAlarm WRITE setLeakSensorsAlarm NOTIFY alarmsChanged)
+	Q_PROPERTY(int internalFailureAlarm READ internalFailureAlarm WRITE setInternalFailureAlarm NOTIFY alarmsChanged)
+	Q_PROPERTY(int electricBoardAlarm READ electricBoardAlarm WRITE setElectricBoardAlarm NOTIFY alarmsChanged)
+	Q_PROPERTY(int batteryTemperatureSensorAlarm READ batteryTemperatureSensorAlarm WRITE setBatteryTemperatureSensorAlarm NOTIFY alarmsChanged)
+	Q_PROPERTY(int airTemperatureSensorAlarm READ airTemperatureSensorAlarm WRITE setAirTemperatureSensorAlarm NOTIFY alarmsChanged)
+	Q_PROPERTY(int stateOfHealthAlarm READ stateOfHealthAlarm WRITE setStateOfHealthAlarm NOTIFY alarmsChanged)
+	Q_PROPERTY(int leak1TripAlarm READ leak1TripAlarm WRITE setLeak1TripAlarm NOTIFY alarmsChanged)
+	Q_PROPERTY(int leak2TripAlarm READ leak2TripAlarm WRITE setLeak2TripAlarm NOTIFY alarmsChanged)
+	Q_PROPERTY(int unknownAlarm READ unknownAlarm WRITE setUnknownAlarm NOTIFY alarmsChanged)
 
 signals:
 	void battAmpsChanged();
@@ -79,25 +89,14 @@ signals:
 	void requestDelayedSelfMaintenanceChanged();
 	void requestImmediateSelfMaintenanceChanged();
 
-	void hasAlarmChanged();
-	void maintenanceAlarmChanged();
-	void maintenanceActiveAlarmChanged();
-	void overCurrentAlarmChanged();
-	void overVoltageAlarmChanged();
-	void batteryTemperatureAlarmChanged();
-	void zincPumpAlarmChanged();
-	void bromidePumpAlarmChanged();
-	void leakSensorsAlarmChanged();
-	void internalFailureAlarmChanged();
-	void electricBoardAlarmChanged();
-	void batteryTemperatureSensorAlarmChanged();
-	void airTemperatureSensorAlarmChanged();
-	void stateOfHealthAlarmChanged();
-	void leak1TripAlarmChanged();
-	void leak2TripAlarmChanged();
-	void unknownAlarmChanged();
+	/// Emitted when any of the alarms has changed.
+	void alarmsChanged();
 public:
-	BatteryController(const QString &portName, int deviceAddress, QObject *parent = 0);
+	/// Allocates a slot in `bank`, which must outlive this object.
+	BatteryController(BatteryBank *bank, const QString &portName, int deviceAddress,
+					  QObject *parent = 0);
+
+	virtual ~BatteryController();
 
 	ConnectionState connectionState() const;
 
@@ -159,6 +158,14 @@ public:
 	void setRequestDelayedSelfMaintenance(int t);
 	int RequestImmediateSelfMaintenance() const;
 	void setRequestImmediateSelfMaintenance(int t);
+	int StsRegSummary() const;
+	void setStsRegSummary(int v);
+	int StsRegHardwareFailure() const;
+	void setStsRegHardwareFailure(int v);
+	int StsRegOperationalFailure() const;
+	void setStsRegOperationalFailure(int v);
+	int StsRegWarning() const;
+	void setStsRegWarning(int v);
 
 	int hasAlarm() const;
 	void setHasAlarm(int a);
@@ -195,11 +202,23 @@ public:
 	int unknownAlarm() const;
 	void setUnknownAlarm(int v);
 
+	/// Recomputes the alarms from the status registers.
+	void updateAlarms();
+
 	/*!
 	 * Returns the logical name of the communication port. (eg. /dev/ttyUSB1).
 	 */
 	QString portName() const;
 
+	/*!
+	 * Returns the time (µs, see `monotonicTime`) at which the value of the
+	 * register with the given index in `ZbmRegisters` was received from the
+	 * device, or -1 if the value has not been received yet.
+	 */
+	qint64 sampleTime(int index) const;
+
+	void setSampleTime(int index, qint64 t);
+
 signals:
 	void connectionStateChanged();
 
@@ -212,47 +231,12 @@ signals:
 	void errorCodeChanged();
 
 private:
+	BatteryBank *mBank;
+	int mSlot;
 	ConnectionState mConnectionState;
-	int mDeviceType;
 	QString mFirmwareVersion;
 	QString mPortName;
 	QString mSerial;
-	double mBattVolts;
-	double mBusVolts;
-	double mBattAmps;
-	double mBattTemp;
-	double mAirTemp;
-	double mSOC;
-	int mStsRegSummary;
-	int mStsRegHardwareFailure;
-	int mStsRegOperationalFailure;
-	int mStsRegWarning;
-	int mOperationalMode;
-	double mSOCAmpHrs;
-	double mHealthIndication;
-	int mState;
-	int mDeviceAddress;
-	int mClearStatusRegisterFlags;
-	int mRequestDelayedSelfMaintenance;
-	int mRequestImmediateSelfMaintenance;
-
-	int mHasAlarm;
-	int mMaintenanceAlarm;
-	int mMaintenanceActiveAlarm;
-	int mOverCurrentAlarm;
-	int mOverVoltageAlarm;
-	int mBatteryTemperatureAlarm;
-	int mZincPumpAlarm;
-	int mBromidePumpAlarm;
-	int mLeakSensorsAlarm;
-	int mInternalFailureAlarm;
-	int mElectricBoardAlarm;
-	int mBatteryTemperatureSensorAlarm;
-	int mAirTemperatureSensorAlarm;
-	int mStateOfHealthAlarm;
-	int mLeak1TripAlarm;
-	int mLeak2TripAlarm;
-	int mUnknownAlarm;
 };
 
 #endif // BATTERY_CONTROLLER_H
@@ -7,6 +7,7 @@
 #include "battery_controller_bridge.h"
 #include "battery_controller_updater.h"
 #include "version.h"
+#include "zbm_registers.h"
 
 BatteryControllerBridge::BatteryControllerBridge(BatteryController *BatteryController,
 							   QObject *parent) :
@@ -36,6 +37,7 @@ BatteryControllerBridge::BatteryControllerBridge(BatteryController *BatteryContr
 	produce("/Serial", BatteryController->serial());
 
 	produceBatteryInfo(BatteryController, "");
+	produceAge("/Dc/0/Age", "/Dc/0/Current", "/Diagnostics/Age");
 
 	registerService();
 }
@@ -56,21 +58,17 @@ bool BatteryControllerBridge::toDBus(const QString &path, QVariant &value)
 
 void BatteryControllerBridge::produceBatteryInfo(BatteryController *bc, const QString &path)
 {
-	produce(bc, "BattAmps", path + "/Dc/0/Current", "A", 1);
-	produce(bc, "BattVolts", path + "/Dc/0/Voltage", "V", 1);
+	for (int i=0; i<ZbmRegisterCount; ++i) {
+		const RegisterDescriptor &d = ZbmRegisters[i];
+		if (d.path != 0) {
+			produce(bc, d.property, path + d.path, d.unit, d.precision);
+			mSampleRegisters[path + d.path].append(i);
+		}
+	}
 	produce(bc, "BattPower", path + "/Dc/0/Power", "W", 1);
-	produce(bc, "BattTemp", path + "/Dc/0/Temperature", "C", 1);
-	produce(bc, "SOC", path + "/Soc", "%", 1);
-
-	produce(bc, "operationalMode", path + "/OperationalMode", "", 0);
-	produce(bc, "SOCAmpHrs", path + "/ConsumedAmphours", "Ah", 0 );
-	produce(bc, "AirTemp", path + "/AirTemperature", "C", 0);
-	// According to Redflow, the state of health indicator is not reliable yet.
-	// We don't use the generic name /Soh in order to prevent the value to
-	// appear in the Gui (PageBatter.qml).
-	produce(bc, "HealthIndication", path + "/SohExperimental", "%", 0);
-	produce(bc, "BusVolts", path + "/BusVoltage", "V", 0);
-	produce(bc, "State", path + "/State", "", 0);
+	mSampleRegisters[path + "/Dc/0/Power"]
+			<< zbmRegisterIndex(RegBatteryVoltage)
+			<< zbmRegisterIndex(RegBatteryCurrent);
 	produce(bc, "DeviceAddress", path + "/DeviceAddress", "", 0);
 	produce(bc, "ClearStatusRegisterFlags", path + "/ClearStatusRegisterFlags", "", 0);
 	produce(bc, "RequestDelayedSelfMaintenance", path + "/RequestDelayedSelfMaintenance", "", 0);
@@ -107,3 +105,17 @@ bool BatteryControllerBridge::fromDBus(const QString &path, QVariant &value)
 	// to the QT properties.
 	return true;
 }
+
+qint64 BatteryControllerBridge::sampleTime(const QString &path) const
+{
+	// Values computed from multiple registers are as old as the oldest one.
+	qint64 t = -1;
+	foreach (int i, mSampleRegisters.value(path)) {
+		qint64 s = mBatteryController->sampleTime(i);
+		if (s < 0)
+			return -1;
+		if (t < 0 || s < t)
+			t = s;
+	}
+	return t;
+}
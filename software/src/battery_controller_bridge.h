@@ -1,6 +1,8 @@
 #ifndef BATTERY_CONTROLLER_BRIDGE_H
 #define BATTERY_CONTROLLER_BRIDGE_H
 
+#include <QHash>
+#include <QList>
 #include <QPointer>
 #include <QString>
 #include "dbus_bridge.h"
@@ -28,8 +30,13 @@ protected:
 
 	virtual bool fromDBus(const QString &path, QVariant &value);
 
+	virtual qint64 sampleTime(const QString &path) const;
+
 private:
 	BatteryController *mBatteryController;
+	// Indices (in `ZbmRegisters`) of the registers each published value is
+	// computed from.
+	QHash<QString, QList<int> > mSampleRegisters;
 };
 
 #endif // BATTERY_CONTROLLER_BRIDGE_H
@@ -0,0 +1,128 @@
+#include <QsLog.h>
+#include "battery_controller_link.h"
+#include "battery_controller_updater.h"
+
+BatteryControllerLink::BatteryControllerLink(BatteryController *controller,
+											 BatteryControllerUpdater *updater,
+											 QObject *parent):
+	QObject(parent),
+	mBatteryController(controller),
+	mUpdater(updater),
+	mUpdatingController(false)
+{
+	Q_ASSERT(controller != 0);
+	Q_ASSERT(updater != 0);
+	connect(updater, SIGNAL(serialChanged(QString)),
+			this, SLOT(onSerialChanged(QString)));
+	connect(updater, SIGNAL(firmwareVersionChanged(QString)),
+			this, SLOT(onFirmwareVersionChanged(QString)));
+	connect(updater, SIGNAL(connectionStateChanged(ConnectionState)),
+			this, SLOT(onConnectionStateChanged(ConnectionState)));
+	connect(updater, SIGNAL(valuesRead(RegisterValues)),
+			this, SLOT(onValuesRead(RegisterValues)));
+	connect(updater, SIGNAL(registerWritten(int)),
+			this, SLOT(onRegisterWritten(int)));
+	connect(controller, SIGNAL(clearStatusRegisterFlagsChanged()),
+			this, SLOT(onClearStatusRegisterFlagsChanged()));
+	connect(controller, SIGNAL(operationalModeChanged()),
+			this, SLOT(onOperationalModeChanged()));
+	connect(controller, SIGNAL(requestDelayedSelfMaintenanceChanged()),
+			this, SLOT(onRequestDelayedSelfMaintenanceChanged()));
+	connect(controller, SIGNAL(requestImmediateSelfMaintenanceChanged()),
+			this, SLOT(onRequestImmediateSelfMaintenanceChanged()));
+	connect(controller, SIGNAL(deviceAddressChanged()),
+			this, SLOT(onDeviceAddressChanged()));
+}
+
+void BatteryControllerLink::onSerialChanged(const QString &serial)
+{
+	mBatteryController->setSerial(serial);
+}
+
+void BatteryControllerLink::onFirmwareVersionChanged(const QString &version)
+{
+	mBatteryController->setFirmwareVersion(version);
+}
+
+void BatteryControllerLink::onConnectionStateChanged(ConnectionState state)
+{
+	mBatteryController->setConnectionState(state);
+}
+
+void BatteryControllerLink::onValuesRead(const RegisterValues &values)
+{
+	mUpdatingController = true;
+	for (int i=0; i<ZbmRegisterCount; ++i) {
+		if (values.valid[i]) {
+			// Set the sample time first, so it is available to the receivers
+			// of the property notifications.
+			mBatteryController->setSampleTime(i, values.timestamps[i]);
+			ZbmRegisters[i].store(mBatteryController, values.values[i]);
+		}
+	}
+	mUpdatingController = false;
+	updateAlarms();
+}
+
+void BatteryControllerLink::onRegisterWritten(int reg)
+{
+	switch (reg) {
+	case RegClearStatusFlags:
+		mBatteryController->setClearStatusRegisterFlags(0);
+		break;
+	case RegDelayedSelfMaintenance:
+		mBatteryController->setRequestDelayedSelfMaintenance(0);
+		break;
+	case RegImmediateSelfMaintenance:
+		mBatteryController->setRequestImmediateSelfMaintenance(0);
+		break;
+	default:
+		break;
+	}
+}
+
+void BatteryControllerLink::onClearStatusRegisterFlagsChanged()
+{
+	invokeUpdater("clearStatusFlags", mBatteryController->ClearStatusRegisterFlags());
+}
+
+void BatteryControllerLink::onOperationalModeChanged()
+{
+	if (mUpdatingController)
+		return;
+	invokeUpdater("setOperationalMode", mBatteryController->operationalMode());
+}
+
+void BatteryControllerLink::onRequestDelayedSelfMaintenanceChanged()
+{
+	invokeUpdater("requestDelayedSelfMaintenance",
+				  mBatteryController->RequestDelayedSelfMaintenance());
+}
+
+void BatteryControllerLink::onRequestImmediateSelfMaintenanceChanged()
+{
+	invokeUpdater("requestImmediateSelfMaintenance",
+				  mBatteryController->RequestImmediateSelfMaintenance());
+}
+
+void BatteryControllerLink::onDeviceAddressChanged()
+{
+	invokeUpdater("setDeviceAddress", mBatteryController->DeviceAddress());
+}
+
+void BatteryControllerLink::updateAlarms()
+{
+	QLOG_DEBUG() << "Device state:" << mBatteryController->DeviceAddress()
+				 << mBatteryController->StsRegSummary()
+				 << mBatteryController->StsRegHardwareFailure()
+				 << mBatteryController->StsRegOperationalFailure()
+				 << mBatteryController->StsRegWarning();
+	mBatteryController->updateAlarms();
+}
+
+void BatteryControllerLink::invokeUpdater(const char *method, int value)
+{
+	// The updater lives in another thread, so we cannot call it directly.
+	QMetaObject::invokeMethod(mUpdater, method, Qt::QueuedConnection,
+							  Q_ARG(int, value));
+}
@@ -0,0 +1,59 @@
+#ifndef BATTERY_CONTROLLER_LINK_H
+#define BATTERY_CONTROLLER_LINK_H
+
+#include <QObject>
+#include "battery_controller.h"
+#include "zbm_registers.h"
+
+class BatteryControllerUpdater;
+
+/*!
+ * @brief Connects a `BatteryController` to its `BatteryControllerUpdater`.
+ * The controller lives in the main thread, while the updater lives in the
+ * thread handling the serial port. Values retrieved by the updater arrive
+ * here as queued events, and are stored in the controller. Changes of the
+ * writable properties of the controller (eg. from the D-Bus) are passed to
+ * the updater.
+ *
+ * This object should be created in the main thread.
+ */
+class BatteryControllerLink : public QObject
+{
+	Q_OBJECT
+public:
+	BatteryControllerLink(BatteryController *controller,
+						  BatteryControllerUpdater *updater,
+						  QObject *parent = 0);
+
+private slots:
+	void onSerialChanged(const QString &serial);
+
+	void onFirmwareVersionChanged(const QString &version);
+
+	void onConnectionStateChanged(ConnectionState state);
+
+	void onValuesRead(const RegisterValues &values);
+
+	void onRegisterWritten(int reg);
+
+	void onClearStatusRegisterFlagsChanged();
+
+	void onOperationalModeChanged();
+
+	void onRequestDelayedSelfMaintenanceChanged();
+
+	void onRequestImmediateSelfMaintenanceChanged();
+
+	void onDeviceAddressChanged();
+
+private:
+	void updateAlarms();
+
+	void invokeUpdater(const char *method, int value);
+
+	BatteryController *mBatteryController;
+	BatteryControllerUpdater *mUpdater;
+	bool mUpdatingController;
+};
+
+#endif // BATTERY_CONTROLLER_LINK_H
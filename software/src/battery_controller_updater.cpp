@@ -1,127 +1,301 @@
 #include <QsLog.h>
 #include <QTimer>
-#include "battery_controller.h"
 #include "battery_controller_updater.h"
 #include "modbus_rtu.h"
+#include "zbm_registers.h"
 
 static const int MaxTimeoutCount = 5;
-static const int MeasurementWaitInterval = 5000;
-static const int DeviceReinitInterval = 10 * 1000;
-static const int ConnectionLostWaitInterval = 60 * 1000;  // 60 seconds in ms
-
-enum ModbusRegisters {
-	RegFirmwareVersion = 0x0003,
-	RegStatusSummary = 0x9001,
-	RegHardwareFailure = 0x9002,
-	RegOperationalFailure = 0x9003,
-	RegWarningIndicator = 0x9004,
-	RegOperationalMode = 0x9008,
-	RegSerial = 0x9010,
-	RegStateOfCharge = 0x9011,
-	RefAmpHours = 0x9012,
-	RegBatteryVoltage = 0x9013,
-	RegBatteryCurrent = 0x9014,
-	RegBatteryTemperature = 0x9015,
-	RegAirTemperature = 0x9016,
-	RegStateOfHealth = 0x9017,
-	RegBusVoltage = 0x9018,
-	RegBatteryState = 0x9019,
-	RegDeviceAddress = 0x9030,
-	RegClearStatusFlags = 0x9031,
-	RegDelayedSelfMaintenance = 0x9032,
-	RegEnterRunCommand = 0x9033,
-	RegImmediateSelfMaintenance = 0x9034
+// Poll intervals of the tiers defined in `PollTier`.
+static const int DefaultPollIntervals[PollTierCount] = {
+	1000,		// FastTier: current, voltage, state of charge
+	5000,		// StatusTier: status registers, operational mode
+	15000,		// SlowTier: temperatures
+	60000		// HealthTier: state of health
 };
+// Tiers which are due within this time (ms) are polled straight away.
+static const int PollSlack = 20;
+static const int DeviceReinitInterval = 10 * 1000;
+// Backoff after a timeout: the first retries are sent straight away, after
+// that the delay doubles with each timeout.
+static const int FastRetryCount = 2;
+static const int BackoffBaseDelay = 200;
+static const int MaxBackoffDelay = 5000;
+// Once the connection is lost, the device is probed at this interval.
+static const int QuarantineInterval = 10 * 1000;
+// Status flags read back after clearing them.
+static const quint16 StatusFlagCount = RegWarningIndicator - RegStatusSummary + 1;
+// Control registers which may be written in a single request.
+static const quint16 FirstControlRegister = RegClearStatusFlags;
+static const int ControlRegisterCount =
+	RegImmediateSelfMaintenance - FirstControlRegister + 1;
+// Allows the complete status block (0x9001..0x9019) to be retrieved in a
+// single request. The largest gap is between RegOperationalMode and
+// RegStateOfCharge.
+static const int DefaultGapTolerance = 8;
+// Used when the device does not accept reads which include unused registers.
+static const int SplitGapTolerance = 0;
 
-BatteryControllerUpdater::BatteryControllerUpdater(BatteryController *mBatteryController,
-												   ModbusRtu *modbus,
+BatteryControllerUpdater::BatteryControllerUpdater(int deviceAddress,
+												   BusScheduler *scheduler,
 												   QObject *parent):
 	QObject(parent),
-	mBatteryController(mBatteryController),
-	mDeviceAddress(mBatteryController->DeviceAddress()),
+	mDeviceAddress(deviceAddress),
 	mRegisterCount(0),
-	mUpdatingController(false),
+	mNewDeviceAddress(deviceAddress),
+	mOperationalMode(0),
+	mOperationalModePending(false),
+	mClearStatusFlags(0),
+	mDelayedSelfMaintenance(0),
+	mImmediateSelfMaintenance(0),
+	mValuesIndex(0),
+	mConnectionState(Disconnected),
+	mScheduler(scheduler),
 	mModbus(0),
+	mBusy(false),
 	mAcquisitionTimer(new QTimer(this)),
 	mTimeoutCount(0),
+	mRetryDelay(0),
+	mQuarantined(false),
 	mState(Init),
-	mTmpState(Wait)
-{
-	Q_ASSERT(mBatteryController != 0);
-	mModbus = modbus;
-	connect(mModbus, SIGNAL(readCompleted(int, quint8, const QList<quint16> &)),
-			this, SLOT(onReadCompleted(int, quint8, QList<quint16>)));
-	connect(mModbus, SIGNAL(writeCompleted(int, quint8, quint16, quint16)),
-			this, SLOT(onWriteCompleted(int, quint8, quint16, quint16)));
-	connect(mModbus, SIGNAL(errorReceived(int, quint8, int)),
-			this, SLOT(onErrorReceived(int, quint8, int)));
+	mTmpState(Wait),
+	mPlanner(DefaultGapTolerance),
+	mDueTiers(0),
+	mReadIndex(0),
+	mSplitReads(false),
+	mCombinedWrites(true),
+	mMultipleWrites(true),
+	mWriteReg(0),
+	mReadBackStart(0),
+	mVerifyOperationalMode(false),
+	mSkipOperationalMode(false)
+{
+	Q_ASSERT(scheduler != 0);
+	mModbus = scheduler->modbus();
 	connect(mAcquisitionTimer, SIGNAL(timeout()),
 			this, SLOT(onWaitFinished()));
-	connect(mBatteryController, SIGNAL(clearStatusRegisterFlagsChanged()),
-			this, SLOT(onClearStatusRegisterFlagsChanged()));
-	connect(mBatteryController, SIGNAL(operationalModeChanged()),
-			this, SLOT(onOperationalModeChanged()));
-	connect(mBatteryController, SIGNAL(requestDelayedSelfMaintenanceChanged()),
-			this, SLOT(onRequestDelayedSelfMaintenanceChanged()));
-	connect(mBatteryController, SIGNAL(requestImmediateSelfMaintenanceChanged()),
-			this, SLOT(onRequestImmediateSelfMaintenanceChanged()));
-	connect(mBatteryController, SIGNAL(deviceAddressChanged()),
-			this, SLOT(onDeviceAddressChanged()));
 	mAcquisitionTimer->setSingleShot(true);
-	mStopwatch.start();
+	for (int i=0; i<PollTierCount; ++i)
+		mPollIntervals[i] = DefaultPollIntervals[i];
+	for (int i=0; i<PlanCount; ++i)
+		mPlanned[i] = false;
+	for (int i=0; i<2; ++i) {
+		mValues[i].values.resize(ZbmRegisterCount);
+		mValues[i].valid.resize(ZbmRegisterCount);
+		mValues[i].timestamps.resize(ZbmRegisterCount);
+	}
+	mReadBack.values.resize(ZbmRegisterCount);
+	mReadBack.valid.resize(ZbmRegisterCount);
+	mReadBack.timestamps.resize(ZbmRegisterCount);
+}
+
+BatteryControllerUpdater::~BatteryControllerUpdater()
+{
+	mScheduler->removeClient(this);
+	mModbus->removeListener(this);
+}
+
+int BatteryControllerUpdater::deviceAddress() const
+{
+	return mDeviceAddress;
+}
+
+void BatteryControllerUpdater::start()
+{
+	schedulePoll(true);
+	mScheduler->addClient(this);
 	startNextAction();
 }
 
-void BatteryControllerUpdater::onErrorReceived(int errorType, quint8 slaveAddress,
-											   int exception)
+int BatteryControllerUpdater::gapTolerance() const
+{
+	return mPlanner.gapTolerance();
+}
+
+void BatteryControllerUpdater::setGapTolerance(int t)
 {
-	if (slaveAddress != mDeviceAddress)
+	if (mPlanner.gapTolerance() == t)
 		return;
-	QLOG_DEBUG() << "ModBus Error:" << errorType << exception
-				 << "State:" << mState << "Slave Address" << slaveAddress
-				 << "Timeout count:" << mTimeoutCount;
-	if (errorType == ModbusRtu::Timeout) {
-		if (mTimeoutCount == MaxTimeoutCount) {
-			if (!mBatteryController->serial().isEmpty()) {
-				QLOG_ERROR() << "Lost connection to battery controller";
-			}
-			mState = WaitOnConnectionLost;
-			mTimeoutCount = MaxTimeoutCount - 1;
-			mBatteryController->setSerial(QString());
-			mBatteryController->setConnectionState(Disconnected);
-		} else {
-			++mTimeoutCount;
-		}
-	}
-	startNextAction();
+	mPlanner.setGapTolerance(t);
+	planReads();
+}
+
+int BatteryControllerUpdater::defaultGapTolerance()
+{
+	return DefaultGapTolerance;
+}
+
+int BatteryControllerUpdater::pollInterval(PollTier tier) const
+{
+	return mPollIntervals[tier];
+}
+
+void BatteryControllerUpdater::setPollInterval(PollTier tier, int interval)
+{
+	mPollIntervals[tier] = interval;
+}
+
+int BatteryControllerUpdater::defaultPollInterval(PollTier tier)
+{
+	return DefaultPollIntervals[tier];
 }
 
-static bool isBitSet(quint16 value, int bit)
+int BatteryControllerUpdater::msecsUntilDue() const
 {
-	return (value & (1 << bit)) != 0;
+	if (mBusy)
+		return NotDue;
+	switch (mState) {
+	case Wait:
+		return msecsUntilNextPoll();
+	case WaitOnDeviceReinit:
+		return NotDue;
+	default:
+		return mRetryDelay - static_cast<int>(mReadySince.elapsed());
+	}
 }
 
-static int getErrorState(quint16 errorValue, int bit)
+ModbusRtu::Priority BatteryControllerUpdater::priority() const
 {
-	return isBitSet(errorValue, bit) ? 2 : 0;
+	switch (mState) {
+	case Serial:
+		// Probing a device which has disappeared should not delay others.
+		// Requests with ScanPriority also use the short probe timeout, and
+		// their timeouts do not inflate the round trip statistics.
+		return mQuarantined ? ModbusRtu::ScanPriority : ModbusRtu::IdentityPriority;
+	case FirmwareVersion:
+		return ModbusRtu::IdentityPriority;
+	case Wait:
+	case Poll:
+		return ModbusRtu::PollPriority;
+	default:
+		return ModbusRtu::WritePriority;
+	}
 }
 
-static int getWarningState(quint16 errorValue, int bit)
+bool BatteryControllerUpdater::startRequest()
 {
-	return isBitSet(errorValue, bit) ? 1 : 0;
+	switch (mState) {
+	case Serial:
+		readRegisters(RegSerial, 1);
+		break;
+	case FirmwareVersion:
+		readRegisters(RegFirmwareVersion, 2);
+		break;
+	case Wait:
+		schedulePoll(false);
+		if (mReads.isEmpty())
+			return false;
+		mState = Poll;
+		// Fall through
+	case Poll:
+	{
+		const RegisterRange &read = mReads.at(mReadIndex).range;
+		readRegisters(read.start, read.count);
+		break;
+	}
+	case SetAddress:
+		QLOG_INFO() << "Changing device address from" << mDeviceAddress
+					<< "to" << mNewDeviceAddress;
+		writeRegister(RegDeviceAddress, mNewDeviceAddress);
+		break;
+	case ClearStatus:
+		if (writeControlBlock())
+			break;
+		if (mCombinedWrites) {
+			// Publish the cleared flags right away, instead of waiting for the
+			// next poll.
+			writeReadRegisters(RegClearStatusFlags, mClearStatusFlags,
+							   RegStatusSummary, StatusFlagCount);
+		} else {
+			writeRegister(RegClearStatusFlags, mClearStatusFlags);
+		}
+		break;
+	case SetOperationalMode:
+		if (!writeControlBlock())
+			writeRegister(RegEnterRunCommand, mOperationalMode);
+		break;
+	case RequestDelayedMaintenance:
+		if (!writeControlBlock())
+			writeRegister(RegDelayedSelfMaintenance, mDelayedSelfMaintenance);
+		break;
+	case RequestImmediateMaintenance:
+		if (!writeControlBlock())
+			writeRegister(RegImmediateSelfMaintenance, mImmediateSelfMaintenance);
+		break;
+	default:
+		return false;
+	}
+	return true;
 }
 
-static int getAlarmState(quint16 errorValue, quint16 warningValue, int bit)
+void BatteryControllerUpdater::onErrorReceived(const ModbusRequest &request,
+											   int errorType, int exception)
 {
-	return isBitSet(errorValue, bit) ? 2 : (isBitSet(warningValue, bit) ? 1 : 0);
+	mBusy = false;
+	QLOG_DEBUG() << "ModBus Error:" << errorType << exception
+				 << "State:" << mState << "Slave Address" << request.slaveAddress
+				 << "Timeout count:" << mTimeoutCount;
+	if (errorType == ModbusRtu::Exception &&
+		exception == ModbusRtu::IllegalDataAddress &&
+		mState == Poll && !mSplitReads) {
+		// Older firmware may reject reads spanning registers it does not
+		// know about. Fall back to reading each block separately.
+		QLOG_WARN() << "Combined read rejected by device" << mDeviceAddress
+					<< "falling back to separate reads";
+		mSplitReads = true;
+		planReads();
+	} else if (errorType == ModbusRtu::Exception &&
+			   exception == ModbusRtu::IllegalFunction &&
+			   request.function == ModbusRtu::ReadWriteMultipleRegisters) {
+		QLOG_WARN() << "Combined write rejected by device" << mDeviceAddress
+					<< "falling back to single register writes";
+		mCombinedWrites = false;
+	} else if (errorType == ModbusRtu::Exception &&
+			   exception == ModbusRtu::IllegalFunction &&
+			   request.function == ModbusRtu::WriteMultipleRegisters) {
+		QLOG_WARN() << "Multiple register write rejected by device"
+					<< mDeviceAddress << "falling back to single register writes";
+		mMultipleWrites = false;
+	} else if (errorType == ModbusRtu::Timeout) {
+		if (mQuarantined) {
+			mRetryDelay = addJitter(QuarantineInterval);
+		} else if (mTimeoutCount == MaxTimeoutCount) {
+			if (!mSerial.isEmpty()) {
+				QLOG_ERROR() << "Lost connection to battery controller";
+			}
+			// Keep probing the device with a low duty cycle. Pending writes
+			// are dropped.
+			mQuarantined = true;
+			mState = Init;
+			mTmpState = Wait;
+			dropPendingWrites();
+			mRetryDelay = addJitter(QuarantineInterval);
+			setSerial(QString());
+			setConnectionState(Disconnected);
+		} else {
+			++mTimeoutCount;
+			mRetryDelay = backoffDelay(mTimeoutCount);
+		}
+	}
+	startNextAction();
 }
 
-void BatteryControllerUpdater::onReadCompleted(int function, quint8 slaveAddress,
-											   const QList<quint16> &registers)
+void BatteryControllerUpdater::onReadCompleted(const ModbusRequest &request,
+											   const RegisterView &registers)
 {
-	Q_UNUSED(function)
-	if (slaveAddress != mDeviceAddress)
+	mBusy = false;
+	if (request.function == ModbusRtu::ReadWriteMultipleRegisters) {
+		// The write has succeeded, otherwise we would have received an
+		// exception.
+		if (mRegisterCount == registers.size()) {
+			publishReadBack(request, registers);
+		} else {
+			QLOG_ERROR() << "Device" << request.slaveAddress << "returned"
+						 << registers.size() << "registers instead of"
+						 << mRegisterCount << "after write";
+		}
+		onWriteCompleted(request, mWriteReg, 1);
 		return;
+	}
 	if (mRegisterCount == registers.size()) {
 		switch (mState) {
 		case Serial:
@@ -129,8 +303,14 @@ void BatteryControllerUpdater::onReadCompleted(int function, quint8 slaveAddress
 			QString serial = QString::number(registers[0]);
 			QLOG_INFO() << "Serial number:" << serial;
 			mState = FirmwareVersion;
-			mBatteryController->setSerial(serial);
-			mBatteryController->setConnectionState(Detected);
+			// Give combined reads another chance, the firmware may have been
+			// updated.
+			mSplitReads = false;
+			mCombinedWrites = true;
+			mMultipleWrites = true;
+			planReads();
+			setSerial(serial);
+			setConnectionState(Detected);
 			break;
 		}
 		case FirmwareVersion:
@@ -141,122 +321,93 @@ void BatteryControllerUpdater::onReadCompleted(int function, quint8 slaveAddress
 					arg(registers[0] / 100, 2, 10, QChar('0')).
 					arg(registers[0] % 100, 2, 10, QChar('0')).
 					arg(registers[1], 2, 10, QChar('0'));
-			mBatteryController->setFirmwareVersion(fwVersion);
-			// mBatteryController->setFirmwareVersion((registers[0] << 16) | registers[1]);
+			emit firmwareVersionChanged(fwVersion);
+			schedulePoll(true);
 			mState = Start;
 			break;
 		}
-		case DeviceState:
+		case Poll:
 		{
-			quint16 summary = registers[0];
-			quint16 hwFailure = registers[1];
-			quint16 opFailure = registers[2];
-			quint16 warning = registers[3];
-			QLOG_DEBUG() << "Device state:" << mDeviceAddress << summary << hwFailure << opFailure << warning;
-			mBatteryController->setHasAlarm(((summary & 0xE000) == 0) ? 0 : 1);
-			mBatteryController->setMaintenanceAlarm(getWarningState(warning, 11));
-			mBatteryController->setMaintenanceActiveAlarm(getWarningState(warning, 10));
-			mBatteryController->setOverCurrentAlarm(getAlarmState(opFailure, warning, 15));
-			mBatteryController->setOverVoltageAlarm(getAlarmState(opFailure, warning, 14));
-			mBatteryController->setBatteryTemperatureAlarm(getAlarmState(opFailure, warning, 13));
-			mBatteryController->setZincPumpAlarm(getErrorState(hwFailure, 15));
-			mBatteryController->setBromidePumpAlarm(getErrorState(hwFailure, 14));
-			mBatteryController->setLeakSensorsAlarm(getErrorState(hwFailure, 11));
-			mBatteryController->setInternalFailureAlarm(getErrorState(hwFailure, 9));
-			mBatteryController->setElectricBoardAlarm(getErrorState(hwFailure, 8));
-			mBatteryController->setBatteryTemperatureSensorAlarm(getErrorState(hwFailure, 7));
-			mBatteryController->setAirTemperatureSensorAlarm(getErrorState(hwFailure, 6));
-			mBatteryController->setStateOfHealthAlarm(getErrorState(hwFailure, 5));
-			mBatteryController->setLeak1TripAlarm(getErrorState(hwFailure, 4));
-			mBatteryController->setLeak2TripAlarm(getErrorState(hwFailure, 3));
-			mBatteryController->setUnknownAlarm(getAlarmState(hwFailure | opFailure, warning, 0));
-			mState = Measurements;
+			const PlannedRead &read = mReads.at(mReadIndex);
+			RegisterValues &values = mValues[mValuesIndex];
+			for (int i=read.firstRegister; i<read.lastRegister; ++i) {
+				const RegisterDescriptor &d = ZbmRegisters[i];
+				if (d.address == RegOperationalMode && mSkipOperationalMode)
+					continue;
+				values.values[i] = d.decode(registers[d.address - read.range.start]);
+				values.valid[i] = true;
+				values.timestamps[i] = request.completed;
+				if (d.address == RegOperationalMode && mVerifyOperationalMode)
+					verifyOperationalMode(static_cast<int>(values.values[i]));
+			}
+			++mReadIndex;
+			if (mReadIndex >= mReads.size()) {
+				mReadIndex = 0;
+				mSkipOperationalMode = false;
+				emit valuesRead(values);
+				mValuesIndex = 1 - mValuesIndex;
+				mValues[mValuesIndex].valid.fill(false);
+				setConnectionState(Connected);
+				mState = Wait;
+			}
 			break;
 		}
-		case Measurements:
-			mBatteryController->setSOC(registers[0] / 100.0);
-			mBatteryController->setSOCAmpHrs(-static_cast<qint16>(registers[1]) / 10.0);
-			mBatteryController->setBattVolts(registers[2] / 10.0);
-			mBatteryController->setBattAmps(-static_cast<qint16>(registers[3]) / 10.0);
-			mBatteryController->setBattTemp(static_cast<qint16>(registers[4]) / 10.0);
-			mBatteryController->setAirTemp(static_cast<qint16>(registers[5]) / 10.0);
-			mState = OperationalMode;
-			break;
-		case OperationalMode:
-			mUpdatingController = true;
-			mBatteryController->setOperationalMode(registers[0]);
-			mUpdatingController = false;
-			mState = Health;
-			break;
-		case Health:
-			mBatteryController->setHealthIndication(registers[0]);
-			mBatteryController->setBusVolts(registers[1] / 10.0);
-			mBatteryController->setState(registers[2]);
-			mBatteryController->setConnectionState(Connected);
-			mState = Wait;
-			break;
 		case Wait:
-			mState = DeviceState;
+			mState = Start;
 			break;
 		default:
 			QLOG_ERROR() << "Unknown updater state" << mState;
-			mState = mBatteryController->serial().isEmpty() ? Init : Start;
+			mState = mSerial.isEmpty() ? Init : Start;
 			break;
 		}
 	} else {
-		QLOG_DEBUG() << __func__ << "Incorrect number of registers" << slaveAddress << mRegisterCount;
+		QLOG_ERROR() << "Device" << request.slaveAddress << "returned"
+					 << registers.size() << "registers instead of"
+					 << mRegisterCount;
 	}
-	mTimeoutCount = 0;
+	resetBackoff();
 	startNextAction();
 }
 
-void BatteryControllerUpdater::onWriteCompleted(int function, quint8 slaveAddress,
+void BatteryControllerUpdater::onWriteCompleted(const ModbusRequest &request,
 												quint16 address, quint16 value)
 {
-	Q_UNUSED(function)
-	Q_UNUSED(address)
-	Q_UNUSED(value)
-	if (slaveAddress != mDeviceAddress)
-		return;
-	switch (mState) {
-	case SetAddress:
-		mTmpState = WaitOnDeviceReinit;
-		break;
-	case ClearStatus:
-		mBatteryController->setClearStatusRegisterFlags(0);
-		break;
-	case SetOperationalMode:
-		// This is a workaround: the ZBM takes some time to change the
-		// operational mode. By setting the mode to wait, we ensure that the
-		// operational mode will not be retrieved for 5 seconds, preventing the
-		// displayed to switch back temporarily to the previous value.
-		mStopwatch.start();
-		mTmpState = Wait;
-		break;
-	case RequestDelayedMaintenance:
-		mBatteryController->setRequestDelayedSelfMaintenance(0);
-		break;
-	case RequestImmediateMaintenance:
-		mBatteryController->setRequestImmediateSelfMaintenance(0);
-		break;
-	default:
-		mTmpState = DeviceState;
-		break;
+	mBusy = false;
+	if (request.function == ModbusRtu::WriteMultipleRegisters) {
+		// `value` contains the number of registers written.
+		onControlBlockWritten(address, value);
+	} else {
+		switch (mState) {
+		case SetAddress:
+			mTmpState = WaitOnDeviceReinit;
+			break;
+		case ClearStatus:
+			mClearStatusFlags = 0;
+			break;
+		case SetOperationalMode:
+			onOperationalModeWritten();
+			break;
+		case RequestDelayedMaintenance:
+			mDelayedSelfMaintenance = 0;
+			break;
+		case RequestImmediateMaintenance:
+			mImmediateSelfMaintenance = 0;
+			break;
+		default:
+			mTmpState = Start;
+			break;
+		}
+		emit registerWritten(address);
 	}
 	mState = mTmpState;
 	mTmpState = Wait;
-	mTimeoutCount = 0;
+	resetBackoff();
 	startNextAction();
 }
 
 void BatteryControllerUpdater::onWaitFinished()
 {
 	switch (mState) {
-	case Wait:
-		mStopwatch.start();
-		mState = Start;
-		break;
-	case WaitOnConnectionLost:
 	case WaitOnDeviceReinit:
 		mState = Init;
 		break;
@@ -267,35 +418,57 @@ void BatteryControllerUpdater::onWaitFinished()
 	startNextAction();
 }
 
-void BatteryControllerUpdater::onClearStatusRegisterFlagsChanged()
+void BatteryControllerUpdater::setOperationalMode(int mode)
 {
-	if (mBatteryController->ClearStatusRegisterFlags() != 0)
-		queueWriteAction(ClearStatus);
+	mOperationalMode = mode;
+	mOperationalModePending = true;
+	queueWriteAction(SetOperationalMode);
 }
 
-void BatteryControllerUpdater::onOperationalModeChanged()
+void BatteryControllerUpdater::clearStatusFlags(int flags)
 {
-	if (mUpdatingController)
+	if (flags == 0)
 		return;
-	queueWriteAction(SetOperationalMode);
+	mClearStatusFlags = flags;
+	queueWriteAction(ClearStatus);
 }
 
-void BatteryControllerUpdater::onRequestDelayedSelfMaintenanceChanged()
+void BatteryControllerUpdater::requestDelayedSelfMaintenance(int value)
 {
-	if (mBatteryController->RequestDelayedSelfMaintenance() != 0)
-		queueWriteAction(RequestDelayedMaintenance);
+	if (value == 0)
+		return;
+	mDelayedSelfMaintenance = value;
+	queueWriteAction(RequestDelayedMaintenance);
 }
 
-void BatteryControllerUpdater::onRequestImmediateSelfMaintenanceChanged()
+void BatteryControllerUpdater::requestImmediateSelfMaintenance(int value)
 {
-	if (mBatteryController->RequestImmediateSelfMaintenance())
-		queueWriteAction(RequestImmediateMaintenance);
+	if (value == 0)
+		return;
+	mImmediateSelfMaintenance = value;
+	queueWriteAction(RequestImmediateMaintenance);
 }
 
-void BatteryControllerUpdater::onDeviceAddressChanged()
+void BatteryControllerUpdater::setDeviceAddress(int address)
 {
-	if (mBatteryController->DeviceAddress() != mDeviceAddress)
-		queueWriteAction(SetAddress);
+	if (address == mDeviceAddress)
+		return;
+	mNewDeviceAddress = address;
+	queueWriteAction(SetAddress);
+}
+
+void BatteryControllerUpdater::onBroadcastWritten(int reg, int value)
+{
+	switch (reg) {
+	case RegEnterRunCommand:
+		mOperationalMode = value;
+		mVerifyOperationalMode = true;
+		// See SetOperationalMode in onWriteCompleted.
+		postponeTier(RegOperationalMode);
+		break;
+	default:
+		break;
+	}
 }
 
 void BatteryControllerUpdater::startNextAction()
@@ -308,63 +481,41 @@ void BatteryControllerUpdater::startNextAction()
 	}
 	switch (mState) {
 	case Serial:
-		mBatteryController->setConnectionState(Searched);
-		readRegisters(RegSerial, 1);
-		break;
-	case FirmwareVersion:
-		readRegisters(RegFirmwareVersion, 2);
+		// A device in quarantine remains disconnected until it replies.
+		if (!mQuarantined)
+			setConnectionState(Searched);
+		mReadySince.start();
+		mScheduler->schedule();
 		break;
-	case DeviceState:
-		readRegisters(RegStatusSummary, 4);
-		break;
-	case OperationalMode:
-		readRegisters(RegOperationalMode, 1);
-		break;
-	case Measurements:
-		readRegisters(RegStateOfCharge, 6);
-		break;
-	case Health:
-		readRegisters(RegStateOfHealth, 3);
+	case Poll:
+		if (mReadIndex >= mReads.size()) {
+			mState = Wait;
+			mScheduler->schedule();
+			break;
+		}
+		mReadySince.start();
+		mScheduler->schedule();
 		break;
 	case Wait:
-	{
-		int dt = MeasurementWaitInterval - mStopwatch.elapsed();
-		if (dt > 20) {
-			mAcquisitionTimer->setInterval(dt);
-			mAcquisitionTimer->start();
-		} else {
-			onWaitFinished();
-		}
+		// The scheduler will call startRequest when the next tier is due.
+		mScheduler->schedule();
 		break;
-	}
 	case WaitOnDeviceReinit:
 		QLOG_INFO() << "Device address changed, waiting for reinit";
-		mDeviceAddress = mBatteryController->DeviceAddress();
-		mBatteryController->setSerial(QString());
-		mBatteryController->setConnectionState(Disconnected);
+		mDeviceAddress = mNewDeviceAddress;
+		setSerial(QString());
+		setConnectionState(Disconnected);
 		mAcquisitionTimer->setInterval(DeviceReinitInterval);
 		mAcquisitionTimer->start();
 		break;
-	case WaitOnConnectionLost:
-		mAcquisitionTimer->setInterval(ConnectionLostWaitInterval);
-		mAcquisitionTimer->start();
-		break;
+	case FirmwareVersion:
 	case SetAddress:
-		QLOG_INFO() << "Changing device address from" << mDeviceAddress
-					<< "to" << mBatteryController->DeviceAddress();
-		writeRegister(RegDeviceAddress, mBatteryController->DeviceAddress());
-		break;
 	case ClearStatus:
-		writeRegister(RegClearStatusFlags, mBatteryController->ClearStatusRegisterFlags());
-		break;
 	case SetOperationalMode:
-		writeRegister(RegEnterRunCommand, mBatteryController->operationalMode());
-		break;
 	case RequestDelayedMaintenance:
-		writeRegister(RegDelayedSelfMaintenance, mBatteryController->RequestDelayedSelfMaintenance());
-		break;
 	case RequestImmediateMaintenance:
-		writeRegister(RegImmediateSelfMaintenance, mBatteryController->RequestImmediateSelfMaintenance());
+		mReadySince.start();
+		mScheduler->schedule();
 		break;
 	default:
 		QLOG_ERROR() << "Invalid state while starting new action" << mState;
@@ -380,19 +531,340 @@ void BatteryControllerUpdater::queueWriteAction(State writeState)
 		mTmpState = Wait;
 		mState = writeState;
 		startNextAction();
+	} else if (mState == Poll && !mBusy && mTmpState == Wait) {
+		// Do not wait for the remaining reads of the current poll. The write
+		// is performed first, after which the poll is resumed.
+		mTmpState = writeState;
+		startNextAction();
 	} else {
 		mTmpState = writeState;
 	}
 }
 
+void BatteryControllerUpdater::verifyOperationalMode(int mode)
+{
+	// A pending write will be performed first, so we check again during the
+	// next poll.
+	if (mTmpState != Wait)
+		return;
+	mVerifyOperationalMode = false;
+	if (mode == mOperationalMode)
+		return;
+	QLOG_WARN() << "Device" << mDeviceAddress << "did not apply broadcast of"
+				<< "operational mode" << mOperationalMode;
+	// Picked up by startNextAction when the read has been handled.
+	mOperationalModePending = true;
+	mTmpState = SetOperationalMode;
+}
+
+void BatteryControllerUpdater::onOperationalModeWritten()
+{
+	mOperationalModePending = false;
+	// This is a workaround: the ZBM takes some time to change the
+	// operational mode. By postponing the tier containing the operational
+	// mode, we ensure that it will not be retrieved for another poll
+	// interval, preventing the displayed to switch back temporarily to the
+	// previous value.
+	postponeTier(RegOperationalMode);
+	if (mTmpState == Poll) {
+		// Resume the interrupted poll, so the remaining registers of the
+		// current tiers are not starved by frequent writes.
+		mSkipOperationalMode = true;
+	} else {
+		mTmpState = Wait;
+	}
+}
+
+bool BatteryControllerUpdater::isWritePending(State writeState) const
+{
+	switch (writeState) {
+	case SetOperationalMode:
+		return mOperationalModePending;
+	case ClearStatus:
+		return mClearStatusFlags != 0;
+	case RequestDelayedMaintenance:
+		return mDelayedSelfMaintenance != 0;
+	case RequestImmediateMaintenance:
+		return mImmediateSelfMaintenance != 0;
+	default:
+		return false;
+	}
+}
+
+void BatteryControllerUpdater::dropPendingWrites()
+{
+	// Otherwise they would be sent along with the next control write.
+	mOperationalModePending = false;
+	mClearStatusFlags = 0;
+	mDelayedSelfMaintenance = 0;
+	mImmediateSelfMaintenance = 0;
+}
+
+void BatteryControllerUpdater::resetBackoff()
+{
+	mTimeoutCount = 0;
+	mRetryDelay = 0;
+	mQuarantined = false;
+}
+
+int BatteryControllerUpdater::backoffDelay(int timeoutCount)
+{
+	if (timeoutCount <= FastRetryCount)
+		return 0;
+	int delay = BackoffBaseDelay;
+	for (int i=FastRetryCount + 1; i<timeoutCount && delay < MaxBackoffDelay; ++i)
+		delay *= 2;
+	return addJitter(qMin(delay, MaxBackoffDelay));
+}
+
+int BatteryControllerUpdater::addJitter(int delay)
+{
+	// Add +/- 25% to prevent batteries which went down together (eg. because
+	// of a cable problem) to retry in lock step.
+	int range = delay / 2;
+	return delay - range / 2 + (range > 0 ? qrand() % (range + 1) : 0);
+}
+
+void BatteryControllerUpdater::setConnectionState(ConnectionState state)
+{
+	// The state is passed to another thread, which involves an allocation for
+	// each signal. Polls would emit Connected each time.
+	if (mConnectionState == state)
+		return;
+	mConnectionState = state;
+	emit connectionStateChanged(state);
+}
+
+void BatteryControllerUpdater::schedulePoll(bool pollAll)
+{
+	mDueTiers = 0;
+	for (int i=0; i<PollTierCount; ++i) {
+		QElapsedTimer &t = mLastPoll[i];
+		if (pollAll || !t.isValid() ||
+			t.elapsed() + PollSlack >= mPollIntervals[i]) {
+			mDueTiers |= 1 << i;
+			t.start();
+		}
+	}
+	mSkipOperationalMode = false;
+	mReads = readPlan(mDueTiers);
+	mReadIndex = 0;
+}
+
+int BatteryControllerUpdater::msecsUntilNextPoll() const
+{
+	// May return a negative value if the next poll is overdue.
+	qint64 dt = BusClient::NotDue;
+	for (int i=0; i<PollTierCount; ++i) {
+		const QElapsedTimer &t = mLastPoll[i];
+		if (!t.isValid())
+			return 0;
+		dt = qMin(dt, mPollIntervals[i] - t.elapsed());
+	}
+	return static_cast<int>(dt);
+}
+
+void BatteryControllerUpdater::postponeTier(quint16 reg)
+{
+	for (int i=0; i<ZbmRegisterCount; ++i) {
+		const RegisterDescriptor &d = ZbmRegisters[i];
+		if (d.address == reg) {
+			mLastPoll[d.tier].start();
+			return;
+		}
+	}
+}
+
+void BatteryControllerUpdater::planReads()
+{
+	// Called when the gap tolerance or mSplitReads has changed, so the plans
+	// computed so far are discarded. The current poll is restarted.
+	for (int i=0; i<PlanCount; ++i) {
+		mPlans[i].clear();
+		mPlanned[i] = false;
+	}
+	mReads = readPlan(mDueTiers);
+	mReadIndex = 0;
+}
+
+const QList<BatteryControllerUpdater::PlannedRead> &
+BatteryControllerUpdater::readPlan(int tiers)
+{
+	QList<PlannedRead> &plan = mPlans[tiers];
+	if (mPlanned[tiers])
+		return plan;
+	QList<RegisterRange> ranges;
+	for (int i=0; i<ZbmRegisterCount; ++i) {
+		const RegisterDescriptor &d = ZbmRegisters[i];
+		if ((tiers & (1 << d.tier)) != 0)
+			ranges.append(RegisterRange(d.address, 1));
+	}
+	QList<RegisterRange> reads = mSplitReads ?
+		ReadPlanner(SplitGapTolerance).plan(ranges) :
+		mPlanner.plan(ranges);
+	// Both the reads and the register table are sorted by address, so the
+	// registers covered by each read can be found in a single pass.
+	int first = 0;
+	foreach (const RegisterRange &r, reads) {
+		PlannedRead pr;
+		pr.range = r;
+		while (first < ZbmRegisterCount && ZbmRegisters[first].address < r.start)
+			++first;
+		int last = first;
+		while (last < ZbmRegisterCount && ZbmRegisters[last].address < r.end())
+			++last;
+		pr.firstRegister = first;
+		pr.lastRegister = last;
+		plan.append(pr);
+		first = last;
+	}
+	mPlanned[tiers] = true;
+	return plan;
+}
+
+void BatteryControllerUpdater::setSerial(const QString &serial)
+{
+	if (mSerial == serial)
+		return;
+	mSerial = serial;
+	emit serialChanged(serial);
+}
+
 void BatteryControllerUpdater::readRegisters(quint16 startReg, quint16 count)
 {
+	mBusy = true;
 	mRegisterCount = count;
-	mModbus->readRegisters(ModbusRtu::ReadHoldingRegisters, mDeviceAddress, startReg, count);
+	mModbus->readRegisters(this, ModbusRtu::ReadHoldingRegisters, mDeviceAddress,
+						   startReg, count, priority());
 }
 
 void BatteryControllerUpdater::writeRegister(quint16 reg, quint16 value)
 {
+	mBusy = true;
 	QLOG_WARN() << "Write register" << reg << "value" << value;
-	mModbus->writeRegister(ModbusRtu::WriteSingleRegister, mDeviceAddress, reg, value);
+	mModbus->writeRegister(this, ModbusRtu::WriteSingleRegister, mDeviceAddress,
+						   reg, value, ModbusRtu::WritePriority);
+}
+
+void BatteryControllerUpdater::writeReadRegisters(quint16 writeReg,
+												  quint16 value,
+												  quint16 readReg,
+												  quint16 readCount)
+{
+	mBusy = true;
+	mRegisterCount = readCount;
+	mWriteReg = writeReg;
+	mReadBackStart = readReg;
+	QLOG_WARN() << "Write register" << writeReg << "value" << value;
+	mModbus->writeReadRegisters(this, mDeviceAddress, writeReg, &value, 1,
+								readReg, readCount, ModbusRtu::WritePriority);
+}
+
+bool BatteryControllerUpdater::writeControlBlock()
+{
+	if (!mMultipleWrites)
+		return false;
+	// Ordered by address, starting at FirstControlRegister. Zero requests
+	// nothing from the status flag and self maintenance registers, so they
+	// may be part of the block without a pending action. This does not hold
+	// for RegEnterRunCommand.
+	const quint16 values[ControlRegisterCount] = {
+		static_cast<quint16>(mClearStatusFlags),
+		static_cast<quint16>(mDelayedSelfMaintenance),
+		static_cast<quint16>(mOperationalMode),
+		static_cast<quint16>(mImmediateSelfMaintenance)
+	};
+	const bool pending[ControlRegisterCount] = {
+		mClearStatusFlags != 0,
+		mDelayedSelfMaintenance != 0,
+		mOperationalModePending,
+		mImmediateSelfMaintenance != 0
+	};
+	int first = -1;
+	int last = -1;
+	int pendingCount = 0;
+	for (int i=0; i<ControlRegisterCount; ++i) {
+		if (pending[i]) {
+			if (first < 0)
+				first = i;
+			last = i;
+			++pendingCount;
+		}
+	}
+	if (pendingCount < 2)
+		return false;
+	int mode = RegEnterRunCommand - FirstControlRegister;
+	if (first < mode && mode < last && !pending[mode])
+		return false;
+	mBusy = true;
+	mWriteReg = FirstControlRegister + first;
+	int count = last - first + 1;
+	QLOG_WARN() << "Write registers" << mWriteReg << "count" << count;
+	mModbus->writeRegisters(this, mDeviceAddress, mWriteReg, values + first,
+							count, ModbusRtu::WritePriority);
+	return true;
+}
+
+void BatteryControllerUpdater::onControlBlockWritten(quint16 startReg, int count)
+{
+	bool modeWritten = false;
+	for (int i=0; i<count; ++i) {
+		quint16 reg = startReg + i;
+		switch (reg) {
+		case RegClearStatusFlags:
+			if (mClearStatusFlags == 0)
+				continue;
+			mClearStatusFlags = 0;
+			break;
+		case RegDelayedSelfMaintenance:
+			if (mDelayedSelfMaintenance == 0)
+				continue;
+			mDelayedSelfMaintenance = 0;
+			break;
+		case RegEnterRunCommand:
+			modeWritten = true;
+			break;
+		case RegImmediateSelfMaintenance:
+			if (mImmediateSelfMaintenance == 0)
+				continue;
+			mImmediateSelfMaintenance = 0;
+			break;
+		default:
+			continue;
+		}
+		emit registerWritten(reg);
+	}
+	// The block may include a write which was queued after the current one.
+	switch (mTmpState) {
+	case SetOperationalMode:
+	case ClearStatus:
+	case RequestDelayedMaintenance:
+	case RequestImmediateMaintenance:
+		if (!isWritePending(mTmpState))
+			mTmpState = Wait;
+		break;
+	default:
+		break;
+	}
+	if (modeWritten)
+		onOperationalModeWritten();
+}
+
+void BatteryControllerUpdater::publishReadBack(const ModbusRequest &request,
+											   const RegisterView &registers)
+{
+	// mValues may contain the results of a poll in progress, so the values
+	// are published separately.
+	RegisterValues &values = mReadBack;
+	int end = mReadBackStart + registers.size();
+	for (int i=0; i<ZbmRegisterCount; ++i) {
+		const RegisterDescriptor &d = ZbmRegisters[i];
+		bool valid = d.address >= mReadBackStart && d.address < end;
+		values.valid[i] = valid;
+		if (valid) {
+			values.values[i] = d.decode(registers[d.address - mReadBackStart]);
+			values.timestamps[i] = request.completed;
+		}
+	}
+	emit valuesRead(values);
 }
@@ -3,72 +3,132 @@
 
 #include <QElapsedTimer>
 #include <QObject>
+#include "battery_controller.h"
+#include "bus_scheduler.h"
 #include "defines.h"
 #include "modbus_rtu.h"
-
-class BatteryController;
+#include "read_planner.h"
+#include "zbm_registers.h"
 
 /*!
- * Retrieves data from a Carlo Gavazzi energy meter.
- * This class will setup a connection (modbus RTU) to an energy meter and
- * retrieve data from the device. The value will be stored in an `AcSensor`
- * object.
+ * Retrieves data from a Redflow ZBM.
+ * This class will setup a connection (modbus RTU) to a ZBM and retrieve data
+ * from the device. The updater runs in the thread handling the serial port.
+ * It has no access to the `BatteryController` which holds the data, because
+ * that object lives in the main thread. Instead, results are reported using
+ * signals, and write requests are passed in using the public slots. Both are
+ * connected by `BatteryControllerLink`.
  *
  * This class is implemented as a state engine. The diagram below shows the
  * progress through the states.
  * @dotfile battery_controller_updater_states.dot
  */
-class BatteryControllerUpdater : public QObject
+class BatteryControllerUpdater : public QObject, public BusClient,
+	public ModbusListener
 {
 	Q_OBJECT
 public:
 	/*!
-	 * Creates an instance of `BatteryControllerUpdater`, and starts the setup
-	 * process.
-	 * If the setup succeeds, the `connectionState` of the `acSensor` will be
-	 * set to `Detected`, otherwise to `disconnected` signal.
-	 * Once the state is `Detected`, the object will become idle until
-	 * `startMeasurement` is called.
-	 * @param acSensor. The storage object. All retrieved values will be
-	 * stored here. The `portName` property of this object should be set before
-	 * calling this contructor.
-	 * @param modbus. The modbus connection object. This object may be shared
-	 * between multiple `AcSensorUpdater` objects. The `modbus` object will not
-	 * be deleted in the destructor.
+	 * Creates an instance of `BatteryControllerUpdater`. Communication will
+	 * not start until `start` is called.
+	 * @param deviceAddress. The modbus address of the ZBM.
+	 * @param scheduler. The scheduler of the modbus connection. This object
+	 * may be shared between multiple `BatteryControllerUpdater` objects. The
+	 * `scheduler` object will not be deleted in the destructor.
 	 */
-	BatteryControllerUpdater(BatteryController *mBatteryController,
-							 ModbusRtu *modbus, QObject *parent = 0);
+	BatteryControllerUpdater(int deviceAddress, BusScheduler *scheduler,
+							 QObject *parent = 0);
 
-private slots:
-	void onErrorReceived(int errorType, quint8 addr, int exception);
+	virtual ~BatteryControllerUpdater();
 
-	void onReadCompleted(int function, quint8 addr, const QList<quint16> &registers);
+	int deviceAddress() const;
 
-	void onWriteCompleted(int function, quint8 addr, quint16 address, quint16 value);
+	int gapTolerance() const;
 
-	void onWaitFinished();
+	/*!
+	 * Sets the maximum number of unused registers between two registers
+	 * that may be read in a single modbus request. The default value
+	 * combines the complete status block (0x9001..0x9019) into one request.
+	 * A negative value results in a separate request for each register.
+	 */
+	void setGapTolerance(int t);
+
+	static int defaultGapTolerance();
+
+	int pollInterval(PollTier tier) const;
+
+	/*!
+	 * Sets the interval (in milliseconds) between two retrievals of the
+	 * registers belonging to `tier`.
+	 */
+	void setPollInterval(PollTier tier, int interval);
+
+	static int defaultPollInterval(PollTier tier);
+
+	virtual int msecsUntilDue() const;
+
+	virtual ModbusRtu::Priority priority() const;
+
+	virtual bool startRequest();
 
-	void onClearStatusRegisterFlagsChanged();
+	virtual void onErrorReceived(const ModbusRequest &request, int errorType, int exception);
+
+	virtual void onReadCompleted(const ModbusRequest &request, const RegisterView &registers);
+
+	virtual void onWriteCompleted(const ModbusRequest &request, quint16 address, quint16 value);
+
+public slots:
+	/*!
+	 * Starts the setup process.
+	 * If the setup succeeds, `connectionStateChanged` will be emitted with
+	 * `Detected`, followed by `Connected` once all registers have been
+	 * retrieved.
+	 */
+	void start();
+
+	void setOperationalMode(int mode);
+
+	void clearStatusFlags(int flags);
+
+	void requestDelayedSelfMaintenance(int value);
+
+	void requestImmediateSelfMaintenance(int value);
+
+	/// Changes the modbus address of the device.
+	void setDeviceAddress(int address);
+
+	/*!
+	 * Called when `value` has been written to `reg` of all devices on the
+	 * bus. The device does not confirm a broadcast, so the operational mode
+	 * is checked during the next poll, and written again if the device
+	 * missed it.
+	 */
+	void onBroadcastWritten(int reg, int value);
 
-	void onOperationalModeChanged();
+signals:
+	void serialChanged(const QString &serial);
 
-	void onRequestDelayedSelfMaintenanceChanged();
+	void firmwareVersionChanged(const QString &version);
 
-	void onRequestImmediateSelfMaintenanceChanged();
+	void connectionStateChanged(ConnectionState state);
 
-	void onDeviceAddressChanged();
+	/// Emitted when a poll of all due registers has been completed, and when
+	/// registers have been read back after a write.
+	void valuesRead(const RegisterValues &values);
+
+	/// Emitted when a write request has been completed.
+	void registerWritten(int reg);
+
+private slots:
+	void onWaitFinished();
 
 private:
 	enum State {
 		Serial,
 		FirmwareVersion,
-		DeviceState,
-		Measurements,
-		OperationalMode,
-		Health,
+		Poll,
 		Wait,
 		WaitOnDeviceReinit,
-		WaitOnConnectionLost,
 
 		SetAddress,
 		SetOperationalMode,
@@ -77,27 +137,127 @@ private:
 		RequestImmediateMaintenance,
 
 		Init = Serial,
-		Start = DeviceState
+		Start = Poll
 	};
 
 	void startNextAction();
 
+	void verifyOperationalMode(int mode);
+
+	void onOperationalModeWritten();
+
+	bool isWritePending(State writeState) const;
+
+	void dropPendingWrites();
+
+	void resetBackoff();
+
+	static int backoffDelay(int timeoutCount);
+
+	static int addJitter(int delay);
+
+	void setConnectionState(ConnectionState state);
+
+	void schedulePoll(bool pollAll);
+
+	int msecsUntilNextPoll() const;
+
+	void postponeTier(quint16 reg);
+
+	void planReads();
+
+	void setSerial(const QString &serial);
+
+	/// A modbus request, and the part of `ZbmRegisters` it retrieves.
+	struct PlannedRead {
+		RegisterRange range;
+		int firstRegister;
+		int lastRegister;
+	};
+
+	/// Number of possible combinations of due tiers.
+	static const int PlanCount = 1 << PollTierCount;
+
+	const QList<PlannedRead> &readPlan(int tiers);
+
 	void queueWriteAction(State writeState);
 
 	void readRegisters(quint16 startReg, quint16 count);
 
 	void writeRegister(quint16 reg, quint16 value);
 
-	BatteryController *mBatteryController;
+	void writeReadRegisters(quint16 writeReg, quint16 value, quint16 readReg,
+							quint16 readCount);
+
+	bool writeControlBlock();
+
+	void onControlBlockWritten(quint16 startReg, int count);
+
+	void publishReadBack(const ModbusRequest &request,
+						 const RegisterView &registers);
+
 	int mDeviceAddress;
 	int mRegisterCount;
-	bool mUpdatingController;
+	QString mSerial;
+	// Values to be written in the corresponding write states
+	int mNewDeviceAddress;
+	int mOperationalMode;
+	// Set until mOperationalMode has been written. Unlike the other control
+	// registers, zero is a valid operational mode.
+	bool mOperationalModePending;
+	int mClearStatusFlags;
+	int mDelayedSelfMaintenance;
+	int mImmediateSelfMaintenance;
+	// Results of the poll in progress. The buffers are used alternately, so
+	// the one emitted by the previous poll is not modified while a queued
+	// signal may still refer to it. Modifying it would copy its contents.
+	RegisterValues mValues[2];
+	int mValuesIndex;
+	RegisterValues mReadBack;
+	ConnectionState mConnectionState;
+	BusScheduler *mScheduler;
 	ModbusRtu *mModbus;
+	bool mBusy;
+	QElapsedTimer mReadySince;
 	QTimer *mAcquisitionTimer;
 	int mTimeoutCount;
-	QElapsedTimer mStopwatch;
+	// Delay (ms) before the next request may be sent, counted from the
+	// moment the updater became ready to send it.
+	int mRetryDelay;
+	// Set when the connection has been lost. The device is still probed,
+	// but with a low duty cycle.
+	bool mQuarantined;
 	State mState;
 	State mTmpState;
+	ReadPlanner mPlanner;
+	int mPollIntervals[PollTierCount];
+	QElapsedTimer mLastPoll[PollTierCount];
+	// Bit mask of the tiers retrieved by the current poll.
+	int mDueTiers;
+	// The reads needed for each combination of tiers, computed when first
+	// needed. Avoids planning the reads (and the allocations involved) for
+	// each poll.
+	QList<PlannedRead> mPlans[PlanCount];
+	bool mPlanned[PlanCount];
+	QList<PlannedRead> mReads;
+	int mReadIndex;
+	bool mSplitReads;
+	// Set if the device accepts ReadWriteMultipleRegisters, which allows us
+	// to read back registers affected by a write in the same transaction.
+	bool mCombinedWrites;
+	// Set if the device accepts WriteMultipleRegisters, which allows us to
+	// send all pending control actions in a single transaction.
+	bool mMultipleWrites;
+	quint16 mWriteReg;
+	quint16 mReadBackStart;
+	// Set after a broadcast of the operational mode, until the mode has been
+	// read back from the device.
+	bool mVerifyOperationalMode;
+	// Set when a poll is resumed after a change of the operational mode. The
+	// device may still report the previous mode during the remaining reads.
+	bool mSkipOperationalMode;
 };
 
+Q_DECLARE_METATYPE(BatteryControllerUpdater *)
+
 #endif // BATTERY_CONTROLLER_UPDATER_H
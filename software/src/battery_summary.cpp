@@ -1,9 +1,11 @@
 #include <QTimer>
 #include <velib/qt/v_busitem.h>
+#include "battery_bank.h"
 #include "battery_controller.h"
 #include "battery_summary.h"
+#include "zbm_registers.h"
 
-BatterySummary::BatterySummary(QObject *parent):
+BatterySummary::BatterySummary(const BatteryBank *bank, QObject *parent):
 	QObject(parent),
 	mAverageVoltage(0),
 	mTotalCurrent(0),
@@ -14,7 +16,9 @@ BatterySummary::BatterySummary(QObject *parent):
 	mRequestDelayedSelfMaintenance(0),
 	mRequestImmediateSelfMaintenance(0),
 	mMaintenanceActive(0),
-	mMaintenanceNeeded(0)
+	mMaintenanceNeeded(0),
+	mBank(bank),
+	mSampleTimes(ZbmRegisterCount, -1)
 {
 	QTimer *timer = new QTimer(this);
 	timer->setInterval(1000);
@@ -176,6 +180,11 @@ void BatterySummary::setMaintenanceNeeded(int v)
 	emit maintenanceNeededChanged();
 }
 
+qint64 BatterySummary::sampleTime(int index) const
+{
+	return mSampleTimes[index];
+}
+
 void BatterySummary::onTimeout()
 {
 	updateValues();
@@ -191,58 +200,40 @@ void BatterySummary::onControllerDestroyed()
 
 void BatterySummary::updateValues()
 {
-	double vTot = 0;
-	int vCount = 0;
-	double iTot	= 0;
-	double pTot = 0;
-	double tMax = 0;
-	double socTot = 0;
-	int socCount = 0;
-	int count = 0;
-	bool maintenanceNeeded = true;
-	bool maintenanceActive = true;
-	foreach (BatteryController *bc, mControllers) {
-		if (bc->connectionState() != Connected)
-			continue;
-		++count;
-		if (bc->BattVolts() > 0) {
-			vTot += bc->BattVolts();
-			++vCount;
-		}
-		iTot += bc->BattAmps();
-		pTot += bc->BattPower();
-		tMax = qMax(tMax, bc->BattTemp());
-		socTot += bc->SOC();
-		++socCount;
-		int userOp = mOperationalMode;
-		if (userOp != -1)
-			bc->setOperationalMode(userOp);
-		// We set maintenanceNeeded and maintenanceActive to false if any
-		// battery has not been put in maintenance mode yet. We do this, so
-		// the GUI can use these values to force all remaining batteries into
-		// into maintenance mode.
-		maintenanceNeeded = maintenanceNeeded && bc->maintenanceAlarm() != 0;
-		maintenanceActive = maintenanceActive && bc->maintenanceActiveAlarm() != 0;
+	BatteryBank::Totals totals = mBank->totals();
+
+	// Commands for all batteries are sent as a single broadcast on each
+	// port, so all batteries receive them at the same time. The new
+	// operational mode will show up in the battery values once it has been
+	// polled.
+	if (totals.count > 0) {
+		if (mOperationalMode != -1)
+			emit broadcastRequested(RegEnterRunCommand, mOperationalMode);
 		if (mRequestClearStatusRegister == 1)
-			bc->setClearStatusRegisterFlags(1);
+			emit broadcastRequested(RegClearStatusFlags, 1);
 		if (mRequestDelayedSelfMaintenance == 1)
-			bc->setRequestDelayedSelfMaintenance(1);
+			emit broadcastRequested(RegDelayedSelfMaintenance, 1);
 		if (mRequestImmediateSelfMaintenance == 1)
-			bc->setRequestImmediateSelfMaintenance(1);
+			emit broadcastRequested(RegImmediateSelfMaintenance, 1);
 	}
 
+	// The sample times must be set before the values, because the values are
+	// published as soon as they change.
+	for (int i=0; i<ZbmRegisterCount; ++i)
+		mSampleTimes[i] = mBank->oldestSampleTime(i);
+
 	// Note: if a devision by zero occurs we leave the INF/NAN value. It will
 	// be published as an invalid value on the D-Bus.
-	setAverageVoltage(vTot / vCount);
-	setTotalCurrent(iTot);
-	setTotalPower(pTot);
-	setAverageStateOfCharge(socTot / socCount);
+	setAverageVoltage(totals.voltage / totals.voltageCount);
+	setTotalCurrent(totals.current);
+	setTotalPower(totals.power);
+	setAverageStateOfCharge(totals.stateOfCharge / totals.count);
 
 	setOperationalMode(-1);
 	setRequestClearStatusRegister(0);
 	setRequestDelayedSelfMaintenance(0);
 	setRequestImmediateSelfMaintenance(0);
 
-	setMaintenanceActive(maintenanceActive && count > 0 ? 1 : 0);
-	setMaintenanceNeeded(maintenanceNeeded && count > 0 ? 1 : 0);
+	setMaintenanceActive(totals.maintenanceActive ? 1 : 0);
+	setMaintenanceNeeded(totals.maintenanceNeeded ? 1 : 0);
 }
@@ -3,7 +3,9 @@
 
 #include <QList>
 #include <QObject>
+#include <QVector>
 
+class BatteryBank;
 class BatteryController;
 
 /// A statistical roundup of all connected Redflow batteries.
@@ -22,7 +24,8 @@ class BatterySummary : public QObject
 	Q_PROPERTY(int maintenanceActive READ maintenanceActive WRITE setMaintenanceActive NOTIFY maintenanceActiveChanged)
 	Q_PROPERTY(int maintenanceNeeded READ maintenanceNeeded WRITE setMaintenanceNeeded NOTIFY maintenanceNeededChanged)
 public:
-	BatterySummary(QObject *parent = 0);
+	/// Computes the summary of the connected batteries in `bank`.
+	BatterySummary(const BatteryBank *bank, QObject *parent = 0);
 
 	QList<int> deviceAddresses() const;
 
@@ -56,6 +59,13 @@ public:
 
 	int maintenanceNeeded() const;
 
+	/*!
+	 * Returns the time (µs, see `monotonicTime`) at which the oldest value of
+	 * the given register (index in `ZbmRegisters`) used to compute the
+	 * current summary was received, or -1 if not available.
+	 */
+	qint64 sampleTime(int index) const;
+
 signals:
 	void zbmCountChanged();
 
@@ -81,6 +91,12 @@ signals:
 
 	void maintenanceNeededChanged();
 
+	/*!
+	 * Emitted when a command must be sent to all batteries. The receiver
+	 * should write `value` to `reg` using a broadcast.
+	 */
+	void broadcastRequested(int reg, int value);
+
 private slots:
 	void onTimeout();
 
@@ -111,7 +127,9 @@ private:
 	int mRequestImmediateSelfMaintenance;
 	int mMaintenanceActive;
 	int mMaintenanceNeeded;
+	const BatteryBank *mBank;
 	QList<BatteryController *> mControllers;
+	QVector<qint64> mSampleTimes;
 };
 
 #endif // BATTERYSUMMARY_H
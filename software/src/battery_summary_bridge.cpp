@@ -2,12 +2,14 @@
 #include <velib/vecan/products.h>
 #include "battery_summary.h"
 #include "battery_summary_bridge.h"
+#include "zbm_registers.h"
 
 Q_DECLARE_METATYPE(QList<int>)
 
 BatterySummaryBridge::BatterySummaryBridge(BatterySummary *summary,
 										   QObject *parent):
-	DBusBridge("com.victronenergy.battery.zbm", parent)
+	DBusBridge("com.victronenergy.battery.zbm", parent),
+	mSummary(summary)
 {
 	// The D-Bus paths /Mgmt/Connection, /ProductName, and /Connected are used
 	// by system-calc to determine whether a service is connected.
@@ -30,6 +32,14 @@ BatterySummaryBridge::BatterySummaryBridge(BatterySummary *summary,
 	produce(summary, "maintenanceActive", "/Alarms/MaintenanceActive");
 	produce(summary, "maintenanceNeeded", "/Alarms/MaintenanceNeeded");
 	produce(summary, "deviceAddresses", "/DeviceAddresses");
+
+	int voltage = zbmRegisterIndex(RegBatteryVoltage);
+	int current = zbmRegisterIndex(RegBatteryCurrent);
+	mSampleRegisters["/Dc/0/Voltage"].append(voltage);
+	mSampleRegisters["/Dc/0/Current"].append(current);
+	mSampleRegisters["/Dc/0/Power"] << voltage << current;
+	mSampleRegisters["/Soc"].append(zbmRegisterIndex(RegStateOfCharge));
+	produceAge("/Dc/0/Age", "/Dc/0/Current", "/Diagnostics/Age");
 }
 
 bool BatterySummaryBridge::toDBus(const QString &path, QVariant &value)
@@ -47,3 +57,17 @@ bool BatterySummaryBridge::toDBus(const QString &path, QVariant &value)
 	}
 	return true;
 }
+
+qint64 BatterySummaryBridge::sampleTime(const QString &path) const
+{
+	// Values computed from multiple registers are as old as the oldest one.
+	qint64 t = -1;
+	foreach (int i, mSampleRegisters.value(path)) {
+		qint64 s = mSummary->sampleTime(i);
+		if (s < 0)
+			return -1;
+		if (t < 0 || s < t)
+			t = s;
+	}
+	return t;
+}
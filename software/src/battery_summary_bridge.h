@@ -1,6 +1,8 @@
 #ifndef BATTERYSUMMARYBRIDGE_H
 #define BATTERYSUMMARYBRIDGE_H
 
+#include <QHash>
+#include <QList>
 #include "dbus_bridge.h"
 
 class BatterySummary;
@@ -14,6 +16,14 @@ public:
 
 protected:
 	virtual bool toDBus(const QString &path, QVariant &v);
+
+	virtual qint64 sampleTime(const QString &path) const;
+
+private:
+	BatterySummary *mSummary;
+	// Indices (in `ZbmRegisters`) of the registers each published value is
+	// computed from.
+	QHash<QString, QList<int> > mSampleRegisters;
 };
 
 #endif // BATTERYSUMMARYBRIDGE_H
@@ -0,0 +1,99 @@
+#include <QsLog.h>
+#include <QTimer>
+#include "baud_rate_selector.h"
+
+const int BaudRateSelector::SupportedRates[] = { 115200, 57600, 38400, 19200, 9600 };
+const int BaudRateSelector::SupportedRateCount =
+	sizeof(SupportedRates) / sizeof(SupportedRates[0]);
+
+// Time (ms) each rate is tried. The device scanner should be able to find a
+// battery within this time, if there is one.
+static const int ProbeInterval = 5000;
+// Time (ms) each rate is tried once a battery has replied. Short enough to
+// keep its updater well below the maximum number of timeouts.
+static const int ShortProbeInterval = 300;
+// Interval (ms) at which the replies are checked once a rate has been
+// selected.
+static const int MonitorInterval = 30000;
+// The CRC error rate is only checked if at least this number of frames has
+// been received.
+static const quint32 MinimumFrameCount = 20;
+static const quint32 MaxCrcErrorPercentage = 5;
+
+BaudRateSelector::BaudRateSelector(ModbusRtu *modbus, QObject *parent):
+	QObject(parent),
+	mModbus(modbus),
+	mTimer(new QTimer(this)),
+	mIndex(0),
+	mProbing(true),
+	mFallbackIndex(-1)
+{
+	Q_ASSERT(modbus != 0);
+	connect(mTimer, SIGNAL(timeout()), this, SLOT(onTimer()));
+	selectRate(0);
+}
+
+int BaudRateSelector::maxProbeTime()
+{
+	return SupportedRateCount * ProbeInterval;
+}
+
+void BaudRateSelector::onTimer()
+{
+	ModbusRtu::Statistics s = mModbus->statistics();
+	quint32 requests = s.requests - mLastStatistics.requests;
+	quint32 replies = s.replies - mLastStatistics.replies;
+	quint32 crcErrors = s.crcErrors - mLastStatistics.crcErrors;
+	quint32 frames = replies + crcErrors;
+	mLastStatistics = s;
+	bool reachable = replies > 0;
+	if (!mProbing) {
+		// A noisy line is not a reason to change the rate: all batteries on
+		// the port would time out while the other rates are tried.
+		if (!reachable && requests > 0) {
+			QLOG_WARN() << "No replies at" << SupportedRates[mIndex]
+						<< "baud. Probing all rates.";
+			mProbing = true;
+			selectRate(0);
+		}
+		return;
+	}
+	bool noisy = frames >= MinimumFrameCount &&
+				 100 * crcErrors > MaxCrcErrorPercentage * frames;
+	if (reachable && !noisy) {
+		lock(mIndex);
+		return;
+	}
+	if (reachable && mFallbackIndex == -1)
+		mFallbackIndex = mIndex;
+	int next = mIndex + 1;
+	if (next == SupportedRateCount) {
+		if (mFallbackIndex != -1) {
+			QLOG_WARN() << "No baud rate with a CRC error rate below"
+						<< MaxCrcErrorPercentage << '%';
+			selectRate(mFallbackIndex);
+			lock(mFallbackIndex);
+			return;
+		}
+		next = 0;
+	}
+	selectRate(next);
+}
+
+void BaudRateSelector::selectRate(int index)
+{
+	mIndex = index;
+	mModbus->setBaudRate(SupportedRates[index]);
+	mLastStatistics = mModbus->statistics();
+	mTimer->setInterval(mFallbackIndex == -1 ? ProbeInterval : ShortProbeInterval);
+	mTimer->start();
+}
+
+void BaudRateSelector::lock(int index)
+{
+	QLOG_INFO() << "Selected baud rate" << SupportedRates[index];
+	mProbing = false;
+	mFallbackIndex = -1;
+	mTimer->setInterval(MonitorInterval);
+	mTimer->start();
+}
@@ -0,0 +1,54 @@
+#ifndef BAUD_RATE_SELECTOR_H
+#define BAUD_RATE_SELECTOR_H
+
+#include <QObject>
+#include "modbus_rtu.h"
+
+class QTimer;
+
+/*!
+ * Selects the highest baud rate at which the batteries on a serial port reply
+ * reliably.
+ *
+ * Starting with the highest supported rate, each rate is tried for a while.
+ * The first rate at which valid replies are received, with a CRC error rate
+ * below the threshold, is used. If none of the rates meets the threshold, the
+ * highest rate with valid replies is used. Once a battery has replied, the
+ * remaining rates are only tried briefly, because the updater of the battery
+ * will time out while another rate is in use.
+ *
+ * Once selected, the rate is only changed if none of the batteries replies
+ * during a full monitoring interval. In that case the selection starts over.
+ */
+class BaudRateSelector : public QObject
+{
+	Q_OBJECT
+public:
+	BaudRateSelector(ModbusRtu *modbus, QObject *parent = 0);
+
+	/// The rates that will be tried, from high to low.
+	static const int SupportedRates[];
+
+	static const int SupportedRateCount;
+
+	/// The maximum time (ms) needed to find a rate when starting up.
+	static int maxProbeTime();
+
+private slots:
+	void onTimer();
+
+private:
+	void selectRate(int index);
+
+	void lock(int index);
+
+	ModbusRtu *mModbus;
+	QTimer *mTimer;
+	int mIndex;
+	bool mProbing;
+	// Highest rate with valid replies found during the current probe, or -1.
+	int mFallbackIndex;
+	ModbusRtu::Statistics mLastStatistics;
+};
+
+#endif // BAUD_RATE_SELECTOR_H
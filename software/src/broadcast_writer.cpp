@@ -0,0 +1,98 @@
+#include <QsLog.h>
+#include "broadcast_writer.h"
+#include "bus_scheduler.h"
+#include "modbus_rtu.h"
+
+BroadcastWriter::BroadcastWriter(BusScheduler *scheduler, QObject *parent):
+	QObject(parent),
+	mScheduler(scheduler),
+	mModbus(scheduler->modbus()),
+	mBusy(false)
+{
+	Q_ASSERT(scheduler != 0);
+	mScheduler->addClient(this);
+}
+
+BroadcastWriter::~BroadcastWriter()
+{
+	mScheduler->removeClient(this);
+	mModbus->removeListener(this);
+}
+
+void BroadcastWriter::write(quint16 reg, quint16 value)
+{
+	// The first entry may be on the bus right now, so it cannot be replaced.
+	for (int i=mBusy ? 1 : 0; i<mPending.size(); ++i) {
+		if (mPending[i].reg == reg) {
+			mPending[i].value = value;
+			return;
+		}
+	}
+	Write w;
+	w.reg = reg;
+	w.value = value;
+	mPending.append(w);
+	if (mPending.size() == 1) {
+		mReadySince.start();
+		mScheduler->schedule();
+	}
+}
+
+int BroadcastWriter::msecsUntilDue() const
+{
+	if (mBusy || mPending.isEmpty())
+		return NotDue;
+	return -static_cast<int>(mReadySince.elapsed());
+}
+
+ModbusRtu::Priority BroadcastWriter::priority() const
+{
+	return ModbusRtu::WritePriority;
+}
+
+bool BroadcastWriter::startRequest()
+{
+	if (mPending.isEmpty())
+		return false;
+	const Write &w = mPending.first();
+	QLOG_INFO() << "Broadcast write register" << w.reg << "value" << w.value;
+	mModbus->writeRegister(this, ModbusRtu::WriteSingleRegister,
+						   ModbusRtu::BroadcastAddress, w.reg, w.value,
+						   ModbusRtu::WritePriority);
+	mBusy = true;
+	return true;
+}
+
+void BroadcastWriter::onReadCompleted(const ModbusRequest &request,
+									  const RegisterView &values)
+{
+	Q_UNUSED(request)
+	Q_UNUSED(values)
+	// We never send read requests.
+	Q_ASSERT(false);
+}
+
+void BroadcastWriter::onWriteCompleted(const ModbusRequest &request,
+									   quint16 address, quint16 value)
+{
+	Q_UNUSED(request)
+	mBusy = false;
+	mPending.removeFirst();
+	if (!mPending.isEmpty()) {
+		mReadySince.start();
+		mScheduler->schedule();
+	}
+	emit broadcastWritten(address, value);
+}
+
+void BroadcastWriter::onErrorReceived(const ModbusRequest &request,
+									  int errorType, int exception)
+{
+	Q_UNUSED(request)
+	Q_UNUSED(exception)
+	// Only possible if the request did not make it into the modbus queue. Try
+	// again when the bus is less busy.
+	QLOG_WARN() << "Broadcast failed:" << errorType;
+	mBusy = false;
+	mScheduler->schedule();
+}
@@ -0,0 +1,58 @@
+#ifndef BROADCAST_WRITER_H
+#define BROADCAST_WRITER_H
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QObject>
+#include "bus_scheduler.h"
+
+/*!
+ * Sends write requests to all devices on a serial port at once, using the
+ * modbus broadcast address. The devices do not reply, so the receivers of
+ * `broadcastWritten` are responsible for checking the result.
+ */
+class BroadcastWriter : public QObject, public BusClient, public ModbusListener
+{
+	Q_OBJECT
+public:
+	BroadcastWriter(BusScheduler *scheduler, QObject *parent);
+
+	virtual ~BroadcastWriter();
+
+	/*!
+	 * Queues a write of `value` to `reg`. A pending write to the same
+	 * register is replaced.
+	 */
+	void write(quint16 reg, quint16 value);
+
+	virtual int msecsUntilDue() const;
+
+	virtual ModbusRtu::Priority priority() const;
+
+	virtual bool startRequest();
+
+	virtual void onReadCompleted(const ModbusRequest &request, const RegisterView &values);
+
+	virtual void onWriteCompleted(const ModbusRequest &request, quint16 address, quint16 value);
+
+	virtual void onErrorReceived(const ModbusRequest &request, int errorType, int exception);
+
+signals:
+	/// Emitted when a broadcast has been sent, and the turnaround delay has
+	/// passed.
+	void broadcastWritten(int reg, int value);
+
+private:
+	struct Write {
+		quint16 reg;
+		quint16 value;
+	};
+
+	BusScheduler *mScheduler;
+	ModbusRtu *mModbus;
+	QList<Write> mPending;
+	bool mBusy;
+	QElapsedTimer mReadySince;
+};
+
+#endif // BROADCAST_WRITER_H
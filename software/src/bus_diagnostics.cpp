@@ -0,0 +1,118 @@
+#include "bus_diagnostics.h"
+
+SlaveRoundTrip::SlaveRoundTrip(int address, QObject *parent):
+	QObject(parent),
+	mAddress(address)
+{
+	mPercentiles.p50 = -1;
+	mPercentiles.p90 = -1;
+	mPercentiles.p99 = -1;
+}
+
+int SlaveRoundTrip::address() const
+{
+	return mAddress;
+}
+
+int SlaveRoundTrip::p50() const
+{
+	return mPercentiles.p50;
+}
+
+int SlaveRoundTrip::p90() const
+{
+	return mPercentiles.p90;
+}
+
+int SlaveRoundTrip::p99() const
+{
+	return mPercentiles.p99;
+}
+
+void SlaveRoundTrip::setPercentiles(const RoundTripPercentiles &p)
+{
+	if (p.p50 == mPercentiles.p50 && p.p90 == mPercentiles.p90 &&
+		p.p99 == mPercentiles.p99)
+		return;
+	mPercentiles = p;
+	emit roundTripChanged();
+}
+
+BusDiagnostics::BusDiagnostics(const QString &portName, QObject *parent):
+	QObject(parent),
+	mPortName(portName)
+{
+}
+
+QString BusDiagnostics::portName() const
+{
+	return mPortName;
+}
+
+double BusDiagnostics::framesPerSecond() const
+{
+	return mMetrics.framesPerSecond;
+}
+
+double BusDiagnostics::bytesPerSecond() const
+{
+	return mMetrics.bytesPerSecond;
+}
+
+double BusDiagnostics::occupancy() const
+{
+	return mMetrics.occupancy;
+}
+
+int BusDiagnostics::timeouts() const
+{
+	return static_cast<int>(mMetrics.timeouts);
+}
+
+int BusDiagnostics::crcErrors() const
+{
+	return static_cast<int>(mMetrics.crcErrors);
+}
+
+int BusDiagnostics::exceptions() const
+{
+	return static_cast<int>(mMetrics.exceptions);
+}
+
+int BusDiagnostics::queueDepth() const
+{
+	return mMetrics.queueDepth;
+}
+
+int BusDiagnostics::cycleTime() const
+{
+	return mMetrics.cycleTime;
+}
+
+QList<SlaveRoundTrip *> BusDiagnostics::slaves() const
+{
+	return mSlaves.values();
+}
+
+void BusDiagnostics::update(const BusMetrics &metrics)
+{
+	mMetrics = metrics;
+	emit metricsChanged();
+	// Slaves which did not reply during the last interval have no
+	// percentiles.
+	RoundTripPercentiles none;
+	none.p50 = -1;
+	none.p90 = -1;
+	none.p99 = -1;
+	foreach (SlaveRoundTrip *s, mSlaves)
+		s->setPercentiles(metrics.roundTrips.value(s->address(), none));
+	for (QMap<int, RoundTripPercentiles>::const_iterator it = metrics.roundTrips.constBegin();
+		 it != metrics.roundTrips.constEnd(); ++it) {
+		if (mSlaves.contains(it.key()))
+			continue;
+		SlaveRoundTrip *s = new SlaveRoundTrip(it.key(), this);
+		s->setPercentiles(it.value());
+		mSlaves.insert(it.key(), s);
+		emit slaveAdded(s);
+	}
+}
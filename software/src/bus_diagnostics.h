@@ -0,0 +1,89 @@
+#ifndef BUS_DIAGNOSTICS_H
+#define BUS_DIAGNOSTICS_H
+
+#include <QMap>
+#include <QObject>
+#include <QString>
+#include "bus_metrics.h"
+
+/// Round trip percentiles (ms) of a single slave, -1 if not available.
+class SlaveRoundTrip : public QObject
+{
+	Q_OBJECT
+	Q_PROPERTY(int p50 READ p50 NOTIFY roundTripChanged)
+	Q_PROPERTY(int p90 READ p90 NOTIFY roundTripChanged)
+	Q_PROPERTY(int p99 READ p99 NOTIFY roundTripChanged)
+public:
+	SlaveRoundTrip(int address, QObject *parent = 0);
+
+	int address() const;
+
+	int p50() const;
+
+	int p90() const;
+
+	int p99() const;
+
+	void setPercentiles(const RoundTripPercentiles &p);
+
+signals:
+	void roundTripChanged();
+
+private:
+	int mAddress;
+	RoundTripPercentiles mPercentiles;
+};
+
+/*!
+ * Utilisation of a single serial port, as reported by its `PortWorker`.
+ * Lives in the main thread.
+ */
+class BusDiagnostics : public QObject
+{
+	Q_OBJECT
+	Q_PROPERTY(double framesPerSecond READ framesPerSecond NOTIFY metricsChanged)
+	Q_PROPERTY(double bytesPerSecond READ bytesPerSecond NOTIFY metricsChanged)
+	Q_PROPERTY(double occupancy READ occupancy NOTIFY metricsChanged)
+	Q_PROPERTY(int timeouts READ timeouts NOTIFY metricsChanged)
+	Q_PROPERTY(int crcErrors READ crcErrors NOTIFY metricsChanged)
+	Q_PROPERTY(int exceptions READ exceptions NOTIFY metricsChanged)
+	Q_PROPERTY(int queueDepth READ queueDepth NOTIFY metricsChanged)
+	Q_PROPERTY(int cycleTime READ cycleTime NOTIFY metricsChanged)
+public:
+	BusDiagnostics(const QString &portName, QObject *parent = 0);
+
+	QString portName() const;
+
+	double framesPerSecond() const;
+
+	double bytesPerSecond() const;
+
+	double occupancy() const;
+
+	int timeouts() const;
+
+	int crcErrors() const;
+
+	int exceptions() const;
+
+	int queueDepth() const;
+
+	int cycleTime() const;
+
+	QList<SlaveRoundTrip *> slaves() const;
+
+public slots:
+	void update(const BusMetrics &metrics);
+
+signals:
+	void metricsChanged();
+
+	void slaveAdded(SlaveRoundTrip *slave);
+
+private:
+	QString mPortName;
+	BusMetrics mMetrics;
+	QMap<int, SlaveRoundTrip *> mSlaves;
+};
+
+#endif // BUS_DIAGNOSTICS_H
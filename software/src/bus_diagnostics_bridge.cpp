@@ -0,0 +1,56 @@
+#include <QFileInfo>
+#include <QRegExp>
+#include "bus_diagnostics.h"
+#include "bus_diagnostics_bridge.h"
+
+BusDiagnosticsBridge::BusDiagnosticsBridge(const QList<BusDiagnostics *> &ports,
+										   DBusBridge *service,
+										   QObject *parent):
+	DBusBridge(service, parent)
+{
+	foreach (BusDiagnostics *port, ports) {
+		QString root = rootPath(port);
+		produce(port, "framesPerSecond", root + "/FramesPerSecond", "/s", 1);
+		produce(port, "bytesPerSecond", root + "/BytesPerSecond", "B/s", 0);
+		produce(port, "occupancy", root + "/Occupancy", "%", 1);
+		produce(port, "timeouts", root + "/Timeouts");
+		produce(port, "crcErrors", root + "/CrcErrors");
+		produce(port, "exceptions", root + "/Exceptions");
+		produce(port, "queueDepth", root + "/QueueDepth");
+		produce(port, "cycleTime", root + "/CycleTime", "ms");
+		foreach (SlaveRoundTrip *slave, port->slaves())
+			produceSlave(root, slave);
+		connect(port, SIGNAL(slaveAdded(SlaveRoundTrip *)),
+				this, SLOT(onSlaveAdded(SlaveRoundTrip *)));
+	}
+}
+
+bool BusDiagnosticsBridge::toDBus(const QString &path, QVariant &v)
+{
+	// Percentiles are -1 if the slave did not reply during the last interval.
+	if (path.contains("/RoundTrip/") && v.toInt() < 0)
+		v = QVariant();
+	return true;
+}
+
+void BusDiagnosticsBridge::onSlaveAdded(SlaveRoundTrip *slave)
+{
+	BusDiagnostics *port = static_cast<BusDiagnostics *>(sender());
+	produceSlave(rootPath(port), slave);
+}
+
+void BusDiagnosticsBridge::produceSlave(const QString &root, SlaveRoundTrip *slave)
+{
+	QString path = QString("%1/RoundTrip/%2").arg(root).arg(slave->address());
+	produce(slave, "p50", path + "/P50", "ms");
+	produce(slave, "p90", path + "/P90", "ms");
+	produce(slave, "p99", path + "/P99", "ms");
+}
+
+QString BusDiagnosticsBridge::rootPath(const BusDiagnostics *port)
+{
+	// D-Bus object paths may only contain [A-Za-z0-9_].
+	QString name = QFileInfo(port->portName()).fileName();
+	name.replace(QRegExp("[^A-Za-z0-9_]"), "_");
+	return "/Diagnostics/Bus/" + name;
+}
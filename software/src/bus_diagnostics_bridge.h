@@ -0,0 +1,38 @@
+#ifndef BUS_DIAGNOSTICS_BRIDGE_H
+#define BUS_DIAGNOSTICS_BRIDGE_H
+
+#include <QList>
+#include "dbus_bridge.h"
+
+class BusDiagnostics;
+class SlaveRoundTrip;
+
+/*!
+ * Publishes the utilisation of the serial ports below
+ * /Diagnostics/Bus/<port> on the given service. Round trip percentiles of
+ * each slave are added below /Diagnostics/Bus/<port>/RoundTrip/<address>
+ * once the slave has replied.
+ *
+ * The objects are added to the service of another bridge, which should
+ * register the service.
+ */
+class BusDiagnosticsBridge : public DBusBridge
+{
+	Q_OBJECT
+public:
+	BusDiagnosticsBridge(const QList<BusDiagnostics *> &ports,
+						 DBusBridge *service, QObject *parent = 0);
+
+protected:
+	virtual bool toDBus(const QString &path, QVariant &v);
+
+private slots:
+	void onSlaveAdded(SlaveRoundTrip *slave);
+
+private:
+	void produceSlave(const QString &root, SlaveRoundTrip *slave);
+
+	static QString rootPath(const BusDiagnostics *port);
+};
+
+#endif // BUS_DIAGNOSTICS_BRIDGE_H
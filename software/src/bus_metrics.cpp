@@ -0,0 +1,52 @@
+#include <string.h>
+#include "bus_metrics.h"
+
+const int LatencyHistogram::UpperBounds[BucketCount] = {
+	1, 2, 3, 5, 7, 10, 15, 20, 30, 50, 70, 100, 150, 200, 300, 500, 700, 1000,
+	1500, 2000, 3000, 5000, 7000, 10000
+};
+
+LatencyHistogram::LatencyHistogram()
+{
+	memset(mCounts, 0, sizeof(mCounts));
+}
+
+void LatencyHistogram::add(int microseconds)
+{
+	int i = 0;
+	while (i < BucketCount - 1 && 1000 * UpperBounds[i] < microseconds)
+		++i;
+	++mCounts[i];
+}
+
+quint32 LatencyHistogram::count() const
+{
+	quint32 n = 0;
+	for (int i=0; i<BucketCount; ++i)
+		n += mCounts[i];
+	return n;
+}
+
+int LatencyHistogram::percentile(int p) const
+{
+	quint32 n = count();
+	if (n == 0)
+		return -1;
+	// Number of samples at or below the percentile, rounded up.
+	quint64 rank = (static_cast<quint64>(n) * p + 99) / 100;
+	quint64 seen = 0;
+	for (int i=0; i<BucketCount; ++i) {
+		seen += mCounts[i];
+		if (seen >= rank && seen > 0)
+			return UpperBounds[i];
+	}
+	return UpperBounds[BucketCount - 1];
+}
+
+LatencyHistogram LatencyHistogram::since(const LatencyHistogram &earlier) const
+{
+	LatencyHistogram h;
+	for (int i=0; i<BucketCount; ++i)
+		h.mCounts[i] = mCounts[i] - earlier.mCounts[i];
+	return h;
+}
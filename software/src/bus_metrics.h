@@ -0,0 +1,82 @@
+#ifndef BUS_METRICS_H
+#define BUS_METRICS_H
+
+#include <QMap>
+#include <QMetaType>
+
+/*!
+ * Histogram of latencies, such as round trip times or the age of published
+ * values. The buckets grow roughly logarithmically from 1 ms to 10 s. Times
+ * above 10 s are counted in the last bucket.
+ */
+class LatencyHistogram
+{
+public:
+	static const int BucketCount = 24;
+
+	LatencyHistogram();
+
+	void add(int microseconds);
+
+	quint32 count() const;
+
+	/*!
+	 * Returns the upper bound (ms) of the bucket containing the given
+	 * percentile (0-100), or -1 if the histogram is empty.
+	 */
+	int percentile(int p) const;
+
+	/// Returns the times added since `earlier` was taken from this histogram.
+	LatencyHistogram since(const LatencyHistogram &earlier) const;
+
+private:
+	static const int UpperBounds[BucketCount];
+
+	quint32 mCounts[BucketCount];
+};
+
+/// Round trip percentiles (ms) of a single slave. -1 if not available.
+struct RoundTripPercentiles
+{
+	int p50;
+	int p90;
+	int p99;
+};
+
+/*!
+ * Utilisation of a serial port during the last measurement interval, and
+ * error counts since the port was opened. Sent by `PortWorker` to the main
+ * thread.
+ */
+struct BusMetrics
+{
+	BusMetrics():
+		framesPerSecond(0),
+		bytesPerSecond(0),
+		occupancy(0),
+		timeouts(0),
+		crcErrors(0),
+		exceptions(0),
+		queueDepth(0),
+		cycleTime(0)
+	{}
+
+	double framesPerSecond;
+	double bytesPerSecond;
+	/// Percentage of the time the line was busy sending or receiving data.
+	double occupancy;
+	quint32 timeouts;
+	quint32 crcErrors;
+	quint32 exceptions;
+	/// Number of requests waiting to be sent.
+	int queueDepth;
+	/// Duration (ms) of the last complete scheduler cycle, see `BusScheduler`.
+	int cycleTime;
+	/// Percentiles per slave address, of the replies received during the
+	/// interval. Slaves without replies are not included.
+	QMap<int, RoundTripPercentiles> roundTrips;
+};
+
+Q_DECLARE_METATYPE(BusMetrics)
+
+#endif // BUS_METRICS_H
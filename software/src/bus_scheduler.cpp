@@ -0,0 +1,148 @@
+#include <QsLog.h>
+#include <QTimer>
+#include "bus_scheduler.h"
+#include "modbus_rtu.h"
+
+BusScheduler::BusScheduler(ModbusRtu *modbus, QObject *parent):
+	QObject(parent),
+	mModbus(modbus),
+	mTimer(new QTimer(this)),
+	mNextClient(0),
+	mBusy(false),
+	mPendingCount(0),
+	mCycleTime(0)
+{
+	Q_ASSERT(modbus != 0);
+	mTimer->setSingleShot(true);
+	connect(mTimer, SIGNAL(timeout()), this, SLOT(onTimer()));
+	connect(mModbus, SIGNAL(requestFinished()),
+			this, SLOT(onTransactionFinished()));
+}
+
+ModbusRtu *BusScheduler::modbus() const
+{
+	return mModbus;
+}
+
+void BusScheduler::addClient(BusClient *client)
+{
+	if (mClients.contains(client))
+		return;
+	mClients.append(client);
+	mPendingInCycle.append(false);
+}
+
+void BusScheduler::removeClient(BusClient *client)
+{
+	int i = mClients.indexOf(client);
+	if (i == -1)
+		return;
+	mClients.removeAt(i);
+	if (mPendingInCycle[i])
+		--mPendingCount;
+	mPendingInCycle.remove(i);
+	if (mNextClient > i)
+		--mNextClient;
+	if (mNextClient >= mClients.size())
+		mNextClient = 0;
+}
+
+void BusScheduler::schedule()
+{
+	if (!mBusy)
+		dispatch();
+}
+
+int BusScheduler::cycleTime() const
+{
+	return mCycleTime;
+}
+
+void BusScheduler::onTransactionFinished()
+{
+	mBusy = false;
+	if (mPendingCount == 0 && mCycleTimer.isValid()) {
+		setCycleTime(static_cast<int>(mCycleTimer.elapsed()));
+		mCycleTimer.invalidate();
+	}
+	dispatch();
+}
+
+void BusScheduler::onTimer()
+{
+	schedule();
+}
+
+void BusScheduler::dispatch()
+{
+	Q_ASSERT(!mBusy);
+	// Clients which are not able to send anything when asked are skipped.
+	// They will call `schedule` when their situation changes.
+	QList<BusClient *> skipped;
+	for (;;) {
+		int count = mClients.size();
+		int selected = -1;
+		int minDue = BusClient::NotDue;
+		ModbusRtu::Priority maxPriority = ModbusRtu::ScanPriority;
+		for (int i=0; i<count; ++i) {
+			int index = (mNextClient + i) % count;
+			BusClient *client = mClients[index];
+			if (skipped.contains(client))
+				continue;
+			int due = client->msecsUntilDue();
+			if (due == BusClient::NotDue)
+				continue;
+			ModbusRtu::Priority priority = client->priority();
+			bool better = false;
+			if (due <= 0 && minDue <= 0) {
+				better = priority > maxPriority ||
+						 (priority == maxPriority && due < minDue);
+			} else {
+				better = due < minDue;
+			}
+			if (better) {
+				minDue = due;
+				maxPriority = priority;
+				selected = index;
+			}
+		}
+		if (selected == -1)
+			return;
+		if (minDue > 0) {
+			mTimer->start(minDue);
+			return;
+		}
+		BusClient *client = mClients[selected];
+		if (!mCycleTimer.isValid()) {
+			// Start a new cycle containing all clients which are due now.
+			mPendingCount = 0;
+			for (int i=0; i<count; ++i) {
+				bool due = mClients[i]->msecsUntilDue() <= 0;
+				mPendingInCycle[i] = due;
+				if (due)
+					++mPendingCount;
+			}
+			mCycleTimer.start();
+		}
+		mNextClient = (selected + 1) % count;
+		mBusy = true;
+		if (client->startRequest()) {
+			if (mPendingInCycle[selected]) {
+				mPendingInCycle[selected] = false;
+				--mPendingCount;
+			}
+			mTimer->stop();
+			return;
+		}
+		mBusy = false;
+		skipped.append(client);
+	}
+}
+
+void BusScheduler::setCycleTime(int t)
+{
+	if (mCycleTime == t)
+		return;
+	mCycleTime = t;
+	QLOG_DEBUG() << "Bus cycle time:" << t << "ms";
+}
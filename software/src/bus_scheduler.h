@@ -0,0 +1,106 @@
+#ifndef BUS_SCHEDULER_H
+#define BUS_SCHEDULER_H
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QObject>
+#include <QVector>
+#include "modbus_rtu.h"
+
+class QTimer;
+
+/*!
+ * Interface for objects which send requests over a bus managed by
+ * `BusScheduler`. A client should never use the modbus connection on its own
+ * initiative. Instead it should call `BusScheduler::schedule` whenever it has
+ * work to do, and wait until `startRequest` is called.
+ */
+class BusClient
+{
+public:
+	virtual ~BusClient() {}
+
+	/*!
+	 * Returns the number of milliseconds until the client wants to send its
+	 * next request. A negative value indicates that the request is overdue
+	 * (the more negative, the more urgent). Returns `NotDue` if the client
+	 * has nothing to send, or if it is still waiting for the reply on a
+	 * previous request.
+	 */
+	virtual int msecsUntilDue() const = 0;
+
+	/*!
+	 * Returns the priority of the next request. Among the clients that are
+	 * due, the one with the highest priority is served first.
+	 */
+	virtual ModbusRtu::Priority priority() const = 0;
+
+	/*!
+	 * Called by the scheduler when the client may send a single request.
+	 * Returns false if the client did not send anything.
+	 */
+	virtual bool startRequest() = 0;
+
+	static const int NotDue = 0x7FFFFFFF;
+};
+
+/*!
+ * Decides which client may use the modbus connection next.
+ * All batteries (and the device scanner) on a serial port share a single
+ * scheduler. Whenever the bus becomes idle, the client with the most overdue
+ * request is allowed to send, unless a due client has a higher priority.
+ * Clients which are equally late are served in round-robin order. This keeps
+ * the bus busy without gaps, and prevents a client from starving the others.
+ *
+ * The scheduler also measures the cycle time: the time needed to serve all
+ * clients that were due at the start of the cycle.
+ */
+class BusScheduler : public QObject
+{
+	Q_OBJECT
+public:
+	BusScheduler(ModbusRtu *modbus, QObject *parent = 0);
+
+	ModbusRtu *modbus() const;
+
+	void addClient(BusClient *client);
+
+	void removeClient(BusClient *client);
+
+	/*!
+	 * Should be called by a client whenever the value returned by
+	 * `msecsUntilDue` may have changed.
+	 */
+	void schedule();
+
+	/*!
+	 * The time (ms) needed to complete the last cycle. Published by
+	 * `PortWorker` as part of the `BusMetrics`.
+	 */
+	int cycleTime() const;
+
+private slots:
+	void onTransactionFinished();
+
+	void onTimer();
+
+private:
+	void dispatch();
+
+	void setCycleTime(int t);
+
+	ModbusRtu *mModbus;
+	QTimer *mTimer;
+	QList<BusClient *> mClients;
+	int mNextClient;
+	bool mBusy;
+	// Set for the clients which were due at the start of the current cycle,
+	// and have not sent a request since. Indexed like mClients. Flags are
+	// used instead of a list of clients, so a cycle does not allocate.
+	QVector<bool> mPendingInCycle;
+	int mPendingCount;
+	QElapsedTimer mCycleTimer;
+	int mCycleTime;
+};
+
+#endif // BUS_SCHEDULER_H
@@ -6,6 +6,11 @@
 
 /*!
  * Computes CRC16 checksum according to the Modbus TCU standard.
+ *
+ * Data is processed 4 bytes per step using 4 lookup tables (slicing-by-4).
+ * If memory is tight, define `CRC16_SINGLE_TABLE` at compile time. Only a
+ * single table with 256 16-bit entries will be used, at the expense of
+ * roughly 3 times lower throughput.
  */
 class Crc16
 {
@@ -23,6 +28,8 @@ public:
 
 	void add(const QByteArray &bytes);
 
+	void add(const uint8_t *bytes, int count);
+
 	void reset();
 
 	/*!
@@ -32,9 +39,14 @@ public:
 	 */
 	static uint16_t getValue(const QByteArray &bytes);
 
+	static uint16_t getValue(const uint8_t *bytes, int count);
+
 private:
-	uint8_t mCrcLo;
-	uint8_t mCrcHi;
+	static uint16_t update(uint16_t crc, const uint8_t *bytes, int count);
+
+	// Note that the CRC is stored in the order used for computation, which
+	// has the bytes swapped relative to the value returned by `getValue`.
+	uint16_t mCrc;
 };
 
 #endif // CRC16_H
@@ -3,25 +3,42 @@
 #include <QTimer>
 #include <velib/qt/v_busitem.h>
 #include <velib/qt/v_busitems.h>
+#include "age_statistics.h"
 #include "v_bus_node.h"
 #include "dbus_bridge.h"
+#include "monotonic_clock.h"
 
 Q_DECLARE_METATYPE(QList<int>)
 
 DBusBridge::DBusBridge(QObject *parent) :
 	QObject(parent),
+	mService(0),
 	mServiceRegistered(false),
 	mUpdateBusy(false),
-	mUpdateTimer(0)
+	mUpdateTimer(0),
+	mAgeStatistics(0)
 {
 }
 
 DBusBridge::DBusBridge(const QString &serviceName, QObject *parent):
 	QObject(parent),
+	mService(0),
 	mServiceName(serviceName),
 	mServiceRegistered(false),
 	mUpdateBusy(false),
-	mUpdateTimer(0)
+	mUpdateTimer(0),
+	mAgeStatistics(0)
+{
+}
+
+DBusBridge::DBusBridge(DBusBridge *service, QObject *parent):
+	QObject(parent),
+	mService(service),
+	mServiceName(service->serviceName()),
+	mServiceRegistered(false),
+	mUpdateBusy(false),
+	mUpdateTimer(0),
+	mAgeStatistics(0)
 {
 }
 
@@ -104,6 +121,26 @@ void DBusBridge::consume(const QString &service, QObject *src,
 	consume(service, src, property, path);
 }
 
+void DBusBridge::produceAge(const QString &agePath, const QString &samplePath,
+							const QString &statisticsPath)
+{
+	if (mAgeStatistics != 0) {
+		QLOG_ERROR() << "Age already published on" << mServiceName;
+		return;
+	}
+	mAgeStatistics = new AgeStatistics(this);
+	mAgeSamplePath = samplePath;
+	onAgeTimer();
+	produce(mAgeStatistics, "age", agePath, "s", 3);
+	produce(mAgeStatistics, "p50", statisticsPath + "/P50", "ms", 0);
+	produce(mAgeStatistics, "p90", statisticsPath + "/P90", "ms", 0);
+	produce(mAgeStatistics, "p99", statisticsPath + "/P99", "ms", 0);
+	QTimer *timer = new QTimer(this);
+	timer->setInterval(1000);
+	connect(timer, SIGNAL(timeout()), this, SLOT(onAgeTimer()));
+	timer->start();
+}
+
 QString DBusBridge::serviceName() const
 {
 	return mServiceName;
@@ -138,6 +175,11 @@ bool DBusBridge::fromDBus(const QString &, QVariant &)
 	return true;
 }
 
+qint64 DBusBridge::sampleTime(const QString &) const
+{
+	return -1;
+}
+
 bool DBusBridge::addSetting(const QString &path,
 							const QVariant &defaultValue,
 							const QVariant &minValue,
@@ -260,6 +302,11 @@ void DBusBridge::onUpdateTimer()
 	}
 }
 
+void DBusBridge::onAgeTimer()
+{
+	mAgeStatistics->setSampleTime(sampleTime(mAgeSamplePath));
+}
+
 void DBusBridge::connectItem(VBusItem *busItem, QObject *src,
 							 const char *property, const QString &path)
 {
@@ -292,7 +339,9 @@ void DBusBridge::connectItem(VBusItem *busItem, QObject *src,
 					QMetaMethod signal = mp.notifySignal();
 					int index = metaObject()->indexOfSlot("onPropertyChanged()");
 					QMetaMethod slot = metaObject()->method(index);
-					connect(src, signal, this, slot);
+					// Properties may share a notify signal (such as the alarms of
+					// BatteryController). onPropertyChanged handles all of them.
+					connect(src, signal, this, slot, Qt::UniqueConnection);
 				}
 				bib.property = mp;
 			}
@@ -304,6 +353,11 @@ void DBusBridge::connectItem(VBusItem *busItem, QObject *src,
 
 void DBusBridge::addVBusNodes(const QString &path, VBusItem *vbi)
 {
+	if (mService != 0) {
+		// Registering a second root object on the service would fail.
+		mService->addVBusNodes(path, vbi);
+		return;
+	}
 	if (mServiceRoot.isNull()) {
 		QDBusConnection connection = VBusItems::getConnection(serviceName());
 		mServiceRoot = new VBusNode(connection, "/", this);
@@ -318,6 +372,11 @@ void DBusBridge::publishValue(DBusBridge::BusItemBridge &item)
 		return;
 	if (!value.isValid())
 		value = QVariant::fromValue(QList<int>());
+	if (mAgeStatistics != 0) {
+		qint64 t = sampleTime(item.path);
+		if (t >= 0)
+			mAgeStatistics->add(monotonicTime() - t);
+	}
 	mUpdateBusy = true;
 
 	item.item->setValue(value);
@@ -7,6 +7,7 @@
 #include <QPointer>
 #include <QString>
 
+class AgeStatistics;
 class QDBusConnection;
 class QDBusVariant;
 class QTimer;
@@ -32,6 +33,13 @@ public:
 
 	DBusBridge(const QString &serviceName, QObject *parent);
 
+	/*!
+	 * Creates a bridge which adds its objects to the service of `service`.
+	 * Both bridges share the root node of the service, so the service should
+	 * only be registered by `service`, which must outlive this bridge.
+	 */
+	DBusBridge(DBusBridge *service, QObject *parent);
+
 	~DBusBridge();
 
 	void setUpdateInterval(int interval);
@@ -87,6 +95,19 @@ public:
 				 QObject *src, const char *property, double defaultValue,
 				 double minValue, double maxValue, const QString &path);
 
+	/*!
+	 * \brief Publishes the age of the values sent to the DBus.
+	 * `agePath` will contain the current age (s) of the value published on
+	 * `samplePath`. It is refreshed every second, so a client can tell how
+	 * old the value it is reading is. The `P50`, `P90`, and `P99` items below
+	 * `statisticsPath` will contain percentiles (ms) of the age of all values
+	 * at the moment they were sent (see `AgeStatistics`). Ages are computed
+	 * using `sampleTime`, and include the delay caused by
+	 * `setUpdateInterval`.
+	 */
+	void produceAge(const QString &agePath, const QString &samplePath,
+					const QString &statisticsPath);
+
 	QString serviceName() const;
 
 	void setServiceName(const QString &sn);
@@ -126,6 +147,15 @@ protected:
 	 */
 	virtual bool fromDBus(const QString &path, QVariant &v);
 
+	/*!
+	 * \brief Returns the time at which the value of a DBus object was measured.
+	 * Used by `produceAge`. The time (µs, see `monotonicTime`) is the moment
+	 * the Modbus reply containing the value was received.
+	 * The default implementation returns -1, which means the time is unknown.
+	 * \param path The path to the DBus object.
+	 */
+	virtual qint64 sampleTime(const QString &path) const;
+
 private slots:
 	void onPropertyChanged();
 
@@ -133,6 +163,8 @@ private slots:
 
 	void onUpdateTimer();
 
+	void onAgeTimer();
+
 private:
 	void connectItem(VBusItem *item, QObject *src, const char *property,
 					 const QString &path);
@@ -153,10 +185,13 @@ private:
 
 	QList<BusItemBridge> mBusItems;
 	QPointer<VBusNode> mServiceRoot;
+	DBusBridge *mService;
 	QString mServiceName;
 	bool mServiceRegistered;
 	bool mUpdateBusy;
 	QTimer *mUpdateTimer;
+	AgeStatistics *mAgeStatistics;
+	QString mAgeSamplePath;
 };
 
 #endif // DBUS_BRIDGE_H
@@ -1,46 +1,119 @@
+#include <QFileInfo>
 #include <QsLog.h>
+#include <QThread>
 #include <QTimer>
+#include "baud_rate_selector.h"
 #include "battery_controller_bridge.h"
+#include "battery_controller_link.h"
 #include "battery_controller_updater.h"
 #include "battery_controller.h"
 #include "battery_summary.h"
 #include "battery_summary_bridge.h"
+#include "bus_diagnostics.h"
+#include "bus_diagnostics_bridge.h"
 #include "dbus_redflow.h"
-#include "device_scanner.h"
+#include "port_worker.h"
 
-DBusRedflow::DBusRedflow(const QString &portName, QObject *parent):
+DBusRedflow::DBusRedflow(const QStringList &portNames, int baudRate,
+						 double replaySpeed, QObject *parent):
 	QObject(parent),
-	mDeviceScanner(0),
-	mModbus(new ModbusRtu(portName, 19200, this)),
-	mPortName(portName),
 	mSummary(0)
 {
 	qRegisterMetaType<ConnectionState>();
-	qRegisterMetaType<QList<quint16> >();
+	qRegisterMetaType<RegisterValues>();
+	qRegisterMetaType<BatteryControllerUpdater *>();
+	qRegisterMetaType<BusMetrics>();
 
-	mModbus->setTimeout(250);
-	connect(mModbus, SIGNAL(serialEvent(const char *)),
-			this, SLOT(onSerialEvent(const char *)));
+	foreach (const QString &portName, portNames) {
+		QThread *thread = new QThread(this);
+		PortWorker *worker = new PortWorker(portName, baudRate);
+		if (replaySpeed > 0)
+			worker->setReplaySpeed(replaySpeed);
+		worker->moveToThread(thread);
+		connect(thread, SIGNAL(started()), worker, SLOT(start()));
+		connect(thread, SIGNAL(finished()), worker, SLOT(deleteLater()));
+		connect(worker, SIGNAL(serialEvent(QString)),
+				this, SLOT(onSerialEvent(QString)), Qt::QueuedConnection);
+		connect(worker, SIGNAL(updaterCreated(BatteryControllerUpdater *, int)),
+				this, SLOT(onUpdaterCreated(BatteryControllerUpdater *, int)));
+		BusDiagnostics *diagnostics = new BusDiagnostics(portName, this);
+		connect(worker, SIGNAL(metricsUpdated(BusMetrics)),
+				diagnostics, SLOT(update(BusMetrics)));
+		mDiagnostics.append(diagnostics);
+		mWorkers.append(worker);
+		mThreads.append(thread);
+		thread->start();
+	}
+
+	int scanTimeout = 7500;
+	if (baudRate == PortWorker::AutoBaudRate && replaySpeed <= 0)
+		scanTimeout += BaudRateSelector::maxProbeTime();
+	QTimer::singleShot(scanTimeout, this, SLOT(onScanTimeout()));
+}
+
+DBusRedflow::~DBusRedflow()
+{
+	foreach (QThread *thread, mThreads) {
+		thread->quit();
+		thread->wait();
+	}
+	// The controllers release their slot in mBank, so they must be deleted
+	// before mBank.
+	qDeleteAll(mBatteryControllers);
+}
+
+void DBusRedflow::setPollInterval(PollTier tier, int interval)
+{
+	foreach (PortWorker *worker, mWorkers) {
+		QMetaObject::invokeMethod(worker, "setPollInterval", Qt::QueuedConnection,
+								  Q_ARG(int, tier), Q_ARG(int, interval));
+	}
+}
 
-	mDeviceScanner = new DeviceScanner(mModbus, this);
-	connect(mDeviceScanner, SIGNAL(deviceFound(int)), this, SLOT(onDeviceFound(int)));
+void DBusRedflow::setGapTolerance(int t)
+{
+	foreach (PortWorker *worker, mWorkers) {
+		QMetaObject::invokeMethod(worker, "setGapTolerance", Qt::QueuedConnection,
+								  Q_ARG(int, t));
+	}
+}
 
-	QTimer::singleShot(7500, this, SLOT(onScanTimeout()));
+void DBusRedflow::startCapture(const QString &fileName, qint64 maxSize)
+{
+	foreach (PortWorker *worker, mWorkers) {
+		QString name = fileName;
+		if (mWorkers.size() > 1)
+			name += "." + QFileInfo(worker->portName()).fileName();
+		QMetaObject::invokeMethod(worker, "startCapture", Qt::QueuedConnection,
+								  Q_ARG(QString, name), Q_ARG(qint64, maxSize));
+	}
 }
 
-void DBusRedflow::onDeviceFound(int address)
+void DBusRedflow::onUpdaterCreated(BatteryControllerUpdater *updater,
+								   int address)
 {
+	PortWorker *worker = static_cast<PortWorker *>(sender());
 	foreach (BatteryController *c, mBatteryControllers) {
-		if (c->DeviceAddress() == address)
+		if (c->DeviceAddress() == address) {
+			// The D-Bus service name is derived from the device address, so
+			// addresses must be unique across all ports.
+			QLOG_ERROR() << "Ignoring device with address" << address
+						 << "on" << worker->portName()
+						 << "because the address is already used on"
+						 << c->portName();
+			// The updater lives in the worker thread, so it must be deleted
+			// there.
+			QMetaObject::invokeMethod(worker, "removeDevice",
+									  Qt::QueuedConnection, Q_ARG(int, address));
 			return;
+		}
 	}
-	BatteryController *m = new BatteryController(mPortName, address, this);
-	new BatteryControllerUpdater(m, mModbus, m);
+	BatteryController *m = new BatteryController(&mBank, worker->portName(), address, this);
+	new BatteryControllerLink(m, updater, m);
 	mBatteryControllers.append(m);
 	connect(m, SIGNAL(connectionStateChanged()),
 			this, SLOT(onConnectionStateChanged()));
-	mModbus->setTimeout(1000);
-	mDeviceScanner->setScanInterval(4000);
+	QMetaObject::invokeMethod(updater, "start", Qt::QueuedConnection);
 }
 
 void DBusRedflow::onConnectionStateChanged()
@@ -79,12 +152,17 @@ void DBusRedflow::onDeviceInitialized(BatteryController *battery)
 {
 	new BatteryControllerBridge(battery, battery);
 	if (mSummary == 0) {
-		mSummary = new BatterySummary(this);
+		mSummary = new BatterySummary(&mBank, this);
 		// Make sure we add the battery before registration. The addBattery
 		// function will update the values within the summary, so we avoid
 		// registering a service without valid values.
 		mSummary->addBattery(battery);
+		foreach (PortWorker *worker, mWorkers) {
+			connect(mSummary, SIGNAL(broadcastRequested(int, int)),
+					worker, SLOT(broadcastWrite(int, int)));
+		}
 		BatterySummaryBridge *bridge = new BatterySummaryBridge(mSummary, mSummary);
+		new BusDiagnosticsBridge(mDiagnostics, bridge, bridge);
 		bridge->registerService();
 	} else {
 		mSummary->addBattery(battery);
@@ -103,18 +181,9 @@ void DBusRedflow::onConnectionLost(BatteryController *battery)
 	exit(1);
 }
 
-void DBusRedflow::onSerialEvent(const char *description)
+void DBusRedflow::onSerialEvent(const QString &description)
 {
 	QLOG_ERROR() << "Serial event:" << description
 				 << "Application will shut down.";
 	exit(1);
 }
-
-void DBusRedflow::addUpdater(int deviceAddress)
-{
-	BatteryController *m = new BatteryController(mPortName, deviceAddress, this);
-	new BatteryControllerUpdater(m, mModbus, m);
-	mBatteryControllers.append(m);
-	connect(m, SIGNAL(connectionStateChanged()),
-			this, SLOT(onConnectionStateChanged()));
-}
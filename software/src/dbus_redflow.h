@@ -3,12 +3,16 @@
 
 #include <QObject>
 #include <QList>
+#include <QStringList>
+#include "battery_bank.h"
+#include "zbm_registers.h"
 
 class BatteryController;
 class BatteryControllerUpdater;
 class BatterySummary;
-class DeviceScanner;
-class ModbusRtu;
+class BusDiagnostics;
+class PortWorker;
+class QThread;
 
 /*!
  * Main object which ties everything together.
@@ -21,18 +25,49 @@ class ModbusRtu;
  *
  * Finally, this class will detect the presence of a multi within the setup,
  * which we need for the Hub-4 control loop.
+ *
+ * Each serial port is handled by a `PortWorker` running in its own thread.
+ * The batteries found on all ports are published on the main thread, and
+ * share a single `BatterySummary`.
  */
 class DBusRedflow : public QObject
 {
 	Q_OBJECT
 public:
-	DBusRedflow(const QString &portName, QObject *parent = 0);
+	/*!
+	 * Creates a `PortWorker` for each port. Use `PortWorker::AutoBaudRate`
+	 * to select the baud rate automatically. If `replaySpeed` is larger than
+	 * zero, the port names are capture files, which are replayed instead of
+	 * opening serial ports (see `PortWorker::setReplaySpeed`).
+	 */
+	DBusRedflow(const QStringList &portNames, int baudRate, double replaySpeed,
+				QObject *parent = 0);
+
+	virtual ~DBusRedflow();
+
+	/*!
+	 * Sets the poll interval of the given tier for all batteries, including
+	 * the ones found later on.
+	 */
+	void setPollInterval(PollTier tier, int interval);
+
+	/*!
+	 * Sets the gap tolerance (see `BatteryControllerUpdater::setGapTolerance`)
+	 * for all batteries, including the ones found later on.
+	 */
+	void setGapTolerance(int t);
+
+	/*!
+	 * Records all serial traffic in capture files. If there is more than one
+	 * port, the name of the port is appended to `fileName`.
+	 */
+	void startCapture(const QString &fileName, qint64 maxSize);
 
 signals:
 	void connectionLost();
 
 private slots:
-	void onDeviceFound(int address);
+	void onUpdaterCreated(BatteryControllerUpdater *updater, int address);
 
 	void onDeviceFound(BatteryController *battery);
 
@@ -44,14 +79,14 @@ private slots:
 
 	void onScanTimeout();
 
-	void onSerialEvent(const char *description);
+	void onSerialEvent(const QString &description);
 
 private:
-	void addUpdater(int deviceAddress);
-
-	DeviceScanner *mDeviceScanner;
-	ModbusRtu *mModbus;
-	QString mPortName;
+	QList<PortWorker *> mWorkers;
+	QList<QThread *> mThreads;
+	// Utilisation of each port, indexed like mWorkers.
+	QList<BusDiagnostics *> mDiagnostics;
+	BatteryBank mBank;
 	QList<BatteryController *> mBatteryControllers;
 	BatterySummary *mSummary;
 };
@@ -1,28 +1,34 @@
 #include <QsLog.h>
-#include <QTimer>
+#include "bus_scheduler.h"
 #include "device_scanner.h"
 #include "modbus_rtu.h"
+#include "zbm_registers.h"
 
 static const quint8 DefaultAddress1 = 1;
 static const quint8 DefaultAddress2 = 99;
 
-DeviceScanner::DeviceScanner(ModbusRtu *modbus, QObject *parent):
+DeviceScanner::DeviceScanner(BusScheduler *scheduler, QObject *parent):
 	QObject(parent),
-	mModbus(modbus),
+	mScheduler(scheduler),
+	mModbus(scheduler->modbus()),
 	mScanInterval(0),
 	mProbedAddress(0),
 	mNewDeviceAddress(0),
 	mAutoScanAddress(DefaultAddress1 + 1),
-	mMaxAddress(1)
+	mMaxAddress(1),
+	mAction(NoAction),
+	mBusy(false),
+	mDelay(0)
 {
-	Q_ASSERT(modbus != 0);
+	Q_ASSERT(scheduler != 0);
+	mScheduler->addClient(this);
 	scanAddress(DefaultAddress1);
-	connect(mModbus, SIGNAL(readCompleted(int, quint8, const QList<quint16> &)),
-			this, SLOT(onReadCompleted(int, quint8, QList<quint16>)));
-	connect(mModbus, SIGNAL(writeCompleted(int, quint8, quint16, quint16)),
-			this, SLOT(onWriteCompleted(int, quint8, quint16, quint16)));
-	connect(mModbus, SIGNAL(errorReceived(int, quint8, int)),
-			this, SLOT(onErrorReceived(int, quint8, int)));
+}
+
+DeviceScanner::~DeviceScanner()
+{
+	mScheduler->removeClient(this);
+	mModbus->removeListener(this);
 }
 
 int DeviceScanner::scanInterval() const
@@ -35,13 +41,44 @@ void DeviceScanner::setScanInterval(int i)
 	mScanInterval = i;
 }
 
-void DeviceScanner::onReadCompleted(int function, quint8 slaveAddress,
-									const QList<quint16> &values)
+int DeviceScanner::msecsUntilDue() const
+{
+	if (mBusy || mAction == NoAction)
+		return NotDue;
+	return mDelay - static_cast<int>(mDelayTimer.elapsed());
+}
+
+ModbusRtu::Priority DeviceScanner::priority() const
+{
+	return mAction == ChangeAddress ? ModbusRtu::WritePriority : ModbusRtu::ScanPriority;
+}
+
+bool DeviceScanner::startRequest()
+{
+	switch (mAction) {
+	case Probe:
+		mModbus->readRegisters(this, ModbusRtu::ReadHoldingRegisters, mProbedAddress,
+							   RegSerial, 1, ModbusRtu::ScanPriority);
+		break;
+	case ChangeAddress:
+		QLOG_INFO() << "Change modbus address from" << mNewDeviceAddress
+					<< "to" << mProbedAddress;
+		mModbus->writeRegister(this, ModbusRtu::WriteSingleRegister,
+							   mNewDeviceAddress, RegDeviceAddress, mProbedAddress);
+		break;
+	default:
+		return false;
+	}
+	mBusy = true;
+	return true;
+}
+
+void DeviceScanner::onReadCompleted(const ModbusRequest &request,
+									const RegisterView &values)
 {
-	Q_UNUSED(function);
+	Q_UNUSED(request);
 	Q_UNUSED(values);
-	if (slaveAddress != mProbedAddress)
-		return;
+	mBusy = false;
 	// We have a successful read. There are several options here:
 	// * We found a new device mProbedAddress with default address (1 or 99)
 	//   * Create a new candidate address (max address + 1) and try to read from
@@ -63,13 +100,14 @@ void DeviceScanner::onReadCompleted(int function, quint8 slaveAddress,
 	}
 }
 
-void DeviceScanner::onWriteCompleted(int function, quint8 slaveAddress,
+void DeviceScanner::onWriteCompleted(const ModbusRequest &request,
 									 quint16 address, quint16 value)
 {
-	Q_UNUSED(function)
+	Q_UNUSED(request)
+	Q_UNUSED(address)
 	Q_UNUSED(value)
-	if (slaveAddress != mNewDeviceAddress || address != 0x9030)
-		return;
+	mBusy = false;
+	mAction = NoAction;
 	// We get here if mCandidate address has been written to the device.
 	// Let's find out if the operation was successful.
 	mMaxAddress = qMax(mMaxAddress, mProbedAddress);
@@ -77,12 +115,12 @@ void DeviceScanner::onWriteCompleted(int function, quint8 slaveAddress,
 	addNewDevice(mProbedAddress);
 }
 
-void DeviceScanner::onErrorReceived(int errorType, quint8 slaveAddress,
-									int exception)
+void DeviceScanner::onErrorReceived(const ModbusRequest &request,
+									int errorType, int exception)
 {
+	Q_UNUSED(request);
 	Q_UNUSED(exception);
-	if (slaveAddress != mProbedAddress)
-		return;
+	mBusy = false;
 	/// @todo EV This may also be a write error.
 	if (errorType == ModbusRtu::Timeout) {
 		// No device found. Options:
@@ -90,10 +128,7 @@ void DeviceScanner::onErrorReceived(int errorType, quint8 slaveAddress,
 		//   new device.
 		// * Random device scan failed to find a device, try next address
 		if (mNewDeviceAddress > 0) {
-			QLOG_INFO() << "Change modbus address from" << mNewDeviceAddress
-						<< "to" << mProbedAddress;
-			mModbus->writeRegister(ModbusRtu::WriteSingleRegister,
-								   mNewDeviceAddress, 0x9030, mProbedAddress);
+			changeAddress();
 		} else {
 			scanAddress(getNextScanAddress(mProbedAddress));
 		}
@@ -102,11 +137,6 @@ void DeviceScanner::onErrorReceived(int errorType, quint8 slaveAddress,
 	}
 }
 
-void DeviceScanner::onTimer()
-{
-	mModbus->readRegisters(ModbusRtu::ReadHoldingRegisters, mProbedAddress, 0x9010, 1);
-}
-
 quint8 DeviceScanner::getNextCandidateAddress() const
 {
 	for (quint8 a = mMaxAddress + 1;; ++a) {
@@ -148,9 +178,16 @@ void DeviceScanner::scanAddress(quint8 address)
 {
 	QLOG_TRACE() << "Polling modbus address" << address;
 	mProbedAddress = address;
-	if (mScanInterval < 250) {
-		mModbus->readRegisters(ModbusRtu::ReadHoldingRegisters, address, 0x9010, 1);
-	} else {
-		QTimer::singleShot(mScanInterval - 250, this, SLOT(onTimer()));
-	}
+	mAction = Probe;
+	mDelay = mScanInterval < 250 ? 0 : mScanInterval - 250;
+	mDelayTimer.start();
+	mScheduler->schedule();
+}
+
+void DeviceScanner::changeAddress()
+{
+	mAction = ChangeAddress;
+	mDelay = 0;
+	mDelayTimer.start();
+	mScheduler->schedule();
 }
@@ -1,36 +1,46 @@
 #ifndef DEVICE_SCANNER_H
 #define DEVICE_SCANNER_H
 
+#include <QElapsedTimer>
 #include <QList>
 #include <QObject>
-
-class ModbusRtu;
-class QTimer;
+#include "bus_scheduler.h"
 
 /// Finds Redflow batteries via modbus RTU
-class DeviceScanner : public QObject
+class DeviceScanner : public QObject, public BusClient, public ModbusListener
 {
 	Q_OBJECT
 public:
-	DeviceScanner(ModbusRtu *modbus, QObject *parent);
+	DeviceScanner(BusScheduler *scheduler, QObject *parent);
+
+	virtual ~DeviceScanner();
 
 	int scanInterval() const;
 
 	void setScanInterval(int i);
 
-signals:
-	void deviceFound(int address);
+	virtual int msecsUntilDue() const;
+
+	virtual ModbusRtu::Priority priority() const;
 
-private slots:
-	void onReadCompleted(int function, quint8 slaveAddress, const QList<quint16> &values);
+	virtual bool startRequest();
 
-	void onWriteCompleted(int function, quint8 slaveAddress, quint16 address, quint16 value);
+	virtual void onReadCompleted(const ModbusRequest &request, const RegisterView &values);
 
-	void onErrorReceived(int errorType, quint8 slaveAddress, int exception);
+	virtual void onWriteCompleted(const ModbusRequest &request, quint16 address, quint16 value);
 
-	void onTimer();
+	virtual void onErrorReceived(const ModbusRequest &request, int errorType, int exception);
+
+signals:
+	void deviceFound(int address);
 
 private:
+	enum Action {
+		NoAction,
+		Probe,
+		ChangeAddress
+	};
+
 	quint8 getNextCandidateAddress() const;
 
 	quint8 getNextScanAddress(quint8 address);
@@ -39,12 +49,19 @@ private:
 
 	void scanAddress(quint8 address);
 
+	void changeAddress();
+
+	BusScheduler *mScheduler;
 	ModbusRtu *mModbus;
 	int mScanInterval;
 	quint8 mProbedAddress;
 	quint8 mNewDeviceAddress;
 	quint8 mAutoScanAddress;
 	quint8 mMaxAddress;
+	Action mAction;
+	bool mBusy;
+	int mDelay;
+	QElapsedTimer mDelayTimer;
 };
 
 #endif // DEVICE_SCANNER_H
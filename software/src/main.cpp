@@ -5,6 +5,7 @@
 #include <velib/qt/v_busitem.h>
 #include <velib/qt/v_busitems.h>
 #include "dbus_redflow.h"
+#include "port_worker.h"
 #include "version.h"
 
 void initLogger(QsLogging::Level logLevel)
@@ -39,6 +40,40 @@ void initDBus(const QString &dbusAddress)
 	QLOG_INFO() << "Local settings found";
 }
 
+void showUsage(const QString &appName)
+{
+	QLOG_INFO() << appName;
+	QLOG_INFO() << "\t-h, --help";
+	QLOG_INFO() << "\t Show this message.";
+	QLOG_INFO() << "\t-V, --version";
+	QLOG_INFO() << "\t Show the application version.";
+	QLOG_INFO() << "\t-d level, --debug level";
+	QLOG_INFO() << "\t Set log level";
+	QLOG_INFO() << "\t-b, --dbus";
+	QLOG_INFO() << "\t dbus address or 'session' or 'system'";
+	QLOG_INFO() << "\t-p intervals, --poll-intervals intervals";
+	QLOG_INFO() << "\t Poll intervals in ms of the fast, status, slow, and health registers";
+	QLOG_INFO() << "\t (eg. 1000,5000,15000,60000). Empty values keep the default.";
+	QLOG_INFO() << "\t-g count, --gap-tolerance count";
+	QLOG_INFO() << "\t Maximum number of unused registers included in a single read (default";
+	QLOG_INFO() << "\t 8). Use -1 to read each register separately.";
+	QLOG_INFO() << "\t-r rate, --baudrate rate";
+	QLOG_INFO() << "\t Baud rate of the serial ports (default 19200). Use 'auto' to select";
+	QLOG_INFO() << "\t the highest rate at which the batteries reply reliably.";
+	QLOG_INFO() << "\t-c file, --capture file";
+	QLOG_INFO() << "\t Record all serial traffic in a capture file. Use trace-decoder to view it.";
+	QLOG_INFO() << "\t--capture-size size";
+	QLOG_INFO() << "\t Maximum disk space used by the capture in kB (default 4096).";
+	QLOG_INFO() << "\t--replay file";
+	QLOG_INFO() << "\t Serve the replies from a capture file instead of a serial port. May be";
+	QLOG_INFO() << "\t used more than once to replay multiple ports. No port names are needed.";
+	QLOG_INFO() << "\t--replay-speed factor";
+	QLOG_INFO() << "\t Divide the recorded reply delays by factor (default 1).";
+	QLOG_INFO() << "\t <Port Name> [<Port Name> ...]";
+	QLOG_INFO() << "\t Name of communication port (eg. /dev/ttyUSB0). Multiple ports may be";
+	QLOG_INFO() << "\t specified, each port will be handled by its own thread.";
+}
+
 extern "C"
 {
 // This function is called by the serial port API from velib when the device is
@@ -57,7 +92,22 @@ int main(int argc, char *argv[])
 
 	bool expectVerbosity = false;
 	bool expectDBusAddress = false;
-	QString portName;
+	bool expectPollIntervals = false;
+	bool expectBaudRate = false;
+	int baudRate = 19200;
+	bool expectCaptureFile = false;
+	bool expectCaptureSize = false;
+	QString captureFile;
+	qint64 captureSize = 4096 * 1024;
+	bool expectReplayFile = false;
+	bool expectReplaySpeed = false;
+	QStringList replayFiles;
+	double replaySpeed = 1;
+	QStringList portNames;
+	QStringList pollIntervals;
+	bool expectGapTolerance = false;
+	bool gapToleranceSet = false;
+	int gapTolerance = 0;
 	QString dbusAddress = "system";
 	QStringList args = app.arguments();
 	args.pop_front();
@@ -73,18 +123,52 @@ int main(int argc, char *argv[])
 		} else if (expectDBusAddress) {
 			dbusAddress = arg;
 			expectDBusAddress = false;
+		} else if (expectPollIntervals) {
+			pollIntervals = arg.split(',');
+			expectPollIntervals = false;
+		} else if (expectGapTolerance) {
+			bool ok = false;
+			gapTolerance = arg.toInt(&ok);
+			if (!ok) {
+				QLOG_ERROR() << "Invalid gap tolerance:" << arg;
+				exit(2);
+			}
+			gapToleranceSet = true;
+			expectGapTolerance = false;
+		} else if (expectBaudRate) {
+			bool ok = false;
+			baudRate = arg == "auto" ? PortWorker::AutoBaudRate : arg.toInt(&ok);
+			if (arg != "auto" && (!ok || baudRate <= 0)) {
+				QLOG_ERROR() << "Invalid baud rate:" << arg;
+				exit(2);
+			}
+			expectBaudRate = false;
+		} else if (expectCaptureFile) {
+			captureFile = arg;
+			expectCaptureFile = false;
+		} else if (expectCaptureSize) {
+			bool ok = false;
+			int size = arg.toInt(&ok);
+			if (!ok || size <= 0) {
+				QLOG_ERROR() << "Invalid capture size:" << arg;
+				showUsage(app.arguments().first());
+				exit(2);
+			}
+			captureSize = 1024 * static_cast<qint64>(size);
+			expectCaptureSize = false;
+		} else if (expectReplayFile) {
+			replayFiles.append(arg);
+			expectReplayFile = false;
+		} else if (expectReplaySpeed) {
+			bool ok = false;
+			replaySpeed = arg.toDouble(&ok);
+			if (!ok || replaySpeed <= 0) {
+				QLOG_ERROR() << "Invalid replay speed:" << arg;
+				exit(2);
+			}
+			expectReplaySpeed = false;
 		} else if (arg == "-h" || arg == "--help") {
-			QLOG_INFO() << app.arguments().first();
-			QLOG_INFO() << "\t-h, --help";
-			QLOG_INFO() << "\t Show this message.";
-			QLOG_INFO() << "\t-V, --version";
-			QLOG_INFO() << "\t Show the application version.";
-			QLOG_INFO() << "\t-d level, --debug level";
-			QLOG_INFO() << "\t Set log level";
-			QLOG_INFO() << "\t-b, --dbus";
-			QLOG_INFO() << "\t dbus address or 'session' or 'system'";
-			QLOG_INFO() << "\t <Port Name>";
-			QLOG_INFO() << "\t Name of communication port (eg. /dev/ttyUSB0)";
+			showUsage(app.arguments().first());
 			exit(1);
 		} else if (arg == "-V" || arg == "--version") {
 			QLOG_INFO() << VERSION << "(" REVISION ")";
@@ -96,21 +180,58 @@ int main(int argc, char *argv[])
 			logger.setIncludeTimestamp(true);
 		} else if (arg == "-b" || arg == "--dbus") {
 			expectDBusAddress = true;
+		} else if (arg == "-p" || arg == "--poll-intervals") {
+			expectPollIntervals = true;
+		} else if (arg == "-g" || arg == "--gap-tolerance") {
+			expectGapTolerance = true;
+		} else if (arg == "-r" || arg == "--baudrate") {
+			expectBaudRate = true;
+		} else if (arg == "-c" || arg == "--capture") {
+			expectCaptureFile = true;
+		} else if (arg == "--capture-size") {
+			expectCaptureSize = true;
+		} else if (arg == "--replay") {
+			expectReplayFile = true;
+		} else if (arg == "--replay-speed") {
+			expectReplaySpeed = true;
 		} else if (!arg.startsWith('-')) {
-			portName = arg;
+			if (!portNames.contains(arg))
+				portNames.append(arg);
 		}
 	}
 
-	if (portName.isEmpty()) {
+	if (!replayFiles.isEmpty()) {
+		if (!portNames.isEmpty())
+			QLOG_WARN() << "Replaying capture files, ignoring port names";
+		portNames = replayFiles;
+	}
+
+	if (portNames.isEmpty()) {
 		QLOG_ERROR() << "No communication port specified on command line";
 		exit(2);
+	}
+
+	if (replayFiles.isEmpty()) {
+		initDBus(dbusAddress);
 	} else {
-		QLOG_INFO() << "Connecting to" << portName;
+		// When replaying, the service usually runs on a session bus without
+		// local settings.
+		VBusItems::setDBusAddress(dbusAddress);
+	}
+
+	DBusRedflow a(portNames, baudRate, replayFiles.isEmpty() ? 0 : replaySpeed);
+	for (int i=0; i<pollIntervals.size() && i<PollTierCount; ++i) {
+		bool ok = false;
+		int interval = pollIntervals[i].toInt(&ok);
+		if (ok && interval > 0)
+			a.setPollInterval(static_cast<PollTier>(i), interval);
 	}
 
-	initDBus(dbusAddress);
+	if (gapToleranceSet)
+		a.setGapTolerance(gapTolerance);
 
-	DBusRedflow a(portName);
+	if (!captureFile.isEmpty())
+		a.startCapture(captureFile, captureSize);
 
 	app.connect(&a, SIGNAL(connectionLost()), &app, SLOT(quit()));
 
@@ -1,14 +1,49 @@
 #include <QMutexLocker>
+#include <QsLog.h>
 #include <QTimer>
-#include <unistd.h>
+#include <string.h>
 #include "defines.h"
 #include "modbus_rtu.h"
+#include "monotonic_clock.h"
+#include "replay_port.h"
+#include "trace_recorder.h"
+
+// Lower limits of the timeout (ms) when round trip statistics are available.
+// Probes get a larger margin, because a missed reply to a probe may cause the
+// device scanner to assign an address which is already in use.
+static const int MinimumTimeout = 50;
+static const int MinimumProbeTimeout = 100;
+// Upper limit of the round trip variance after a timeout, as a multiple of
+// the smoothed round trip time. Keeps the timeout of a slave which has gone
+// silent close to its usual round trip time.
+static const int MaxTimeoutVarianceFactor = 2;
+// Time (ms) the devices need to process a broadcast before the next request
+// may be sent. The Modbus serial line specification suggests 100 to 200 ms.
+static const int TurnaroundDelay = 100;
+// Lower limit of the silent interval (ms) which marks the end of a frame.
+// Serial drivers deliver received data in bursts, so shorter gaps may occur
+// within a frame. USB adapters need a larger margin: an FTDI adapter holds
+// back received data for up to 16 ms (its latency timer).
+static const int MinimumSilentInterval = 5;
+static const int MinimumUsbSilentInterval = 20;
+// Upper limit (ms) of the gaps measured within a reply which are taken into
+// account by the silent interval. Keeps a single stall of the driver from
+// delaying the detection of corrupted replies for good.
+static const int MaxChunkGap = 100;
 
 ModbusRtu::ModbusRtu(const QString &portName, int baudrate, QObject *parent):
 	QObject(parent),
 	mPortName(portName.toLatin1()),
+	mReplayPort(0),
 	mTimer(new QTimer(this)),
-	mCurrentSlave(0)
+	mGapTimer(new QTimer(this)),
+	mSilenceTimer(new QTimer(this)),
+	mSilenceCheckPending(false),
+	mLastHandle(InvalidHandle),
+	mTimeout(1000),
+	mProbeTimeout(250),
+	mTraceRecorder(0),
+	mTxLength(0)
 {
 	memset(&mSerialPort, 0, sizeof(mSerialPort));
 	// The pointer returned by mPortName.data() will remain valid as long as
@@ -19,288 +54,873 @@ ModbusRtu::ModbusRtu(const QString &portName, int baudrate, QObject *parent):
 	mSerialPort.rxCallback = onDataRead;
 	mSerialPort.eventCallback = onSerialEvent;
 	veSerialOpen(&mSerialPort, this);
+	init();
+}
 
-	mData.reserve(16);
+ModbusRtu::ModbusRtu(ReplayPort *replayPort, QObject *parent):
+	QObject(parent),
+	mReplayPort(replayPort),
+	mTimer(new QTimer(this)),
+	mGapTimer(new QTimer(this)),
+	mSilenceTimer(new QTimer(this)),
+	mSilenceCheckPending(false),
+	mLastHandle(InvalidHandle),
+	mTimeout(1000),
+	mProbeTimeout(250),
+	mTraceRecorder(0),
+	mTxLength(0)
+{
+	Q_ASSERT(replayPort != 0);
+	memset(&mSerialPort, 0, sizeof(mSerialPort));
+	int baudrate = replayPort->baudRate();
+	mSerialPort.baudrate = static_cast<un32>(baudrate > 0 ? baudrate : 19200);
+	replayPort->setParent(this);
+	connect(replayPort, SIGNAL(dataReceived(QByteArray)),
+			this, SLOT(onReplayData(QByteArray)));
+	init();
+}
 
+void ModbusRtu::init()
+{
 	resetStateEngine();
-	mTimer->setInterval(1000);
+	memset(mTiming, 0, sizeof(mTiming));
+	mTimer->setSingleShot(true);
 	connect(mTimer, SIGNAL(timeout()), this, SLOT(onTimeout()));
+	mGapTimer->setSingleShot(true);
+	connect(mGapTimer, SIGNAL(timeout()), this, SLOT(onGapTimeout()));
+	mSilenceTimer->setSingleShot(true);
+	connect(mSilenceTimer, SIGNAL(timeout()), this, SLOT(onSilenceTimeout()));
+	memset(&mStatistics, 0, sizeof(mStatistics));
+	mChunkGap = 0;
+	mFrameChunkGap = -1;
+	updateSilentInterval();
 }
 
 ModbusRtu::~ModbusRtu()
 {
-	veSerialClose(&mSerialPort);
+	if (mReplayPort == 0)
+		veSerialClose(&mSerialPort);
 }
 
 void ModbusRtu::setTimeout(int timeout)
 {
-	mTimer->setInterval(timeout);
+	QMutexLocker lock(&mMutex);
+	mTimeout = timeout;
 }
 
-void ModbusRtu::readRegisters(FunctionCode function, quint8 slaveAddress,
-							  quint16 startReg, quint16 count)
+void ModbusRtu::setProbeTimeout(int timeout)
 {
 	QMutexLocker lock(&mMutex);
-	if (mState == Idle) {
-		_readRegisters(function, slaveAddress, startReg, count);
-	} else {
-		Cmd cmd;
-		cmd.function = function;
-		cmd.slaveAddress = slaveAddress;
-		cmd.reg = startReg;
-		cmd.value = count;
-		mPendingCommands.append(cmd);
+	mProbeTimeout = timeout;
+}
+
+int ModbusRtu::baudRate() const
+{
+	QMutexLocker lock(&mMutex);
+	return static_cast<int>(mSerialPort.baudrate);
+}
+
+void ModbusRtu::setBaudRate(int baudrate)
+{
+	QMutexLocker lock(&mMutex);
+	if (static_cast<int>(mSerialPort.baudrate) == baudrate)
+		return;
+	QLOG_INFO() << "Changing baud rate of" << mPortName << "to" << baudrate;
+	mSerialPort.baudrate = static_cast<un32>(baudrate);
+	if (mReplayPort == 0)
+		veSerialSetBaud(&mSerialPort, mSerialPort.baudrate);
+	memset(mTiming, 0, sizeof(mTiming));
+	updateSilentInterval();
+	if (mTraceRecorder != 0)
+		mTraceRecorder->recordBaudRate(timestamp(), baudrate);
+}
+
+ModbusRtu::Statistics ModbusRtu::statistics() const
+{
+	QMutexLocker lock(&mMutex);
+	return mStatistics;
+}
+
+int ModbusRtu::queueDepth() const
+{
+	QMutexLocker lock(&mMutex);
+	return mPendingCommands.size();
+}
+
+QMap<int, LatencyHistogram> ModbusRtu::roundTripHistograms() const
+{
+	QMutexLocker lock(&mMutex);
+	QMap<int, LatencyHistogram> result;
+	for (int i=0; i<256; ++i) {
+		if (mRoundTrips[i].count() > 0)
+			result.insert(i, mRoundTrips[i]);
 	}
+	return result;
 }
 
-void ModbusRtu::writeRegister(FunctionCode function, quint8 slaveAddress,
-							  quint16 reg, quint16 value)
+void ModbusRtu::setTraceRecorder(TraceRecorder *recorder)
 {
 	QMutexLocker lock(&mMutex);
-	if (mState == Idle) {
-		_writeRegister(function, slaveAddress, reg, value);
-	} else {
-		Cmd cmd;
-		cmd.function = function;
-		cmd.slaveAddress = slaveAddress;
-		cmd.reg	= reg;
-		cmd.value = value;
-		mPendingCommands.append(cmd);
+	mTraceRecorder = recorder;
+	if (mTraceRecorder != 0)
+		mTraceRecorder->recordBaudRate(timestamp(), static_cast<int>(mSerialPort.baudrate));
+}
+
+int ModbusRtu::roundTripTime(quint8 slaveAddress) const
+{
+	QMutexLocker lock(&mMutex);
+	int srtt = mTiming[slaveAddress].srtt;
+	return srtt == 0 ? -1 : (srtt + 500) / 1000;
+}
+
+qint64 ModbusRtu::timestamp() const
+{
+	return monotonicTime();
+}
+
+ModbusRtu::Handle ModbusRtu::readRegisters(ModbusListener *listener,
+										   FunctionCode function,
+										   quint8 slaveAddress,
+										   quint16 startReg, quint16 count,
+										   Priority priority, int timeout)
+{
+	if (slaveAddress == BroadcastAddress) {
+		QLOG_ERROR() << "Reading registers from the broadcast address is not possible";
+		return InvalidHandle;
+	}
+	QMutexLocker lock(&mMutex);
+	Cmd cmd = createCommand(listener, function, slaveAddress, priority, timeout);
+	cmd.reg = startReg;
+	cmd.value = count;
+	return issue(cmd);
+}
+
+ModbusRtu::Handle ModbusRtu::writeRegister(ModbusListener *listener,
+										   FunctionCode function,
+										   quint8 slaveAddress, quint16 reg,
+										   quint16 value, Priority priority,
+										   int timeout)
+{
+	QMutexLocker lock(&mMutex);
+	Cmd cmd = createCommand(listener, function, slaveAddress, priority, timeout);
+	cmd.reg = reg;
+	cmd.value = value;
+	return issue(cmd);
+}
+
+ModbusRtu::Handle ModbusRtu::writeRegisters(ModbusListener *listener,
+											quint8 slaveAddress,
+											quint16 startReg,
+											const quint16 *values, int count,
+											Priority priority, int timeout)
+{
+	Q_ASSERT(count > 0 && count <= MaxWriteCount);
+	QMutexLocker lock(&mMutex);
+	Cmd cmd = createCommand(listener, WriteMultipleRegisters, slaveAddress,
+							priority, timeout);
+	cmd.writeReg = startReg;
+	cmd.writeCount = static_cast<quint16>(count);
+	memcpy(cmd.values, values, count * sizeof(quint16));
+	return issue(cmd);
+}
+
+ModbusRtu::Handle ModbusRtu::writeReadRegisters(ModbusListener *listener,
+												quint8 slaveAddress,
+												quint16 writeReg,
+												const quint16 *values,
+												int count,
+												quint16 readReg,
+												quint16 readCount,
+												Priority priority,
+												int timeout)
+{
+	if (slaveAddress == BroadcastAddress) {
+		QLOG_ERROR() << "Reading registers from the broadcast address is not possible";
+		return InvalidHandle;
+	}
+	Q_ASSERT(count > 0 && count <= MaxWriteReadCount);
+	QMutexLocker lock(&mMutex);
+	Cmd cmd = createCommand(listener, ReadWriteMultipleRegisters, slaveAddress,
+							priority, timeout);
+	cmd.reg = readReg;
+	cmd.value = readCount;
+	cmd.writeReg = writeReg;
+	cmd.writeCount = static_cast<quint16>(count);
+	memcpy(cmd.values, values, count * sizeof(quint16));
+	return issue(cmd);
+}
+
+bool ModbusRtu::cancel(Handle handle)
+{
+	QMutexLocker lock(&mMutex);
+	if (mState != Idle && mCurrent.request.handle == handle) {
+		mCurrent.listener = 0;
+		return true;
+	}
+	for (int i=0; i<mPendingCommands.size(); ++i) {
+		if (mPendingCommands[i].request.handle == handle) {
+			mPendingCommands.removeAt(i);
+			return true;
+		}
+	}
+	for (int i=0; i<mDroppedCommands.size(); ++i) {
+		if (mDroppedCommands[i].request.handle == handle) {
+			mDroppedCommands.removeAt(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+void ModbusRtu::removeListener(ModbusListener *listener)
+{
+	QMutexLocker lock(&mMutex);
+	if (mCurrent.listener == listener)
+		mCurrent.listener = 0;
+	for (int i=mPendingCommands.size() - 1; i>=0; --i) {
+		if (mPendingCommands[i].listener == listener)
+			mPendingCommands.removeAt(i);
+	}
+	for (int i=mDroppedCommands.size() - 1; i>=0; --i) {
+		if (mDroppedCommands[i].listener == listener)
+			mDroppedCommands.removeAt(i);
 	}
 }
 
 void ModbusRtu::onTimeout()
 {
 	QMutexLocker lock(&mMutex);
-	if (mState == Idle || mState == Process)
+	if (mState == Idle || mState == Gap || mState == Process)
 		return;
-	quint8 cs = mCurrentSlave;
-	resetStateEngine();
-	processPending();
+	if (mState == Turnaround) {
+		onTurnaroundFinished();
+		return;
+	}
+	ErrorType error = mCrcErrorSeen ? CrcError : Timeout;
+	if (error == CrcError)
+		++mStatistics.crcErrors;
+	else
+		++mStatistics.timeouts;
+	SlaveTiming &timing = mTiming[mCurrent.request.slaveAddress];
+	if (timing.srtt > 0 && mCurrent.priority != ScanPriority) {
+		// Replies arriving after the timeout cannot be measured. Increase the
+		// variance, so the timeout will grow if the slave has become slower.
+		// Probes (eg. of a quarantined battery) are often not answered at
+		// all, so they are left out.
+		int limit = qMax(1000, MaxTimeoutVarianceFactor * timing.srtt);
+		timing.rttvar = qMax(timing.rttvar,
+							 qMin(qMax(2 * timing.rttvar, 1000), limit));
+	}
+	Cmd cmd = finishRequest();
+	mMutex.unlockInline();
+	if (cmd.listener != 0)
+		cmd.listener->onErrorReceived(cmd.request, error, 0);
+	emit requestFinished();
+}
+
+void ModbusRtu::onTurnaroundFinished()
+{
+	Cmd cmd = finishRequest();
 	mMutex.unlockInline();
-	emit errorReceived(Timeout, cs, 0);
+	// Only WriteSingleRegister and WriteMultipleRegisters may be broadcast.
+	// For the latter, `value` is not used.
+	if (cmd.listener != 0) {
+		quint16 reg = cmd.request.function == WriteMultipleRegisters ?
+			cmd.writeReg : cmd.reg;
+		quint16 value = cmd.request.function == WriteMultipleRegisters ?
+			cmd.writeCount : cmd.value;
+		cmd.listener->onWriteCompleted(cmd.request, reg, value);
+	}
+	emit requestFinished();
 }
 
 void ModbusRtu::processPacket()
 {
 	QMutexLocker lock(&mMutex);
-	quint8 cs = mCurrentSlave;
-	if (mCrc != mCrcBuilder.getValue()) {
-		resetStateEngine();
-		processPending();
+	const quint8 *frame = mFrameBuffer;
+	++mStatistics.replies;
+	if ((frame[1] & 0x80) != 0) {
+		++mStatistics.exceptions;
+		quint8 errorCode = frame[2];
+		Cmd cmd = finishRequest();
 		mMutex.unlockInline();
-		emit errorReceived(CrcError, cs, 0);
+		if (cmd.listener != 0)
+			cmd.listener->onErrorReceived(cmd.request, Exception, errorCode);
+		emit requestFinished();
 		return;
 	}
-	if ((mFunction & 0x80) != 0) {
-		quint8 errorCode = static_cast<quint8>(mData[0]);
-		resetStateEngine();
-		processPending();
-		mMutex.unlockInline();
-		emit errorReceived(Exception, cs, errorCode);
-		return;
-	}
-	if (mState == Function) {
-		FunctionCode function = mFunction;
-		resetStateEngine();
-		processPending();
-		mMutex.unlockInline();
-		emit errorReceived(Unsupported, cs, function);
-		return;
-	}
-	FunctionCode function = mFunction;
+	FunctionCode function = static_cast<FunctionCode>(frame[1]);
 	switch (function) {
 	case ReadHoldingRegisters:
 	case ReadInputRegisters:
+	case ReadWriteMultipleRegisters:
 	{
-		QList<quint16> registers;
-		for (int i=0; i<mData.length(); i+=2) {
-			registers.append(toUInt16(mData, i));
-		}
-		resetStateEngine();
-		processPending();
+		// mRegisters is only used from this thread, so it is safe to pass it to
+		// the listener after releasing the lock.
+		int count = frame[2] / 2;
+		const quint8 *data = frame + 3;
+		for (int i=0; i<count; ++i)
+			mRegisters[i] = toUInt16(data[2 * i], data[2 * i + 1]);
+		Cmd cmd = finishRequest();
 		mMutex.unlockInline();
-		emit readCompleted(function, cs, registers);
+		if (cmd.listener != 0)
+			cmd.listener->onReadCompleted(cmd.request, RegisterView(mRegisters, count));
+		emit requestFinished();
 		return;
 	}
 	case WriteSingleRegister:
+	case WriteMultipleRegisters:
 	{
-		quint16 value = toUInt16(mData, 0);
-		quint16 startAddress = mStartAddress;
-		resetStateEngine();
-		processPending();
+		// The reply to WriteMultipleRegisters contains the number of
+		// registers written instead of the value.
+		quint16 startAddress = toUInt16(frame[2], frame[3]);
+		quint16 value = toUInt16(frame[4], frame[5]);
+		Cmd cmd = finishRequest();
 		mMutex.unlockInline();
-		emit writeCompleted(function, cs, startAddress, value);
+		if (cmd.listener != 0)
+			cmd.listener->onWriteCompleted(cmd.request, startAddress, value);
+		emit requestFinished();
 		return;
 	}
 	default:
-		break;
+	{
+		Cmd cmd = finishRequest();
+		mMutex.unlockInline();
+		if (cmd.listener != 0)
+			cmd.listener->onErrorReceived(cmd.request, Unsupported, function);
+		emit requestFinished();
+		return;
+	}
 	}
 }
 
-void ModbusRtu::handleByteRead(quint8 b)
+void ModbusRtu::reportDroppedCommands()
 {
-	if (mAddToCrc)
-		mCrcBuilder.add(b);
-	switch (mState) {
-	case Idle:
-	case Process:
-		// We received data when we were not expecting any. Ignore the data.
-		break;
-	case Address:
-		if (b == mCurrentSlave)
-			mState = Function;
-		break;
-	case Function:
-		mFunction = static_cast<FunctionCode>(b);
-		if ((mFunction & 0x80) != 0) {
-			// Exception
-			mCount = 1;
-			mState = Data;
-		} else {
-			switch (mFunction) {
-			case ReadHoldingRegisters:
-			case ReadInputRegisters:
-				mState = ByteCount;
-				break;
-			case WriteSingleRegister:
-				mState = StartAddressMsb;
-				break;
-			default:
-				mState = Address;
-				break;
-			}
-		}
-		break;
-	case ByteCount:
-		mCount = b;
-		if (mCount == 0) {
-			mState = CrcMsb;
-			mAddToCrc = false;
-		} else {
-			mState = Data;
-		}
-		break;
-	case StartAddressMsb:
-		mStartAddress = static_cast<quint16>(b << 8);
-		mState = StartAddressLsb;
-		break;
-	case StartAddressLsb:
-		mStartAddress |= b;
-		mCount = 2;
-		mState = Data;
-		break;
-	case Data:
-		if (mCount > 0) {
-			mData.append(static_cast<char>(b));
-			--mCount;
+	QMutexLocker lock(&mMutex);
+	QList<Cmd> dropped = mDroppedCommands;
+	mDroppedCommands.clear();
+	qint64 now = timestamp();
+	lock.unlock();
+	for (int i=0; i<dropped.size(); ++i) {
+		Cmd &cmd = dropped[i];
+		cmd.request.completed = now;
+		if (cmd.listener != 0)
+			cmd.listener->onErrorReceived(cmd.request, QueueFull, 0);
+	}
+}
+
+void ModbusRtu::reportUnsupported()
+{
+	QMutexLocker lock(&mMutex);
+	if (mState != Process)
+		return;
+	Cmd cmd = finishRequest();
+	lock.unlock();
+	if (cmd.listener != 0)
+		cmd.listener->onErrorReceived(cmd.request, Unsupported, cmd.request.function);
+	emit requestFinished();
+}
+
+void ModbusRtu::onGapTimeout()
+{
+	QMutexLocker lock(&mMutex);
+	if (mState == Gap)
+		transmit();
+}
+
+void ModbusRtu::armSilenceTimer()
+{
+	QMutexLocker lock(&mMutex);
+	mSilenceCheckPending = false;
+	if (mState == Receiving && !mSilenceTimer->isActive())
+		mSilenceTimer->start((mSilentInterval + 999) / 1000);
+}
+
+void ModbusRtu::onSilenceTimeout()
+{
+	QMutexLocker lock(&mMutex);
+	if (mState != Receiving)
+		return;
+	qint64 silence = mLastActivity.nsecsElapsed() / 1000;
+	if (silence < mSilentInterval) {
+		mSilenceTimer->start(static_cast<int>((mSilentInterval - silence + 999) / 1000));
+		return;
+	}
+	// The line has gone quiet without a complete reply. If nothing in the
+	// received data looked like the reply we are waiting for, it was foreign
+	// traffic which has already been discarded, and the reply may still come.
+	if (mFrameLength == 0 && !mCrcErrorSeen)
+		return;
+	// Otherwise the reply was corrupted, and there is no need to wait for the
+	// timeout.
+	++mStatistics.crcErrors;
+	Cmd cmd = finishRequest();
+	mMutex.unlockInline();
+	if (cmd.listener != 0)
+		cmd.listener->onErrorReceived(cmd.request, CrcError, 0);
+	emit requestFinished();
+}
+
+void ModbusRtu::appendData(const quint8 *buffer, int length)
+{
+	while (length > 0 && mState == Receiving) {
+		int n = qMin(length, MaxFrameSize - mFrameLength);
+		memcpy(mFrameBuffer + mFrameLength, buffer, static_cast<size_t>(n));
+		mFrameLength += n;
+		buffer += n;
+		length -= n;
+		parseFrame();
+	}
+}
+
+void ModbusRtu::parseFrame()
+{
+	int start = 0;
+	for (;;) {
+		// Skip everything that cannot be the start of the reply we are
+		// waiting for.
+		while (start < mFrameLength &&
+			   mFrameBuffer[start] != mCurrent.request.slaveAddress)
+			++start;
+		const quint8 *frame = mFrameBuffer + start;
+		int available = mFrameLength - start;
+		int expected = expectedFrameLength(frame, available);
+		if (expected < 0) {
+			++start;
+			continue;
 		}
-		if (mCount == 0) {
-			mState = CrcMsb;
-			mAddToCrc = false;
+		if (expected == 0 || available < expected)
+			break;
+		quint16 crc = toUInt16(frame[expected - 2], frame[expected - 1]);
+		if (Crc16::getValue(frame, expected - 2) == crc) {
+			++mStatistics.frames;
+			if (mFrameChunkGap > mChunkGap && mChunkGap < 1000 * MaxChunkGap) {
+				mChunkGap = qMin(mFrameChunkGap, 1000 * MaxChunkGap);
+				updateSilentInterval();
+			}
+			addRoundTrip(mCurrent.request.slaveAddress,
+						 static_cast<int>(timestamp() - mCurrent.request.sent),
+						 wireTime(mTxLength + expected));
+			memmove(mFrameBuffer, frame, static_cast<size_t>(expected));
+			mFrameLength = expected;
+			mState = Process;
+			// Queued, because the lock is still held by the caller.
+			QMetaObject::invokeMethod(this, "processPacket", Qt::QueuedConnection);
+			return;
 		}
-		break;
-	case CrcMsb:
-		mCrc = static_cast<quint16>(b << 8);
-		mState = CrcLsb;
-		break;
-	case CrcLsb:
-		mCrc |= b;
-		mState = Process;
-		QMetaObject::invokeMethod(this, "processPacket");
-		break;
+		// This may be a corrupted reply, or garbage which happens to start
+		// with the slave address. Keep looking for a valid frame, and report
+		// a CRC error if none is found before the timeout.
+		mCrcErrorSeen = true;
+		++start;
+	}
+	if (start > 0) {
+		mFrameLength -= start;
+		memmove(mFrameBuffer, mFrameBuffer + start, static_cast<size_t>(mFrameLength));
 	}
 }
 
+int ModbusRtu::currentTimeout() const
+{
+	if (mCurrent.timeout > 0)
+		return mCurrent.timeout;
+	const SlaveTiming &timing = mTiming[mCurrent.request.slaveAddress];
+	bool probe = mCurrent.priority == ScanPriority;
+	// The statistics do not include the time needed to transmit the frames,
+	// because it depends on the size of the request and the reply.
+	int wire = (wireTime(mTxLength + expectedReplyLength(mCurrent)) + 999) / 1000;
+	if (timing.srtt == 0)
+		return (probe ? mProbeTimeout : mTimeout) + wire;
+	int rto = (timing.srtt + 4 * timing.rttvar + 999) / 1000;
+	if (probe)
+		return qBound(MinimumProbeTimeout, rto, mProbeTimeout) + wire;
+	return qBound(MinimumTimeout, rto, mTimeout) + wire;
+}
+
+void ModbusRtu::addRoundTrip(quint8 slaveAddress, int microseconds, int wireTime)
+{
+	mRoundTrips[slaveAddress].add(microseconds);
+	SlaveTiming &timing = mTiming[slaveAddress];
+	int rtt = qMax(0, microseconds - wireTime);
+	if (timing.srtt == 0) {
+		timing.srtt = qMax(1, rtt);
+		timing.rttvar = rtt / 2;
+	} else {
+		timing.rttvar = (3 * timing.rttvar + qAbs(timing.srtt - rtt)) / 4;
+		timing.srtt = qMax(1, (7 * timing.srtt + rtt) / 8);
+	}
+}
+
+void ModbusRtu::addTraffic(int length)
+{
+	mStatistics.bytes += static_cast<quint32>(length);
+	mStatistics.lineTime += static_cast<quint64>(wireTime(length));
+}
+
+int ModbusRtu::wireTime(int length) const
+{
+	// 10 bits per character, like the gap computed in `send`.
+	return static_cast<int>(static_cast<qint64>(length) * 10 * 1000 * 1000 /
+							mSerialPort.baudrate);
+}
+
+int ModbusRtu::expectedReplyLength(const Cmd &cmd)
+{
+	switch (cmd.request.function) {
+	case ReadHoldingRegisters:
+	case ReadInputRegisters:
+	case ReadWriteMultipleRegisters:
+		return 5 + 2 * cmd.value;
+	default:
+		return 8;
+	}
+}
+
+int ModbusRtu::expectedFrameLength(const quint8 *frame, int length)
+{
+	// Returns the length of the frame including address and CRC, 0 if more
+	// data is needed to determine the length, and -1 if the data cannot be
+	// the start of a valid reply.
+	if (length < 2)
+		return 0;
+	quint8 function = frame[1];
+	if ((function & 0x80) != 0)
+		return 5;
+	switch (function) {
+	case ReadHoldingRegisters:
+	case ReadInputRegisters:
+	case ReadWriteMultipleRegisters:
+	{
+		if (length < 3)
+			return 0;
+		int count = frame[2];
+		if (count > MaxFrameSize - 5)
+			return -1;
+		return count + 5;
+	}
+	case WriteSingleRegister:
+	case WriteMultipleRegisters:
+		return 8;
+	default:
+		return -1;
+	}
+}
+
+void ModbusRtu::updateSilentInterval()
+{
+	// The Modbus specification uses 3.5 character times, with a fixed value
+	// of 1750 µs above 19200 baud.
+	int baudrate = static_cast<int>(mSerialPort.baudrate);
+	mSilentInterval = baudrate > 19200 ? 1750 : (35 * 1000 * 1000) / baudrate;
+	bool usb = mPortName.contains("ttyUSB") || mPortName.contains("ttyACM");
+	int minimum = usb ? MinimumUsbSilentInterval : MinimumSilentInterval;
+	mSilentInterval = qMax(mSilentInterval, 1000 * minimum);
+	// Gaps seen within valid replies may occur again, so add a margin.
+	mSilentInterval = qMax(mSilentInterval, mChunkGap + mChunkGap / 2);
+}
+
 void ModbusRtu::resetStateEngine()
 {
 	mState = Idle;
-	mCrcBuilder.reset();
-	mAddToCrc = true;
-	mCurrentSlave = 0;
-	mData.clear();
+	mFrameLength = 0;
+	mCrcErrorSeen = false;
+	mCurrent.listener = 0;
 	mTimer->stop();
+	mGapTimer->stop();
+	mSilenceTimer->stop();
+}
+
+ModbusRtu::Cmd ModbusRtu::createCommand(ModbusListener *listener,
+										FunctionCode function,
+										quint8 slaveAddress,
+										Priority priority, int timeout)
+{
+	Cmd cmd;
+	cmd.listener = listener;
+	cmd.request.handle = ++mLastHandle;
+	if (cmd.request.handle == InvalidHandle)
+		cmd.request.handle = ++mLastHandle;
+	cmd.request.function = function;
+	cmd.request.slaveAddress = slaveAddress;
+	cmd.request.issued = timestamp();
+	cmd.request.sent = -1;
+	cmd.request.completed = -1;
+	cmd.request.timeout = 0;
+	cmd.reg = 0;
+	cmd.value = 0;
+	cmd.writeReg = 0;
+	cmd.writeCount = 0;
+	cmd.priority = priority;
+	cmd.timeout = timeout;
+	return cmd;
+}
+
+ModbusRtu::Handle ModbusRtu::issue(const Cmd &cmd)
+{
+	if (mState != Idle)
+		return enqueue(cmd);
+	start(cmd);
+	return cmd.request.handle;
+}
+
+ModbusRtu::Handle ModbusRtu::enqueue(const Cmd &cmd)
+{
+	Cmd c = cmd;
+	bool isRead = c.request.function == ReadHoldingRegisters ||
+				  c.request.function == ReadInputRegisters;
+	if (isRead) {
+		// An identical read from the same listener is already pending, so
+		// there is no need to send it twice. We only have to make sure it is
+		// sent in time for the new request. The listener will see the handle
+		// of the pending read.
+		for (int i=0; i<mPendingCommands.size(); ++i) {
+			const Cmd &p = mPendingCommands[i];
+			if (p.listener == c.listener &&
+				p.request.function == c.request.function &&
+				p.request.slaveAddress == c.request.slaveAddress &&
+				p.reg == c.reg && p.value == c.value) {
+				if (p.priority >= c.priority)
+					return p.request.handle;
+				c.request = p.request;
+				mPendingCommands.removeAt(i);
+				break;
+			}
+		}
+	}
+	if (mPendingCommands.size() >= MaxPendingCommands) {
+		// The last command has the lowest priority, and is the most recent
+		// among commands with that priority.
+		if (mPendingCommands.last().priority >= c.priority) {
+			dropCommand(c);
+			return c.request.handle;
+		}
+		dropCommand(mPendingCommands.takeLast());
+	}
+	int i = mPendingCommands.size();
+	while (i > 0 && mPendingCommands[i - 1].priority < c.priority)
+		--i;
+	mPendingCommands.insert(i, c);
+	return c.request.handle;
+}
+
+void ModbusRtu::dropCommand(const Cmd &cmd)
+{
+	// The error is reported from the event loop, because the caller may
+	// expect that the request has not been handled yet when the read/write
+	// function returns.
+	if (mDroppedCommands.isEmpty())
+		QMetaObject::invokeMethod(this, "reportDroppedCommands", Qt::QueuedConnection);
+	mDroppedCommands.append(cmd);
 }
 
 void ModbusRtu::processPending()
 {
 	if (mPendingCommands.isEmpty())
 		return;
-	const Cmd &cmd = mPendingCommands.first();
-	switch (cmd.function) {
+	start(mPendingCommands.takeFirst());
+}
+
+ModbusRtu::Cmd ModbusRtu::finishRequest()
+{
+	// Returns the request which has just been completed, so its result can
+	// be reported after the lock has been released. The next request is
+	// started right away.
+	Cmd cmd = mCurrent;
+	cmd.request.completed = timestamp();
+	resetStateEngine();
+	processPending();
+	return cmd;
+}
+
+void ModbusRtu::start(const Cmd &cmd)
+{
+	Q_ASSERT(mState == Idle);
+	mCurrent = cmd;
+	switch (cmd.request.function) {
 	case ReadHoldingRegisters:
 	case ReadInputRegisters:
-		_readRegisters(cmd.function, cmd.slaveAddress, cmd.reg, cmd.value);
+		_readRegisters(cmd);
 		break;
 	case WriteSingleRegister:
-		_writeRegister(cmd.function, cmd.slaveAddress, cmd.reg, cmd.value);
+		_writeRegister(cmd);
+		break;
+	case WriteMultipleRegisters:
+		_writeRegisters(cmd);
+		break;
+	case ReadWriteMultipleRegisters:
+		_writeReadRegisters(cmd);
 		break;
 	default:
+		QLOG_ERROR() << "Unsupported modbus function" << cmd.request.function;
+		// Reported like a reply, so the bus is released. Queued, because the
+		// lock is held by the caller.
+		mState = Process;
+		QMetaObject::invokeMethod(this, "reportUnsupported", Qt::QueuedConnection);
 		break;
 	}
-	mPendingCommands.removeFirst();
 }
 
-void ModbusRtu::_readRegisters(ModbusRtu::FunctionCode function,
-							   quint8 slaveAddress, quint16 startReg,
-							   quint16 count)
+void ModbusRtu::_readRegisters(const Cmd &cmd)
 {
-	Q_ASSERT(mState == Idle);
-	QByteArray frame;
-	frame.reserve(8);
-	frame.append(static_cast<char>(slaveAddress));
-	frame.append(static_cast<char>(function));
-	frame.append(static_cast<char>(msb(startReg)));
-	frame.append(static_cast<char>(lsb(startReg)));
-	frame.append(static_cast<char>(msb(count)));
-	frame.append(static_cast<char>(lsb(count)));
-	send(frame);
+	Q_ASSERT(cmd.request.slaveAddress != BroadcastAddress);
+	quint8 *frame = mTxFrame;
+	frame[0] = cmd.request.slaveAddress;
+	frame[1] = static_cast<quint8>(cmd.request.function);
+	frame[2] = msb(cmd.reg);
+	frame[3] = lsb(cmd.reg);
+	frame[4] = msb(cmd.value);
+	frame[5] = lsb(cmd.value);
+	send(6);
 }
 
-void ModbusRtu::_writeRegister(ModbusRtu::FunctionCode function,
-							   quint8 slaveAddress, quint16 reg, quint16 value)
+void ModbusRtu::_writeRegister(const Cmd &cmd)
 {
-	Q_ASSERT(mState == Idle);
-	QByteArray frame;
-	frame.reserve(8);
-	frame.append(static_cast<char>(slaveAddress));
-	frame.append(static_cast<char>(function));
-	frame.append(static_cast<char>(msb(reg)));
-	frame.append(static_cast<char>(lsb(reg)));
-	frame.append(static_cast<char>(msb(value)));
-	frame.append(static_cast<char>(lsb(value)));
-	send(frame);
+	quint8 *frame = mTxFrame;
+	frame[0] = cmd.request.slaveAddress;
+	frame[1] = static_cast<quint8>(cmd.request.function);
+	frame[2] = msb(cmd.reg);
+	frame[3] = lsb(cmd.reg);
+	frame[4] = msb(cmd.value);
+	frame[5] = lsb(cmd.value);
+	send(6);
+}
+
+void ModbusRtu::_writeRegisters(const Cmd &cmd)
+{
+	const quint16 *values = cmd.values;
+	quint16 count = cmd.writeCount;
+	Q_ASSERT(count > 0 && count <= MaxWriteCount);
+	quint8 *frame = mTxFrame;
+	frame[0] = cmd.request.slaveAddress;
+	frame[1] = static_cast<quint8>(WriteMultipleRegisters);
+	frame[2] = msb(cmd.writeReg);
+	frame[3] = lsb(cmd.writeReg);
+	frame[4] = msb(count);
+	frame[5] = lsb(count);
+	frame[6] = static_cast<quint8>(2 * count);
+	quint8 *data = frame + 7;
+	for (int i=0; i<count; ++i) {
+		data[2 * i] = msb(values[i]);
+		data[2 * i + 1] = lsb(values[i]);
+	}
+	send(7 + 2 * count);
 }
 
-void ModbusRtu::send(QByteArray &data)
+void ModbusRtu::_writeReadRegisters(const Cmd &cmd)
 {
+	const quint16 *values = cmd.values;
+	quint16 count = cmd.writeCount;
+	Q_ASSERT(count > 0 && count <= MaxWriteReadCount);
+	Q_ASSERT(cmd.value > 0 && cmd.value <= MaxRegisterCount);
+	Q_ASSERT(cmd.request.slaveAddress != BroadcastAddress);
+	quint8 *frame = mTxFrame;
+	frame[0] = cmd.request.slaveAddress;
+	frame[1] = static_cast<quint8>(ReadWriteMultipleRegisters);
+	frame[2] = msb(cmd.reg);
+	frame[3] = lsb(cmd.reg);
+	frame[4] = msb(cmd.value);
+	frame[5] = lsb(cmd.value);
+	frame[6] = msb(cmd.writeReg);
+	frame[7] = lsb(cmd.writeReg);
+	frame[8] = msb(count);
+	frame[9] = lsb(count);
+	frame[10] = static_cast<quint8>(2 * count);
+	quint8 *data = frame + 11;
+	for (int i=0; i<count; ++i) {
+		data[2 * i] = msb(values[i]);
+		data[2 * i + 1] = lsb(values[i]);
+	}
+	send(11 + 2 * count);
+}
+
+void ModbusRtu::send(int length)
+{
+	// The frame (without CRC) has already been stored in mTxFrame.
 	Q_ASSERT(mState == Idle);
-	quint16 crc = Crc16::getValue(data);
-	data.append(static_cast<char>(msb(crc)));
-	data.append(static_cast<char>(lsb(crc)));
+	Q_ASSERT(length + 2 <= MaxFrameSize);
+	quint16 crc = Crc16::getValue(mTxFrame, length);
+	mTxFrame[length] = msb(crc);
+	mTxFrame[length + 1] = lsb(crc);
+	mTxLength = length + 2;
 	// Modbus requires a pause between sending of 3.5 times the interval needed
 	// to send a character. We use 4 characters here, just in case...
 	// We also assume 10 bits per caracter (8 data bits, 1 stop bit and 1 parity
 	// bit). Keep in mind that overestimating the character time does not hurt
 	// (a lot), but underestimating does.
 	// Then number of bits devided by the the baudrate (unit: bits/second) gives
-	// us the time in seconds. usleep wants time in microseconds, so we have to
+	// us the time in seconds. We want the time in microseconds, so we have to
 	// multiply by 1 million.
-	usleep((4 * 10 * 1000 * 1000) / mSerialPort.baudrate);
-	veSerialPutBuf(&mSerialPort, reinterpret_cast<un8 *>(data.data()),
-				   static_cast<un32>(data.size()));
-	mTimer->start();
-	mState = Address;
-	mCurrentSlave = static_cast<quint8>(data[0]);
+	// Usually the pause has passed already while the reply to the previous
+	// request was processed, so there is no need to wait.
+	qint64 gap = (4 * 10 * 1000 * 1000) / mSerialPort.baudrate;
+	qint64 silence = mLastActivity.isValid() ?
+		mLastActivity.nsecsElapsed() / 1000 : gap;
+	if (silence >= gap) {
+		transmit();
+	} else {
+		mState = Gap;
+		mGapTimer->start(static_cast<int>((gap - silence + 999) / 1000));
+	}
+}
+
+void ModbusRtu::transmit()
+{
+	if (mReplayPort != 0)
+		mReplayPort->write(mTxFrame, mTxLength);
+	else
+		veSerialPutBuf(&mSerialPort, mTxFrame, static_cast<un32>(mTxLength));
+	mLastActivity.start();
+	mCurrent.request.sent = timestamp();
+	++mStatistics.frames;
+	addTraffic(mTxLength);
+	if (mTraceRecorder != 0)
+		mTraceRecorder->record(TraceTransmit, mCurrent.request.sent, mTxFrame, mTxLength);
+	if (mCurrent.request.slaveAddress == BroadcastAddress) {
+		// There will be no reply. Data received in the meantime is ignored.
+		mTimer->start(TurnaroundDelay);
+		mState = Turnaround;
+		return;
+	}
+	++mStatistics.requests;
+	mFrameChunkGap = -1;
+	mCurrent.request.timeout = currentTimeout();
+	mTimer->start(mCurrent.request.timeout);
+	mState = Receiving;
+}
+
+void ModbusRtu::onReplayData(const QByteArray &data)
+{
+	dataReceived(reinterpret_cast<const quint8 *>(data.constData()), data.size());
+}
+
+void ModbusRtu::dataReceived(const quint8 *buffer, int length)
+{
+	QMutexLocker lock(&mMutex);
+	if (mState == Receiving) {
+		int gap = static_cast<int>(mLastActivity.nsecsElapsed() / 1000);
+		mFrameChunkGap = mFrameChunkGap < 0 ? 0 : qMax(mFrameChunkGap, gap);
+	}
+	mLastActivity.start();
+	addTraffic(length);
+	if (mTraceRecorder != 0)
+		mTraceRecorder->record(TraceReceive, timestamp(), buffer, length);
+	// Data received while we are not expecting any is ignored.
+	if (mState == Receiving) {
+		appendData(buffer, length);
+		// This function may be called from another thread, so we cannot
+		// start the timer here.
+		if (mState == Receiving && !mSilenceCheckPending) {
+			mSilenceCheckPending = true;
+			QMetaObject::invokeMethod(this, "armSilenceTimer", Qt::QueuedConnection);
+		}
+	}
 }
 
 void ModbusRtu::onDataRead(VeSerialPortS *port, const quint8 *buffer,
 						   quint32 length)
 {
 	ModbusRtu *rtu = reinterpret_cast<ModbusRtu *>(port->ctx);
-	QMutexLocker lock(&rtu->mMutex);
-	for (quint32 i=0; i<length; ++i)
-		rtu->handleByteRead(buffer[i]);
+	rtu->dataReceived(buffer, static_cast<int>(length));
 }
 
 void ModbusRtu::onSerialEvent(VeSerialPortS *port, VeSerialEvent event,
@@ -2,28 +2,133 @@
 #define MODBUS_RTU_H
 
 #include <QByteArray>
+#include <QElapsedTimer>
 #include <QList>
+#include <QMap>
 #include <QMetaType>
 #include <QMutex>
 #include <QObject>
 extern "C" {
 	#include <velib/platform/serial.h>
 }
+#include "bus_metrics.h"
 #include "crc16.h"
 
 class QTimer;
+class ReplayPort;
+class TraceRecorder;
 
-Q_DECLARE_METATYPE(QList<quint16>)
+/*!
+ * Read-only view on the registers received by `ModbusRtu`. The view refers to
+ * a buffer owned by `ModbusRtu`, so it is only valid during the call to
+ * `ModbusListener::onReadCompleted`.
+ * This saves a container per reply.
+ */
+class RegisterView
+{
+public:
+	RegisterView(const quint16 *data, int count):
+		mData(data),
+		mCount(count)
+	{
+	}
+
+	int size() const
+	{
+		return mCount;
+	}
+
+	quint16 operator[](int i) const
+	{
+		Q_ASSERT(i >= 0 && i < mCount);
+		return mData[i];
+	}
+
+private:
+	const quint16 *mData;
+	int mCount;
+};
+
+/*!
+ * Identifies a request sent via `ModbusRtu`, and records its progress. Passed
+ * to the `ModbusListener` together with the result of the request.
+ */
+struct ModbusRequest
+{
+	/// The value returned by the `ModbusRtu` function which issued the
+	/// request.
+	quint32 handle;
+	int function;
+	quint8 slaveAddress;
+	/// The time (µs) at which the request was issued, put on the bus, and
+	/// completed, as returned by `ModbusRtu::timestamp`. `sent` is -1 if the
+	/// request has never been put on the bus.
+	qint64 issued;
+	qint64 sent;
+	qint64 completed;
+	/// The timeout (ms) used while waiting for the reply.
+	int timeout;
+
+	/// The time (µs) the request has been waiting in the queue.
+	qint64 queueTime() const
+	{
+		return sent < 0 ? completed - issued : sent - issued;
+	}
+
+	/// The time (µs) between sending the request and receiving the reply,
+	/// or -1 if the request has never been sent.
+	qint64 roundTripTime() const
+	{
+		return sent < 0 ? -1 : completed - sent;
+	}
+};
+
+/*!
+ * Receives the results of requests sent via `ModbusRtu`. Only the object
+ * which issued a request is notified of its result.
+ *
+ * The reply to `WriteMultipleRegisters` is passed to `onWriteCompleted`, with
+ * the number of registers written in `value`. The reply to
+ * `ReadWriteMultipleRegisters` is passed to `onReadCompleted`, which implies
+ * that the write has succeeded.
+ */
+class ModbusListener
+{
+public:
+	virtual ~ModbusListener() {}
+
+	virtual void onReadCompleted(const ModbusRequest &request,
+								 const RegisterView &values) = 0;
+
+	virtual void onWriteCompleted(const ModbusRequest &request,
+								  quint16 address, quint16 value) = 0;
+
+	virtual void onErrorReceived(const ModbusRequest &request, int errorType,
+								 int exception) = 0;
+};
 
 /*!
  * Partial implementation of the Modbus RTU protocol.
  *
  * Supported functions: `ReadHoldingRegisters`, `ReadInputRegisters`,
- * and `WriteSingleRegister`.
+ * `WriteSingleRegister`, `WriteMultipleRegisters` and
+ * `ReadWriteMultipleRegisters`.
  *
  * Communication is implemented asynchronously. It is allowed to add multiple
  * request at once. They will be queued and sent to the device whenever it is
- * ready (ie. all previous requests have been handled).
+ * ready (ie. all previous requests have been handled). Each function issuing
+ * a request returns a handle, which can be used to cancel the request. The
+ * result of each request is passed to the `ModbusListener` supplied with the
+ * request, together with the handle and the timing of the request. After
+ * that the `requestFinished` signal is emitted. Requests with a higher
+ * `Priority` are sent first, so a write never has to wait for more than the
+ * request currently on the bus. When the queue is full, the request with the
+ * lowest priority fails with `QueueFull`.
+ *
+ * Writes sent to `BroadcastAddress` are executed by all devices on the bus.
+ * Devices do not reply to a broadcast, so the listener is notified with
+ * `onWriteCompleted` once the turnaround delay has passed. Reads cannot be
+ * broadcast, and are rejected.
  */
 class ModbusRtu : public QObject
 {
@@ -65,27 +170,173 @@ public:
 		CrcError,
 		Timeout,
 		Exception,
-		Unsupported
+		Unsupported,
+		QueueFull
 	};
 
+	/// Order in which queued requests are sent. Higher values go first.
+	enum Priority {
+		ScanPriority,
+		PollPriority,
+		IdentityPriority,
+		WritePriority
+	};
+
+	static const int MaxPendingCommands = 32;
+
+	static const quint8 BroadcastAddress = 0;
+
+	/// Identifies a request. Never equal to `InvalidHandle`.
+	typedef quint32 Handle;
+
+	static const Handle InvalidHandle = 0;
+
+	/// Number of requests and replies since the connection was created.
+	struct Statistics {
+		/// Requests put on the bus, excluding broadcasts.
+		quint32 requests;
+		/// Valid replies, including exceptions.
+		quint32 replies;
+		quint32 crcErrors;
+		quint32 timeouts;
+		quint32 exceptions;
+		/// Frames sent (including broadcasts) and valid frames received.
+		quint32 frames;
+		/// Bytes sent and received, including data which was ignored.
+		quint32 bytes;
+		/// Time (µs) needed to transfer `bytes` at the baud rate in use.
+		quint64 lineTime;
+	};
+
+	/// Maximum number of registers in a single `writeRegisters` request.
+	static const int MaxWriteCount = 123;
+	/// Maximum number of registers written by a `writeReadRegisters`
+	/// request.
+	static const int MaxWriteReadCount = 121;
+
 	ModbusRtu(const QString &portName, int baudrate, QObject *parent = 0);
 
+	/*!
+	 * Creates a connection which uses `replayPort` instead of a serial port.
+	 * Ownership of `replayPort` is transferred to this object.
+	 */
+	ModbusRtu(ReplayPort *replayPort, QObject *parent = 0);
+
 	~ModbusRtu();
 
+	/*!
+	 * Sets the maximum timeout (ms). This timeout is also used for slaves
+	 * which have not replied to any request yet. The time needed to transmit
+	 * the request and the reply is added to all timeouts.
+	 */
 	void setTimeout(int timeout);
 
-	void readRegisters(FunctionCode function, quint8 slaveAddress,
-					   quint16 startReg, quint16 count);
+	/*!
+	 * Sets the timeout (ms) of requests with `ScanPriority` sent to slaves
+	 * which have not replied to any request yet, and the maximum timeout of
+	 * all other requests with `ScanPriority`. Timeouts of those requests do
+	 * not affect the round trip statistics.
+	 */
+	void setProbeTimeout(int timeout);
 
-	void writeRegister(FunctionCode function, quint8 slaveAddress,
-					   quint16 reg, quint16 value);
+	int baudRate() const;
 
-signals:
-	void readCompleted(int function, quint8 slaveAddress, const QList<quint16> &values);
+	/*!
+	 * Changes the baud rate of the serial port. The round trip statistics
+	 * are discarded, because they depend on the baud rate.
+	 */
+	void setBaudRate(int baudrate);
+
+	Statistics statistics() const;
+
+	/// Returns the number of requests waiting to be sent.
+	int queueDepth() const;
+
+	/*!
+	 * Returns the round trip times of all replies received since the
+	 * connection was created, per slave address. Slaves which have never
+	 * replied are not included.
+	 */
+	QMap<int, LatencyHistogram> roundTripHistograms() const;
 
-	void writeCompleted(int function, quint8 slaveAddress, quint16 address, quint16 value);
+	/*!
+	 * Records all data sent and received in `recorder`, using `timestamp`
+	 * for the time stamps. Pass 0 to stop recording. The recorder is not
+	 * owned by this object, and must not be deleted before the recording
+	 * is stopped, or this object is destroyed.
+	 */
+	void setTraceRecorder(TraceRecorder *recorder);
 
-	void errorReceived(int errorType, quint8 slaveAddress, int exception);
+	/*!
+	 * Returns the smoothed round trip time (ms) of requests sent to the
+	 * given slave, excluding the time needed to transmit the request and the
+	 * reply. Returns -1 if the slave has not replied to any request yet.
+	 */
+	int roundTripTime(quint8 slaveAddress) const;
+
+	/*!
+	 * Returns the current time (µs) of the clock used for the timestamps in
+	 * `ModbusRequest`. This is `monotonicTime`, so the timestamps may be
+	 * compared with those of other ports.
+	 */
+	qint64 timestamp() const;
+
+	/*!
+	 * The functions below issue a request, and return its handle.
+	 * If `timeout` (ms) is larger than zero, it is used instead of the
+	 * timeout derived from the round trip statistics of the slave.
+	 * Requests which read registers cannot be sent to `BroadcastAddress`.
+	 * They are rejected, and `InvalidHandle` is returned.
+	 */
+	Handle readRegisters(ModbusListener *listener, FunctionCode function,
+						 quint8 slaveAddress, quint16 startReg, quint16 count,
+						 Priority priority = PollPriority, int timeout = 0);
+
+	Handle writeRegister(ModbusListener *listener, FunctionCode function,
+						 quint8 slaveAddress, quint16 reg, quint16 value,
+						 Priority priority = WritePriority, int timeout = 0);
+
+	/*!
+	 * Writes `count` values to consecutive registers starting at `startReg`,
+	 * using `WriteMultipleRegisters`. At most `MaxWriteCount` registers may be
+	 * written. The values are copied, so they need not remain valid after the
+	 * call.
+	 */
+	Handle writeRegisters(ModbusListener *listener, quint8 slaveAddress,
+						  quint16 startReg, const quint16 *values, int count,
+						  Priority priority = WritePriority, int timeout = 0);
+
+	/*!
+	 * Writes `count` values to consecutive registers starting at `writeReg`,
+	 * and reads `readCount` registers starting at `readReg` in a single
+	 * transaction (`ReadWriteMultipleRegisters`). The device performs the
+	 * write before the read. At most `MaxWriteReadCount` registers may be
+	 * written.
+	 */
+	Handle writeReadRegisters(ModbusListener *listener, quint8 slaveAddress,
+							  quint16 writeReg, const quint16 *values,
+							  int count, quint16 readReg, quint16 readCount,
+							  Priority priority = WritePriority,
+							  int timeout = 0);
+
+	/*!
+	 * Cancels the given request. The listener will not be notified of its
+	 * result. A request which is already on the bus will still occupy the
+	 * bus until the reply has been received, or the timeout has passed.
+	 * Returns false if the request has already been completed.
+	 */
+	bool cancel(Handle handle);
+
+	/*!
+	 * Makes sure `listener` will not be notified anymore. Should be called
+	 * before the listener is destroyed. Pending requests issued by the
+	 * listener are removed from the queue.
+	 */
+	void removeListener(ModbusListener *listener);
+
+signals:
+	/// Emitted after the result of a request has been passed to its listener.
+	void requestFinished();
 
 	void serialEvent(const char *description);
 
@@ -94,20 +345,100 @@ private slots:
 
 	void processPacket();
 
+	void reportDroppedCommands();
+
+	void reportUnsupported();
+
+	void onGapTimeout();
+
+	void armSilenceTimer();
+
+	void onSilenceTimeout();
+
+	void onReplayData(const QByteArray &data);
+
 private:
-	void handleByteRead(quint8 b);
+	void init();
+
+	void dataReceived(const quint8 *buffer, int length);
+
+	void onTurnaroundFinished();
+
+	void appendData(const quint8 *buffer, int length);
+
+	void parseFrame();
+
+	static int expectedFrameLength(const quint8 *frame, int length);
 
 	void resetStateEngine();
 
+	/*!
+	 * Computes the silent interval from the baud rate (3.5 character times),
+	 * the type of serial port, and the gaps measured within replies.
+	 */
+	void updateSilentInterval();
+
+	struct Cmd {
+		ModbusListener *listener;
+		ModbusRequest request;
+		// Start and count of the registers read, or the register and value
+		// written by `WriteSingleRegister`.
+		quint16 reg;
+		quint16 value;
+		// Registers written by `WriteMultipleRegisters` and
+		// `ReadWriteMultipleRegisters`. The values are stored in the command
+		// itself, so issuing a request does not allocate.
+		quint16 writeReg;
+		quint16 writeCount;
+		quint16 values[MaxWriteCount];
+		ModbusRtu::Priority priority;
+		// Timeout (ms) requested by the caller, 0 if not specified.
+		int timeout;
+	};
+
+	Cmd createCommand(ModbusListener *listener, FunctionCode function,
+					  quint8 slaveAddress, Priority priority, int timeout);
+
+	Handle issue(const Cmd &cmd);
+
+	Handle enqueue(const Cmd &cmd);
+
+	void dropCommand(const Cmd &cmd);
+
 	void processPending();
 
-	void _readRegisters(FunctionCode function, quint8 slaveAddress,
-						quint16 startReg, quint16 count);
+	Cmd finishRequest();
+
+	void start(const Cmd &cmd);
+
+	void _readRegisters(const Cmd &cmd);
+
+	void _writeRegister(const Cmd &cmd);
+
+	void _writeRegisters(const Cmd &cmd);
+
+	void _writeReadRegisters(const Cmd &cmd);
 
-	void _writeRegister(FunctionCode function, quint8 slaveAddress,
-						quint16 reg, quint16 value);
+	int currentTimeout() const;
 
-	void send(QByteArray &data);
+	/*!
+	 * Adds a round trip time (µs) to the statistics of the given slave.
+	 * `wireTime` (µs) is the part of the round trip needed to transmit the
+	 * request and the reply.
+	 */
+	void addRoundTrip(quint8 slaveAddress, int microseconds, int wireTime);
+
+	void addTraffic(int length);
+
+	/// Returns the time (µs) needed to transmit `length` bytes.
+	int wireTime(int length) const;
+
+	/// Returns the length of the reply to `cmd`, if no exception occurs.
+	static int expectedReplyLength(const Cmd &cmd);
+
+	void send(int length);
+
+	void transmit();
 
 	static void onDataRead(struct VeSerialPortS *port, const quint8 *buffer,
 						   quint32 length);
@@ -117,39 +448,74 @@ private:
 
 	enum ReadState {
 		Idle,
-		Address,
-		Function,
-		ByteCount,
-		StartAddressMsb,
-		StartAddressLsb,
-		Data,
-		CrcMsb,
-		CrcLsb,
-		Process
+		Gap,
+		Receiving,
+		Process,
+		Turnaround
 	};
 
+	/// Maximum size of a modbus RTU frame
+	static const int MaxFrameSize = 256;
+	/// Maximum number of registers in a single reply
+	static const int MaxRegisterCount = (MaxFrameSize - 5) / 2;
+
 	VeSerialPort mSerialPort;
 	QByteArray mPortName;
+	// Used instead of mSerialPort if set. Only the baud rate in mSerialPort
+	// is used in that case.
+	ReplayPort *mReplayPort;
 	QTimer *mTimer;
-	QMutex mMutex;
-	struct Cmd {
-		ModbusRtu::FunctionCode function;
-		quint8 slaveAddress;
-		quint16 reg;
-		quint16 value;
-	};
+	QTimer *mGapTimer;
+	QTimer *mSilenceTimer;
+	// Set while a call to `armSilenceTimer` is pending.
+	bool mSilenceCheckPending;
+	// Minimum time (µs) without data which marks the end of a frame. See
+	// `updateSilentInterval`.
+	int mSilentInterval;
+	// Largest gap (µs) between two chunks of data measured within a valid
+	// reply.
+	int mChunkGap;
+	// Largest gap (µs) between the chunks received since the current request
+	// was sent, -1 if nothing has been received yet.
+	int mFrameChunkGap;
+	mutable QMutex mMutex;
 	QList<Cmd> mPendingCommands;
-	quint8 mCurrentSlave;
+	QList<Cmd> mDroppedCommands;
+	// The request being sent, or waiting for its reply. The listener is 0 if
+	// the result should not be reported.
+	Cmd mCurrent;
+	Handle mLastHandle;
+	int mTimeout;
+	int mProbeTimeout;
+	// Round trip statistics per slave address, computed like the TCP
+	// retransmission timeout (RFC 6298). Values are in microseconds, and do
+	// not include the time needed to transmit the request and the reply. A
+	// smoothed round trip time of 0 indicates that no data is available.
+	struct SlaveTiming {
+		int srtt;
+		int rttvar;
+	};
+	SlaveTiming mTiming[256];
+	LatencyHistogram mRoundTrips[256];
+	Statistics mStatistics;
+	TraceRecorder *mTraceRecorder;
+	// Frame being sent. In the `Gap` state, the frame is waiting for the
+	// silent interval to pass.
+	quint8 mTxFrame[MaxFrameSize];
+	int mTxLength;
+	// Time of the last byte sent or received.
+	QElapsedTimer mLastActivity;
 
 	// State engine
 	ReadState mState;
-	FunctionCode mFunction;
-	quint8 mCount;
-	quint16 mStartAddress;
-	quint16 mCrc;
-	Crc16 mCrcBuilder;
-	bool mAddToCrc;
-	QByteArray mData;
+	// Received data. Once in the `Process` state, this contains a complete
+	// frame with valid CRC.
+	quint8 mFrameBuffer[MaxFrameSize];
+	int mFrameLength;
+	bool mCrcErrorSeen;
+	// Registers of the last read reply, passed to the listener as a
+	// `RegisterView`.
+	quint16 mRegisters[MaxRegisterCount];
 };
 
 #endif // MODBUS_RTU_H
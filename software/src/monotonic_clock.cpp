@@ -0,0 +1,9 @@
+#include <time.h>
+#include "monotonic_clock.h"
+
+qint64 monotonicTime()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<qint64>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
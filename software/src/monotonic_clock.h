@@ -0,0 +1,14 @@
+#ifndef MONOTONIC_CLOCK_H
+#define MONOTONIC_CLOCK_H
+
+#include <QtGlobal>
+
+/*!
+ * Returns the time (µs) of the system's monotonic clock. Unlike the values
+ * of a `QElapsedTimer`, the values returned are comparable across objects and
+ * threads, so they may be used to follow a measurement from the serial port
+ * to the D-Bus.
+ */
+qint64 monotonicTime();
+
+#endif // MONOTONIC_CLOCK_H
@@ -0,0 +1,194 @@
+#include <QsLog.h>
+#include <QTimer>
+#include "baud_rate_selector.h"
+#include "battery_controller_updater.h"
+#include "broadcast_writer.h"
+#include "bus_scheduler.h"
+#include "device_scanner.h"
+#include "modbus_rtu.h"
+#include "port_worker.h"
+#include "replay_port.h"
+#include "trace_recorder.h"
+
+// Interval (ms) at which the utilisation of the port is reported.
+static const int MetricsInterval = 5000;
+
+PortWorker::PortWorker(const QString &portName, int baudRate, QObject *parent):
+	QObject(parent),
+	mPortName(portName),
+	mBaudRate(baudRate),
+	mReplaySpeed(0),
+	mModbus(0),
+	mScheduler(0),
+	mDeviceScanner(0),
+	mBroadcastWriter(0),
+	mBaudRateSelector(0),
+	mTraceRecorder(0),
+	mCaptureSize(0),
+	mMetricsTimer(0),
+	mGapTolerance(BatteryControllerUpdater::defaultGapTolerance())
+{
+	for (int i=0; i<PollTierCount; ++i) {
+		mPollIntervals[i] = BatteryControllerUpdater::defaultPollInterval(
+			static_cast<PollTier>(i));
+	}
+}
+
+QString PortWorker::portName() const
+{
+	return mPortName;
+}
+
+void PortWorker::setReplaySpeed(double speed)
+{
+	mReplaySpeed = speed;
+}
+
+void PortWorker::start()
+{
+	if (mModbus != 0)
+		return;
+	bool autoBaudRate = false;
+	if (mReplaySpeed > 0) {
+		QLOG_INFO() << "Replaying" << mPortName;
+		ReplayPort *port = new ReplayPort(mPortName, mReplaySpeed);
+		if (!port->isOpen()) {
+			// The reason has been logged by the port. Handled like a serial
+			// port which cannot be opened: the application will shut down.
+			delete port;
+			emit serialEvent("Could not load capture file " + mPortName);
+			return;
+		}
+		mModbus = new ModbusRtu(port, this);
+	} else {
+		QLOG_INFO() << "Connecting to" << mPortName;
+		autoBaudRate = mBaudRate == AutoBaudRate;
+		mModbus = new ModbusRtu(mPortName,
+								autoBaudRate ? BaudRateSelector::SupportedRates[0] : mBaudRate,
+								this);
+	}
+	mModbus->setTimeout(1000);
+	mModbus->setProbeTimeout(250);
+	connect(mModbus, SIGNAL(serialEvent(const char *)),
+			this, SLOT(onSerialEvent(const char *)));
+	if (!mCaptureFile.isEmpty())
+		startCapture(mCaptureFile, mCaptureSize);
+
+	mScheduler = new BusScheduler(mModbus, this);
+
+	mBroadcastWriter = new BroadcastWriter(mScheduler, this);
+
+	mDeviceScanner = new DeviceScanner(mScheduler, this);
+	connect(mDeviceScanner, SIGNAL(deviceFound(int)), this, SLOT(onDeviceFound(int)));
+
+	if (autoBaudRate)
+		mBaudRateSelector = new BaudRateSelector(mModbus, this);
+
+	mLastStatistics = mModbus->statistics();
+	mMetricsClock.start();
+	mMetricsTimer = new QTimer(this);
+	connect(mMetricsTimer, SIGNAL(timeout()), this, SLOT(onMetricsTimer()));
+	mMetricsTimer->start(MetricsInterval);
+}
+
+void PortWorker::setPollInterval(int tier, int interval)
+{
+	mPollIntervals[tier] = interval;
+	foreach (BatteryControllerUpdater *u, findChildren<BatteryControllerUpdater *>())
+		u->setPollInterval(static_cast<PollTier>(tier), interval);
+}
+
+void PortWorker::setGapTolerance(int t)
+{
+	mGapTolerance = t;
+	foreach (BatteryControllerUpdater *u, findChildren<BatteryControllerUpdater *>())
+		u->setGapTolerance(t);
+}
+
+void PortWorker::broadcastWrite(int reg, int value)
+{
+	if (mBroadcastWriter == 0)
+		return;
+	mBroadcastWriter->write(static_cast<quint16>(reg), static_cast<quint16>(value));
+}
+
+void PortWorker::startCapture(const QString &fileName, qint64 maxSize)
+{
+	mCaptureFile = fileName;
+	mCaptureSize = maxSize;
+	if (mModbus == 0 || mTraceRecorder != 0)
+		return;
+	// The recorder is a child of mModbus, so it will outlive the serial
+	// port.
+	mTraceRecorder = new TraceRecorder(fileName, maxSize, mModbus);
+	if (mTraceRecorder->isOpen())
+		mModbus->setTraceRecorder(mTraceRecorder);
+}
+
+void PortWorker::removeDevice(int address)
+{
+	if (!mIgnoredAddresses.contains(address))
+		mIgnoredAddresses.append(address);
+	foreach (BatteryControllerUpdater *u, findChildren<BatteryControllerUpdater *>()) {
+		if (u->deviceAddress() == address)
+			delete u;
+	}
+}
+
+void PortWorker::onDeviceFound(int address)
+{
+	if (mIgnoredAddresses.contains(address))
+		return;
+	foreach (BatteryControllerUpdater *u, findChildren<BatteryControllerUpdater *>()) {
+		if (u->deviceAddress() == address)
+			return;
+	}
+	BatteryControllerUpdater *u = new BatteryControllerUpdater(address, mScheduler, this);
+	for (int i=0; i<PollTierCount; ++i)
+		u->setPollInterval(static_cast<PollTier>(i), mPollIntervals[i]);
+	u->setGapTolerance(mGapTolerance);
+	connect(mBroadcastWriter, SIGNAL(broadcastWritten(int, int)),
+			u, SLOT(onBroadcastWritten(int, int)));
+	mDeviceScanner->setScanInterval(4000);
+	emit updaterCreated(u, address);
+}
+
+void PortWorker::onSerialEvent(const char *description)
+{
+	// The description is copied, because it is handled in another thread.
+	emit serialEvent(QString(description));
+}
+
+void PortWorker::onMetricsTimer()
+{
+	ModbusRtu::Statistics s = mModbus->statistics();
+	QMap<int, LatencyHistogram> roundTrips = mModbus->roundTripHistograms();
+	qint64 elapsed = mMetricsClock.restart();
+	BusMetrics m;
+	if (elapsed > 0) {
+		double seconds = elapsed / 1000.0;
+		m.framesPerSecond = (s.frames - mLastStatistics.frames) / seconds;
+		m.bytesPerSecond = (s.bytes - mLastStatistics.bytes) / seconds;
+		m.occupancy = qMin(100.0, (s.lineTime - mLastStatistics.lineTime) /
+									  (10.0 * elapsed));
+	}
+	m.timeouts = s.timeouts;
+	m.crcErrors = s.crcErrors;
+	m.exceptions = s.exceptions;
+	m.queueDepth = mModbus->queueDepth();
+	m.cycleTime = mScheduler->cycleTime();
+	for (QMap<int, LatencyHistogram>::const_iterator it = roundTrips.constBegin();
+		 it != roundTrips.constEnd(); ++it) {
+		LatencyHistogram h = it.value().since(mLastRoundTrips.value(it.key()));
+		if (h.count() == 0)
+			continue;
+		RoundTripPercentiles p;
+		p.p50 = h.percentile(50);
+		p.p90 = h.percentile(90);
+		p.p99 = h.percentile(99);
+		m.roundTrips.insert(it.key(), p);
+	}
+	mLastStatistics = s;
+	mLastRoundTrips = roundTrips;
+	emit metricsUpdated(m);
+}
@@ -0,0 +1,133 @@
+#ifndef PORT_WORKER_H
+#define PORT_WORKER_H
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QMap>
+#include <QObject>
+#include <QString>
+#include "bus_metrics.h"
+#include "modbus_rtu.h"
+#include "zbm_registers.h"
+
+class BaudRateSelector;
+class BatteryControllerUpdater;
+class BroadcastWriter;
+class BusScheduler;
+class DeviceScanner;
+class QTimer;
+class TraceRecorder;
+
+/*!
+ * Handles all communication over a single serial port.
+ * This object is supposed to be moved to its own thread. Once the thread has
+ * been started, `start` should be called (using a queued connection) to
+ * create the modbus connection, the device scanner, and (later on) the
+ * updaters of the batteries found. All those objects will live in the
+ * worker thread.
+ */
+class PortWorker : public QObject
+{
+	Q_OBJECT
+public:
+	/*!
+	 * Creates a worker for the given port. If `baudRate` is `AutoBaudRate`,
+	 * the highest rate at which the batteries reply reliably is selected
+	 * by `BaudRateSelector`.
+	 */
+	PortWorker(const QString &portName, int baudRate, QObject *parent = 0);
+
+	static const int AutoBaudRate = 0;
+
+	QString portName() const;
+
+	/*!
+	 * Treats the port name as a capture file, and replays it (see
+	 * `ReplayPort`) instead of opening a serial port. Recorded delays are
+	 * divided by `speed`. Must be called before `start`.
+	 */
+	void setReplaySpeed(double speed);
+
+public slots:
+	void start();
+
+	/*!
+	 * Sets the poll interval of the given tier for all batteries on this
+	 * port, including the ones found later on.
+	 */
+	void setPollInterval(int tier, int interval);
+
+	/*!
+	 * Sets the gap tolerance (see `BatteryControllerUpdater::setGapTolerance`)
+	 * for all batteries on this port, including the ones found later on.
+	 */
+	void setGapTolerance(int t);
+
+	/*!
+	 * Writes `value` to `reg` of all batteries on this port using a single
+	 * broadcast. Each updater verifies the result during its next poll.
+	 */
+	void broadcastWrite(int reg, int value);
+
+	/*!
+	 * Records all traffic on this port in the given file. The file is
+	 * rotated when it reaches half of `maxSize` (bytes).
+	 */
+	void startCapture(const QString &fileName, qint64 maxSize);
+
+	/*!
+	 * Deletes the updater of the battery with the given address, and ignores
+	 * the battery from now on. Used when the address is already taken by a
+	 * battery on another port.
+	 */
+	void removeDevice(int address);
+
+signals:
+	/*!
+	 * Emitted when a new battery has been found. The updater will not start
+	 * communicating until its `start` slot is called. This gives the
+	 * receiver the opportunity to connect to its signals first. The updater
+	 * lives in the worker thread, so `address` should be used instead of
+	 * calling `deviceAddress`.
+	 */
+	void updaterCreated(BatteryControllerUpdater *updater, int address);
+
+	/*!
+	 * Emitted when the serial port reports an error, or when the capture file
+	 * to be replayed cannot be loaded.
+	 */
+	void serialEvent(const QString &description);
+
+	/// Emitted periodically with the utilisation of the serial port.
+	void metricsUpdated(const BusMetrics &metrics);
+
+private slots:
+	void onDeviceFound(int address);
+
+	void onSerialEvent(const char *description);
+
+	void onMetricsTimer();
+
+private:
+	QString mPortName;
+	int mBaudRate;
+	// Larger than zero when replaying a capture file.
+	double mReplaySpeed;
+	ModbusRtu *mModbus;
+	BusScheduler *mScheduler;
+	DeviceScanner *mDeviceScanner;
+	BroadcastWriter *mBroadcastWriter;
+	BaudRateSelector *mBaudRateSelector;
+	TraceRecorder *mTraceRecorder;
+	QString mCaptureFile;
+	qint64 mCaptureSize;
+	QTimer *mMetricsTimer;
+	QElapsedTimer mMetricsClock;
+	ModbusRtu::Statistics mLastStatistics;
+	QMap<int, LatencyHistogram> mLastRoundTrips;
+	int mPollIntervals[PollTierCount];
+	int mGapTolerance;
+	QList<int> mIgnoredAddresses;
+};
+
+#endif // PORT_WORKER_H
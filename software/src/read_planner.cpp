@@ -0,0 +1,72 @@
+#include <QtAlgorithms>
+#include "read_planner.h"
+
+RegisterRange::RegisterRange():
+	start(0),
+	count(0)
+{
+}
+
+RegisterRange::RegisterRange(quint16 start, quint16 count):
+	start(start),
+	count(count)
+{
+}
+
+quint16 RegisterRange::end() const
+{
+	return start + count;
+}
+
+static bool startsBefore(const RegisterRange &r0, const RegisterRange &r1)
+{
+	return r0.start < r1.start;
+}
+
+ReadPlanner::ReadPlanner(int gapTolerance, int maxCount):
+	mGapTolerance(gapTolerance),
+	mMaxCount(maxCount)
+{
+}
+
+int ReadPlanner::gapTolerance() const
+{
+	return mGapTolerance;
+}
+
+void ReadPlanner::setGapTolerance(int t)
+{
+	mGapTolerance = t;
+}
+
+int ReadPlanner::maxCount() const
+{
+	return mMaxCount;
+}
+
+void ReadPlanner::setMaxCount(int c)
+{
+	mMaxCount = qBound(1, c, static_cast<int>(MaxRegisterCount));
+}
+
+QList<RegisterRange> ReadPlanner::plan(const QList<RegisterRange> &ranges) const
+{
+	QList<RegisterRange> sorted = ranges;
+	qSort(sorted.begin(), sorted.end(), startsBefore);
+	QList<RegisterRange> result;
+	foreach (const RegisterRange &r, sorted) {
+		if (r.count == 0)
+			continue;
+		if (!result.isEmpty() && mGapTolerance >= 0) {
+			RegisterRange &last = result.last();
+			int gap = r.start - last.end();
+			int end = qMax(static_cast<int>(last.end()), static_cast<int>(r.end()));
+			if (gap <= mGapTolerance && end - last.start <= mMaxCount) {
+				last.count = static_cast<quint16>(end - last.start);
+				continue;
+			}
+		}
+		result.append(r);
+	}
+	return result;
+}
@@ -0,0 +1,60 @@
+#ifndef READ_PLANNER_H
+#define READ_PLANNER_H
+
+#include <QList>
+#include <QtGlobal>
+
+/// A contiguous block of modbus registers.
+struct RegisterRange
+{
+	RegisterRange();
+
+	RegisterRange(quint16 start, quint16 count);
+
+	quint16 end() const;
+
+	quint16 start;
+	quint16 count;
+};
+
+/*!
+ * Combines register ranges into as few modbus read requests as possible.
+ * Ranges which are separated by no more than `gapTolerance` unused registers
+ * are merged into a single read. The values of the unused registers in between
+ * are simply ignored by the caller. A merged read will never exceed
+ * `maxCount` registers (the modbus protocol allows at most 125 registers per
+ * read).
+ */
+class ReadPlanner
+{
+public:
+	ReadPlanner(int gapTolerance = 0, int maxCount = MaxRegisterCount);
+
+	int gapTolerance() const;
+
+	/*!
+	 * Sets the maximum number of unused registers allowed between two ranges.
+	 * A negative value disables merging altogether, so each range will
+	 * result in a read of its own (even if the ranges are adjacent).
+	 */
+	void setGapTolerance(int t);
+
+	int maxCount() const;
+
+	void setMaxCount(int c);
+
+	/*!
+	 * @brief Computes the read requests needed to retrieve all ranges.
+	 * @param ranges The ranges to be retrieved. The order is not relevant.
+	 * @return The reads, sorted by start address.
+	 */
+	QList<RegisterRange> plan(const QList<RegisterRange> &ranges) const;
+
+	static const int MaxRegisterCount = 125;
+
+private:
+	int mGapTolerance;
+	int mMaxCount;
+};
+
+#endif // READ_PLANNER_H
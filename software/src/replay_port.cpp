@@ -0,0 +1,153 @@
+#include <QFile>
+#include <QHash>
+#include <QsLog.h>
+#include <QTimer>
+#include <string.h>
+#include "replay_port.h"
+#include "trace_format.h"
+
+static quint64 readUInt(const char *data, int count)
+{
+	quint64 v = 0;
+	for (int i=count-1; i>=0; --i)
+		v = (v << 8) | static_cast<quint8>(data[i]);
+	return v;
+}
+
+ReplayPort::ReplayPort(const QString &fileName, double speed, QObject *parent):
+	QObject(parent),
+	mTimer(new QTimer(this)),
+	mSpeed(speed > 0 ? speed : 1),
+	mBaudRate(0),
+	mOpen(false),
+	mScheduled(0),
+	mNextChunk(0)
+{
+	mTimer->setSingleShot(true);
+	connect(mTimer, SIGNAL(timeout()), this, SLOT(onTimer()));
+	mOpen = load(fileName);
+}
+
+bool ReplayPort::isOpen() const
+{
+	return mOpen;
+}
+
+int ReplayPort::baudRate() const
+{
+	return mBaudRate;
+}
+
+void ReplayPort::write(const quint8 *data, int length)
+{
+	// A new request is only sent once the previous one has been completed,
+	// so whatever is left of the previous reply is not needed anymore.
+	mScheduled = 0;
+	mTimer->stop();
+	for (int i=0; i<mRequests.size(); ++i) {
+		Request &r = mRequests[i];
+		if (r.frame.size() != length ||
+			memcmp(r.frame.constData(), data, static_cast<size_t>(length)) != 0)
+			continue;
+		mScheduled = &r.replies.at(r.nextReply);
+		mNextChunk = 0;
+		r.nextReply = (r.nextReply + 1) % r.replies.size();
+		mSent.start();
+		scheduleNext();
+		return;
+	}
+	QLOG_TRACE() << "Request not found in capture:"
+				 << QByteArray(reinterpret_cast<const char *>(data), length).toHex();
+}
+
+void ReplayPort::onTimer()
+{
+	if (mScheduled == 0 || mNextChunk >= mScheduled->size())
+		return;
+	// The chunk is owned by mRequests, so it remains valid if the receiver
+	// sends the next request.
+	const QByteArray &data = mScheduled->at(mNextChunk++).data;
+	scheduleNext();
+	emit dataReceived(data);
+}
+
+bool ReplayPort::load(const QString &fileName)
+{
+	QFile file(fileName);
+	if (!file.open(QIODevice::ReadOnly)) {
+		QLOG_ERROR() << "Could not open capture file" << fileName
+					 << file.errorString();
+		return false;
+	}
+	QByteArray capture = file.readAll();
+	const char *data = capture.constData();
+	if (capture.size() < TraceFileHeaderSize ||
+		memcmp(data, TraceMagic, sizeof(TraceMagic)) != 0 ||
+		readUInt(data + 8, 2) != TraceVersion) {
+		QLOG_ERROR() << fileName << "is not a supported capture file";
+		return false;
+	}
+	// Index in mRequests of each distinct request.
+	QHash<QByteArray, int> index;
+	// The last request, -1 before the first one.
+	int current = -1;
+	qint64 sent = 0;
+	int requestCount = 0;
+	int pos = TraceFileHeaderSize;
+	while (pos + TraceRecordHeaderSize <= capture.size()) {
+		int type = data[pos];
+		int length = static_cast<int>(readUInt(data + pos + 1, 2));
+		qint64 timestamp = static_cast<qint64>(readUInt(data + pos + 3, 8));
+		pos += TraceRecordHeaderSize;
+		if (pos + length > capture.size())
+			break;
+		const char *payload = data + pos;
+		pos += length;
+		switch (type) {
+		case TraceTransmit:
+		{
+			QByteArray request(payload, length);
+			sent = timestamp;
+			current = index.value(request, -1);
+			if (current < 0) {
+				current = mRequests.size();
+				index.insert(request, current);
+				Request r;
+				r.frame = request;
+				r.nextReply = 0;
+				mRequests.append(r);
+			}
+			mRequests[current].replies.append(Reply());
+			++requestCount;
+			break;
+		}
+		case TraceReceive:
+			// Data received before the first request cannot be replayed.
+			if (current >= 0) {
+				Chunk chunk;
+				chunk.delay = timestamp - sent;
+				chunk.data = QByteArray(payload, length);
+				mRequests[current].replies.last().append(chunk);
+			}
+			break;
+		case TraceBaudRate:
+			if (mBaudRate == 0 && length == 4)
+				mBaudRate = static_cast<int>(readUInt(payload, 4));
+			break;
+		default:
+			break;
+		}
+	}
+	QLOG_INFO() << "Replaying" << requestCount << "requests (" << mRequests.size()
+				<< "distinct) from" << fileName;
+	return true;
+}
+
+void ReplayPort::scheduleNext()
+{
+	if (mScheduled == 0 || mNextChunk >= mScheduled->size())
+		return;
+	qint64 due = static_cast<qint64>(mScheduled->at(mNextChunk).delay / mSpeed);
+	qint64 remaining = due - mSent.nsecsElapsed() / 1000;
+	mTimer->start(static_cast<int>((qMax(remaining, Q_INT64_C(0)) + 999) / 1000));
+}
@@ -0,0 +1,78 @@
+#ifndef REPLAY_PORT_H
+#define REPLAY_PORT_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QList>
+#include <QObject>
+#include <QString>
+
+class QTimer;
+
+/*!
+ * Replaces the serial port of `ModbusRtu` with the traffic recorded in a
+ * capture file (see `TraceRecorder`).
+ *
+ * Each request written to this port is looked up in the capture, and the
+ * data received after the same request in the capture is passed back via
+ * `dataReceived`, with the recorded delays divided by `speed`. If a request
+ * occurs more than once in the capture, the recorded replies are returned in
+ * order, starting again with the first one when all have been used. So
+ * missing and corrupted replies are reproduced as well. Requests which do not
+ * occur in the capture are not answered.
+ */
+class ReplayPort : public QObject
+{
+	Q_OBJECT
+public:
+	ReplayPort(const QString &fileName, double speed, QObject *parent = 0);
+
+	bool isOpen() const;
+
+	/// The first baud rate found in the capture, or 0 if there is none.
+	int baudRate() const;
+
+	void write(const quint8 *data, int length);
+
+signals:
+	void dataReceived(const QByteArray &data);
+
+private slots:
+	void onTimer();
+
+private:
+	bool load(const QString &fileName);
+
+	void scheduleNext();
+
+	struct Chunk {
+		// Time (µs) between sending the request and receiving the data, as
+		// recorded.
+		qint64 delay;
+		QByteArray data;
+	};
+
+	typedef QList<Chunk> Reply;
+
+	/// A distinct request found in the capture, and the replies to it.
+	struct Request {
+		QByteArray frame;
+		QList<Reply> replies;
+		int nextReply;
+	};
+
+	QTimer *mTimer;
+	double mSpeed;
+	int mBaudRate;
+	bool mOpen;
+	// Searched linearly by `write`. A capture contains few distinct requests,
+	// and unlike a lookup in a hash, this does not copy the request.
+	QList<Request> mRequests;
+	// Reply to the last request, and the index of its next chunk. 0 if there
+	// is nothing left to send.
+	const Reply *mScheduled;
+	int mNextChunk;
+	QElapsedTimer mSent;
+};
+
+#endif // REPLAY_PORT_H
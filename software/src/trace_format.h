@@ -0,0 +1,38 @@
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+#include <stdint.h>
+
+/*
+ * Layout of the capture files written by `TraceRecorder`, and read by the
+ * trace decoder (tools/trace-decoder). All values are little endian.
+ *
+ * File header:
+ *   8 bytes  TraceMagic
+ *   u16      TraceVersion
+ *   u16      reserved (0)
+ *
+ * Followed by records:
+ *   u8       TraceRecordType
+ *   u16      payload length
+ *   u64      timestamp (µs, monotonic)
+ *   payload
+ *
+ * `TraceTransmit` and `TraceReceive` records contain the data as passed to
+ * or received from the serial port, so a single modbus frame may be spread
+ * over multiple receive records. `TraceBaudRate` records contain the baud
+ * rate as u32. Each file starts with a `TraceBaudRate` record.
+ */
+
+static const char TraceMagic[8] = { 'Z', 'B', 'M', 'T', 'R', 'A', 'C', 'E' };
+static const uint16_t TraceVersion = 1;
+static const int TraceFileHeaderSize = 12;
+static const int TraceRecordHeaderSize = 11;
+
+enum TraceRecordType {
+	TraceTransmit = 1,
+	TraceReceive = 2,
+	TraceBaudRate = 3
+};
+
+#endif // TRACE_FORMAT_H
@@ -0,0 +1,94 @@
+#include <QsLog.h>
+#include "trace_recorder.h"
+
+// Keeps the file from being rotated after each record.
+static const qint64 MinimumSize = 4096;
+
+static void appendUInt16(QByteArray &buffer, quint16 v)
+{
+	buffer.append(static_cast<char>(v & 0xFF));
+	buffer.append(static_cast<char>(v >> 8));
+}
+
+static void appendUInt64(QByteArray &buffer, quint64 v)
+{
+	for (int i=0; i<8; ++i)
+		buffer.append(static_cast<char>((v >> (8 * i)) & 0xFF));
+}
+
+TraceRecorder::TraceRecorder(const QString &fileName, qint64 maxSize,
+							 QObject *parent):
+	QObject(parent),
+	mFile(fileName),
+	mMaxSize(qMax(maxSize, MinimumSize)),
+	mLastTimestamp(0),
+	mBaudRate(0)
+{
+	if (open())
+		QLOG_INFO() << "Recording serial traffic in" << fileName;
+}
+
+bool TraceRecorder::isOpen() const
+{
+	return mFile.isOpen();
+}
+
+void TraceRecorder::record(TraceRecordType type, qint64 timestamp,
+						   const quint8 *data, int length)
+{
+	if (!mFile.isOpen())
+		return;
+	QByteArray record;
+	record.reserve(TraceRecordHeaderSize + length);
+	record.append(static_cast<char>(type));
+	appendUInt16(record, static_cast<quint16>(length));
+	appendUInt64(record, static_cast<quint64>(timestamp));
+	record.append(reinterpret_cast<const char *>(data), length);
+	// Flushed right away, because the service may be terminated with exit()
+	// at any moment, for example when the serial port disappears.
+	if (mFile.write(record) != record.size() || !mFile.flush()) {
+		QLOG_ERROR() << "Could not write capture file" << mFile.fileName()
+					 << mFile.errorString();
+		mFile.close();
+		return;
+	}
+	mLastTimestamp = timestamp;
+	if (mFile.pos() >= mMaxSize / 2)
+		rotate();
+}
+
+void TraceRecorder::recordBaudRate(qint64 timestamp, int baudRate)
+{
+	mBaudRate = baudRate;
+	quint8 data[4];
+	for (int i=0; i<4; ++i)
+		data[i] = static_cast<quint8>((baudRate >> (8 * i)) & 0xFF);
+	record(TraceBaudRate, timestamp, data, sizeof(data));
+}
+
+bool TraceRecorder::open()
+{
+	if (!mFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		QLOG_ERROR() << "Could not open capture file" << mFile.fileName()
+					 << mFile.errorString();
+		return false;
+	}
+	QByteArray header(TraceMagic, sizeof(TraceMagic));
+	appendUInt16(header, TraceVersion);
+	appendUInt16(header, 0);
+	mFile.write(header);
+	mFile.flush();
+	return true;
+}
+
+void TraceRecorder::rotate()
+{
+	QString fileName = mFile.fileName();
+	QString oldFileName = fileName + ".1";
+	mFile.close();
+	QFile::remove(oldFileName);
+	QFile::rename(fileName, oldFileName);
+	// The decoder needs the baud rate to compute the duration of frames.
+	if (open() && mBaudRate > 0)
+		recordBaudRate(mLastTimestamp, mBaudRate);
+}
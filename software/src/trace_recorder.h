@@ -0,0 +1,46 @@
+#ifndef TRACE_RECORDER_H
+#define TRACE_RECORDER_H
+
+#include <QFile>
+#include <QObject>
+#include <QString>
+#include "trace_format.h"
+
+/*!
+ * Records the data sent and received over a serial port in a binary capture
+ * file (see trace_format.h).
+ *
+ * The size of the capture is limited: once the file reaches half of the
+ * maximum size, it is renamed by appending `.1` to its name (replacing the
+ * previous one), and a new file is started. So the last part of the traffic
+ * is always available in the two files. Each record is flushed to the file
+ * immediately.
+ *
+ * This class is not thread safe. `ModbusRtu` only calls `record` while
+ * holding its lock.
+ */
+class TraceRecorder : public QObject
+{
+	Q_OBJECT
+public:
+	TraceRecorder(const QString &fileName, qint64 maxSize, QObject *parent = 0);
+
+	bool isOpen() const;
+
+	void record(TraceRecordType type, qint64 timestamp, const quint8 *data,
+				int length);
+
+	void recordBaudRate(qint64 timestamp, int baudRate);
+
+private:
+	bool open();
+
+	void rotate();
+
+	QFile mFile;
+	qint64 mMaxSize;
+	qint64 mLastTimestamp;
+	int mBaudRate;
+};
+
+#endif // TRACE_RECORDER_H
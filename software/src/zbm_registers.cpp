@@ -0,0 +1,53 @@
+#include "battery_controller.h"
+#include "zbm_registers.h"
+
+template<typename T, void (BatteryController::*Setter)(T)>
+static void store(BatteryController *c, double value)
+{
+	(c->*Setter)(static_cast<T>(value));
+}
+
+const RegisterDescriptor ZbmRegisters[] = {
+	{ RegStatusSummary, false, 1, StatusTier, "StsRegSummary", 0, "", 0,
+	  &store<int, &BatteryController::setStsRegSummary> },
+	{ RegHardwareFailure, false, 1, StatusTier, "StsRegHardwareFailure", 0, "", 0,
+	  &store<int, &BatteryController::setStsRegHardwareFailure> },
+	{ RegOperationalFailure, false, 1, StatusTier, "StsRegOperationalFailure", 0, "", 0,
+	  &store<int, &BatteryController::setStsRegOperationalFailure> },
+	{ RegWarningIndicator, false, 1, StatusTier, "StsRegWarning", 0, "", 0,
+	  &store<int, &BatteryController::setStsRegWarning> },
+	{ RegOperationalMode, false, 1, StatusTier, "operationalMode", "/OperationalMode", "", 0,
+	  &store<int, &BatteryController::setOperationalMode> },
+	{ RegStateOfCharge, false, 100, FastTier, "SOC", "/Soc", "%", 1,
+	  &store<double, &BatteryController::setSOC> },
+	{ RefAmpHours, true, -10, FastTier, "SOCAmpHrs", "/ConsumedAmphours", "Ah", 0,
+	  &store<double, &BatteryController::setSOCAmpHrs> },
+	{ RegBatteryVoltage, false, 10, FastTier, "BattVolts", "/Dc/0/Voltage", "V", 1,
+	  &store<double, &BatteryController::setBattVolts> },
+	{ RegBatteryCurrent, true, -10, FastTier, "BattAmps", "/Dc/0/Current", "A", 1,
+	  &store<double, &BatteryController::setBattAmps> },
+	{ RegBatteryTemperature, true, 10, SlowTier, "BattTemp", "/Dc/0/Temperature", "C", 1,
+	  &store<double, &BatteryController::setBattTemp> },
+	{ RegAirTemperature, true, 10, SlowTier, "AirTemp", "/AirTemperature", "C", 0,
+	  &store<double, &BatteryController::setAirTemp> },
+	// According to Redflow, the state of health indicator is not reliable yet.
+	// We don't use the generic name /Soh in order to prevent the value to
+	// appear in the Gui (PageBatter.qml).
+	{ RegStateOfHealth, false, 1, HealthTier, "HealthIndication", "/SohExperimental", "%", 0,
+	  &store<double, &BatteryController::setHealthIndication> },
+	{ RegBusVoltage, false, 10, FastTier, "BusVolts", "/BusVoltage", "V", 0,
+	  &store<double, &BatteryController::setBusVolts> },
+	{ RegBatteryState, false, 1, StatusTier, "State", "/State", "", 0,
+	  &store<int, &BatteryController::setState> }
+};
+
+const int ZbmRegisterCount = sizeof(ZbmRegisters) / sizeof(ZbmRegisters[0]);
+
+int zbmRegisterIndex(int reg)
+{
+	for (int i=0; i<ZbmRegisterCount; ++i) {
+		if (ZbmRegisters[i].address == reg)
+			return i;
+	}
+	return -1;
+}
@@ -0,0 +1,102 @@
+#ifndef ZBM_REGISTERS_H
+#define ZBM_REGISTERS_H
+
+#include <QMetaType>
+#include <QVector>
+
+class BatteryController;
+
+/// Modbus registers of the Redflow ZBM.
+enum ZbmRegister {
+	RegFirmwareVersion = 0x0003,
+	RegStatusSummary = 0x9001,
+	RegHardwareFailure = 0x9002,
+	RegOperationalFailure = 0x9003,
+	RegWarningIndicator = 0x9004,
+	RegOperationalMode = 0x9008,
+	RegSerial = 0x9010,
+	RegStateOfCharge = 0x9011,
+	RefAmpHours = 0x9012,
+	RegBatteryVoltage = 0x9013,
+	RegBatteryCurrent = 0x9014,
+	RegBatteryTemperature = 0x9015,
+	RegAirTemperature = 0x9016,
+	RegStateOfHealth = 0x9017,
+	RegBusVoltage = 0x9018,
+	RegBatteryState = 0x9019,
+	RegDeviceAddress = 0x9030,
+	RegClearStatusFlags = 0x9031,
+	RegDelayedSelfMaintenance = 0x9032,
+	RegEnterRunCommand = 0x9033,
+	RegImmediateSelfMaintenance = 0x9034
+};
+
+/*!
+ * Indicates how often a register should be retrieved from the device. The
+ * interval of each tier can be configured in `BatteryControllerUpdater`.
+ * Registers which do not change while the device is connected (serial number
+ * and firmware version) are retrieved once per connection, and are not part
+ * of any tier.
+ */
+enum PollTier {
+	FastTier,
+	StatusTier,
+	SlowTier,
+	HealthTier,
+	PollTierCount
+};
+
+/*!
+ * @brief Describes a register that is retrieved periodically from the ZBM.
+ * The value of the register is computed by taking the raw value (interpreted
+ * as signed 16 bit integer if `isSigned` is set), and dividing it by
+ * `divisor`. The result is stored in `BatteryController` using the `store`
+ * function.
+ */
+struct RegisterDescriptor
+{
+	quint16 address;
+	bool isSigned;
+	double divisor;
+	PollTier tier;
+	/// Name of the `BatteryController` property holding the value.
+	const char *property;
+	/// D-Bus path (relative to the service root), or 0 if the value should
+	/// not be published.
+	const char *path;
+	const char *unit;
+	int precision;
+	void (*store)(BatteryController *c, double value);
+
+	double decode(quint16 raw) const
+	{
+		return (isSigned ? static_cast<qint16>(raw) : raw) / divisor;
+	}
+};
+
+/// All registers retrieved periodically, sorted by address.
+extern const RegisterDescriptor ZbmRegisters[];
+
+extern const int ZbmRegisterCount;
+
+/// Returns the index of `reg` in `ZbmRegisters`, or -1 if it is not polled.
+int zbmRegisterIndex(int reg);
+
+/*!
+ * Decoded register values, indexed like `ZbmRegisters`. Used to pass the
+ * results of a complete poll from the thread handling the serial port to the
+ * main thread in a single event.
+ */
+struct RegisterValues
+{
+	QVector<double> values;
+	/// Indicates which entries of `values` have been retrieved.
+	QVector<bool> valid;
+	/// The time (µs, see `monotonicTime`) at which the reply containing each
+	/// value was received.
+	QVector<qint64> timestamps;
+};
+
+Q_DECLARE_METATYPE(RegisterValues)
+
+#endif // ZBM_REGISTERS_H
@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "crc16.h"
+#include "trace_format.h"
+
+// Prints the modbus frames found in one or more capture files, together with
+// the bus timing. Usage:
+//
+//   trace-decoder capture.1 capture
+//
+// Files are processed in the order given, so pass the rotated file first.
+// Receive records are joined into a single frame as long as the time between
+// them is shorter than the silent interval used by `ModbusRtu`. All times are
+// host side timestamps, so they include the latency of the serial driver.
+
+static const int MinimumSilentInterval = 5000;
+
+struct Summary
+{
+	Summary():
+		requests(0),
+		replies(0),
+		crcErrors(0),
+		missing(0),
+		turnaroundCount(0),
+		turnaroundTotal(0),
+		turnaroundMax(0),
+		gapCount(0),
+		gapTotal(0),
+		gapMax(0)
+	{}
+
+	int requests;
+	int replies;
+	int crcErrors;
+	int missing;
+	int turnaroundCount;
+	int64_t turnaroundTotal;
+	int64_t turnaroundMax;
+	int gapCount;
+	int64_t gapTotal;
+	int64_t gapMax;
+};
+
+class Decoder
+{
+public:
+	Decoder():
+		mBaudRate(0),
+		mSilentInterval(MinimumSilentInterval),
+		mTxTime(-1),
+		mTxEnd(-1),
+		mTxSlave(-1),
+		mReplied(true),
+		mRxStart(0),
+		mRxLast(-1)
+	{}
+
+	void add(int type, int64_t timestamp, const uint8_t *data, int length)
+	{
+		if (type != TraceReceive || (mRxLast >= 0 &&
+									 timestamp - mRxLast > mSilentInterval))
+			flushReceived();
+		switch (type) {
+		case TraceTransmit:
+			transmitted(timestamp, data, length);
+			break;
+		case TraceReceive:
+			if (mRx.empty())
+				mRxStart = timestamp;
+			mRx.insert(mRx.end(), data, data + length);
+			mRxLast = timestamp;
+			break;
+		case TraceBaudRate:
+			if (length == 4)
+				setBaudRate(data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24));
+			break;
+		default:
+			printf("%s  unknown record type %d\n", formatTime(timestamp), type);
+			break;
+		}
+	}
+
+	void finish()
+	{
+		flushReceived();
+		checkReplied();
+	}
+
+	const Summary &summary() const
+	{
+		return mSummary;
+	}
+
+private:
+	void setBaudRate(int baudRate)
+	{
+		if (baudRate == mBaudRate || baudRate <= 0)
+			return;
+		mBaudRate = baudRate;
+		// Same as ModbusRtu::updateSilentInterval
+		int64_t interval = baudRate > 19200 ? 1750 : (35 * 1000 * 1000) / baudRate;
+		mSilentInterval = interval < MinimumSilentInterval ?
+			MinimumSilentInterval : interval;
+		printf("baud rate %d\n", baudRate);
+	}
+
+	void transmitted(int64_t timestamp, const uint8_t *data, int length)
+	{
+		checkReplied();
+		++mSummary.requests;
+		printf("%s  TX ", formatTime(timestamp));
+		printFrame(data, length);
+		if (mTxEnd >= 0 && mRxLast >= 0 && mRxLast > mTxEnd) {
+			int64_t gap = timestamp - mRxLast;
+			printf("  gap %.1f ms", gap / 1000.0);
+			++mSummary.gapCount;
+			mSummary.gapTotal += gap;
+			if (gap > mSummary.gapMax)
+				mSummary.gapMax = gap;
+		}
+		printf("\n");
+		mTxTime = timestamp;
+		mTxEnd = timestamp + frameDuration(length);
+		mTxSlave = length > 0 ? data[0] : -1;
+		// No reply is expected for broadcasts.
+		mReplied = mTxSlave == 0;
+	}
+
+	void flushReceived()
+	{
+		if (mRx.empty())
+			return;
+		const uint8_t *data = &mRx[0];
+		int length = static_cast<int>(mRx.size());
+		printf("%s  RX ", formatTime(mRxStart));
+		printFrame(data, length);
+		if (mTxEnd >= 0 && mRxStart >= mTxTime) {
+			int64_t turnaround = mRxStart - mTxEnd;
+			printf("  turnaround %.1f ms", turnaround / 1000.0);
+			if (!mReplied) {
+				++mSummary.turnaroundCount;
+				mSummary.turnaroundTotal += turnaround;
+				if (turnaround > mSummary.turnaroundMax)
+					mSummary.turnaroundMax = turnaround;
+			}
+		}
+		if (length < 4 || !crcOk(data, length)) {
+			printf("  CRC FAIL");
+			++mSummary.crcErrors;
+		} else {
+			++mSummary.replies;
+			if (data[0] != mTxSlave)
+				printf("  unexpected slave");
+		}
+		printf("\n");
+		mReplied = true;
+		mRx.clear();
+	}
+
+	void checkReplied()
+	{
+		if (mReplied)
+			return;
+		printf("%s  no reply\n", formatTime(mTxTime));
+		++mSummary.missing;
+		mReplied = true;
+	}
+
+	/// Time (µs) needed to send `length` bytes, using 10 bits per character.
+	int64_t frameDuration(int length) const
+	{
+		if (mBaudRate <= 0)
+			return 0;
+		return static_cast<int64_t>(length) * 10 * 1000 * 1000 / mBaudRate;
+	}
+
+	static bool crcOk(const uint8_t *data, int length)
+	{
+		uint16_t crc = static_cast<uint16_t>((data[length - 2] << 8) | data[length - 1]);
+		return Crc16::getValue(data, length - 2) == crc;
+	}
+
+	static void printFrame(const uint8_t *data, int length)
+	{
+		if (length >= 2) {
+			int function = data[1] & 0x7F;
+			printf("slave %3d fc %2d%s ", data[0], function,
+				   (data[1] & 0x80) != 0 ? " (exception)" : "");
+		}
+		printf("[");
+		for (int i=0; i<length; ++i)
+			printf(i == 0 ? "%02x" : " %02x", data[i]);
+		printf("]");
+	}
+
+	static const char *formatTime(int64_t timestamp)
+	{
+		static char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%6lld.%06lld",
+				 static_cast<long long>(timestamp / 1000000),
+				 static_cast<long long>(timestamp % 1000000));
+		return buffer;
+	}
+
+	int mBaudRate;
+	int64_t mSilentInterval;
+	int64_t mTxTime;
+	int64_t mTxEnd;
+	int mTxSlave;
+	// False while waiting for the reply on the last request.
+	bool mReplied;
+	std::vector<uint8_t> mRx;
+	int64_t mRxStart;
+	int64_t mRxLast;
+	Summary mSummary;
+};
+
+static uint64_t readLittleEndian(const uint8_t *data, int count)
+{
+	uint64_t v = 0;
+	for (int i=count-1; i>=0; --i)
+		v = (v << 8) | data[i];
+	return v;
+}
+
+static bool decodeFile(const char *fileName, Decoder &decoder)
+{
+	FILE *file = fopen(fileName, "rb");
+	if (file == 0) {
+		fprintf(stderr, "Could not open %s\n", fileName);
+		return false;
+	}
+	uint8_t header[TraceFileHeaderSize];
+	if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+		memcmp(header, TraceMagic, sizeof(TraceMagic)) != 0) {
+		fprintf(stderr, "%s is not a capture file\n", fileName);
+		fclose(file);
+		return false;
+	}
+	uint16_t version = static_cast<uint16_t>(readLittleEndian(header + 8, 2));
+	if (version != TraceVersion) {
+		fprintf(stderr, "%s: unsupported version %d\n", fileName, version);
+		fclose(file);
+		return false;
+	}
+	printf("%s\n", fileName);
+	std::vector<uint8_t> payload;
+	for (;;) {
+		uint8_t record[TraceRecordHeaderSize];
+		size_t n = fread(record, 1, sizeof(record), file);
+		if (n == 0)
+			break;
+		int length = static_cast<int>(readLittleEndian(record + 1, 2));
+		payload.resize(length);
+		if (n != sizeof(record) ||
+			(length > 0 && fread(&payload[0], 1, length, file) != static_cast<size_t>(length))) {
+			// The application may have been stopped while writing a record.
+			fprintf(stderr, "%s: truncated record\n", fileName);
+			break;
+		}
+		int64_t timestamp = static_cast<int64_t>(readLittleEndian(record + 3, 8));
+		decoder.add(record[0], timestamp, length > 0 ? &payload[0] : 0, length);
+	}
+	fclose(file);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s capture-file...\n", argv[0]);
+		return 1;
+	}
+	Decoder decoder;
+	for (int i=1; i<argc; ++i) {
+		if (!decodeFile(argv[i], decoder))
+			return 1;
+	}
+	decoder.finish();
+	const Summary &s = decoder.summary();
+	printf("\nrequests %d, replies %d, CRC errors %d, no reply %d\n",
+		   s.requests, s.replies, s.crcErrors, s.missing);
+	if (s.turnaroundCount > 0) {
+		printf("turnaround avg %.1f ms, max %.1f ms\n",
+			   s.turnaroundTotal / 1000.0 / s.turnaroundCount,
+			   s.turnaroundMax / 1000.0);
+	}
+	if (s.gapCount > 0) {
+		printf("gap avg %.1f ms, max %.1f ms\n",
+			   s.gapTotal / 1000.0 / s.gapCount, s.gapMax / 1000.0);
+	}
+	return 0;
+}
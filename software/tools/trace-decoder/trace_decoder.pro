@@ -0,0 +1,21 @@
+# Prints the modbus frames in a capture file written with the --capture
+# option. Not part of the application build.
+
+QT += core
+QT -= gui
+
+TARGET = trace-decoder
+CONFIG += console release
+CONFIG -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+SOURCES += \
+    main.cpp \
+    ../../src/crc16.cpp
+
+HEADERS += \
+    ../../src/crc16.h \
+    ../../src/trace_format.h
@@ -0,0 +1,27 @@
+# Example fault profile for zbm-sim (see fault_profile.h). Run with:
+#   zbm-sim -n 30 -f example.profile
+
+# A clean bus for the first minute.
+at 60
+# Light noise.
+crc 1
+drop 0.5
+truncate 0.5
+at 120
+# A battery disappears for 30 seconds, while the others are busy at times.
+vanish 5 30
+busy 2
+delay 5 300
+at 180
+# Heavy noise.
+crc 10
+drop 5
+illegal-address 1
+at 240
+# Back to normal.
+crc 0
+drop 0
+truncate 0
+delay 0 0
+busy 0
+illegal-address 0
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fault_profile.h"
+
+FaultProfile::FaultProfile()
+{
+	FaultPhase phase;
+	phase.start = 0;
+	mPhases.push_back(phase);
+}
+
+bool FaultProfile::load(const char *fileName)
+{
+	FILE *file = fopen(fileName, "r");
+	if (file == 0) {
+		perror(fileName);
+		return false;
+	}
+	char line[256];
+	int lineNumber = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), file) != 0) {
+		++lineNumber;
+		char *comment = strchr(line, '#');
+		if (comment != 0)
+			*comment = 0;
+		char keyword[32];
+		double a = 0;
+		double b = 0;
+		int n = sscanf(line, "%31s %lf %lf", keyword, &a, &b);
+		if (n < 1)
+			continue;
+		FaultSettings &s = mPhases.back().settings;
+		std::string k = keyword;
+		if (k == "crc" && n == 2) {
+			s.crcError = a;
+		} else if (k == "drop" && n == 2) {
+			s.drop = a;
+		} else if (k == "truncate" && n == 2) {
+			s.truncate = a;
+		} else if (k == "delay" && n == 3) {
+			s.delay = a;
+			s.delayTime = static_cast<int>(b);
+		} else if (k == "busy" && n == 2) {
+			s.busy = a;
+		} else if (k == "illegal-address" && n == 2) {
+			s.illegalAddress = a;
+		} else if (k == "vanish" && n == 3 && a >= 1 && a <= 247) {
+			Vanish v;
+			v.address = static_cast<uint8_t>(a);
+			v.start = mPhases.back().start;
+			v.end = v.start + static_cast<int64_t>(b * 1e6);
+			mVanished.push_back(v);
+		} else if (k == "at" && n == 2 && a * 1e6 > mPhases.back().start) {
+			FaultPhase phase = mPhases.back();
+			phase.start = static_cast<int64_t>(a * 1e6);
+			mPhases.push_back(phase);
+		} else {
+			fprintf(stderr, "%s:%d: invalid line\n", fileName, lineNumber);
+			ok = false;
+		}
+	}
+	fclose(file);
+	return ok;
+}
+
+int FaultProfile::phaseCount() const
+{
+	return static_cast<int>(mPhases.size());
+}
+
+const FaultPhase &FaultProfile::phase(int index) const
+{
+	return mPhases[index];
+}
+
+int FaultProfile::phaseAt(int64_t elapsed) const
+{
+	int index = 0;
+	while (index + 1 < phaseCount() && mPhases[index + 1].start <= elapsed)
+		++index;
+	return index;
+}
+
+bool FaultProfile::isVanished(uint8_t address, int64_t elapsed) const
+{
+	for (size_t i=0; i<mVanished.size(); ++i) {
+		const Vanish &v = mVanished[i];
+		if (v.address == address && elapsed >= v.start && elapsed < v.end)
+			return true;
+	}
+	return false;
+}
@@ -0,0 +1,91 @@
+#ifndef FAULT_PROFILE_H
+#define FAULT_PROFILE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/// Probabilities (%) of the faults injected in each request.
+struct FaultSettings
+{
+	FaultSettings():
+		crcError(0),
+		drop(0),
+		truncate(0),
+		delay(0),
+		delayTime(0),
+		busy(0),
+		illegalAddress(0)
+	{}
+
+	/// Reply sent with a corrupted CRC.
+	double crcError;
+	/// No reply.
+	double drop;
+	/// Only the first part of the reply is sent.
+	double truncate;
+	/// Reply sent `delayTime` (ms) later than usual.
+	double delay;
+	int delayTime;
+	/// `SlaveDeviceBusy` exception instead of executing the request.
+	double busy;
+	/// `IllegalDataAddress` exception instead of executing the request.
+	double illegalAddress;
+};
+
+struct FaultPhase
+{
+	/// Time (µs, relative to the start of the simulation) at which the
+	/// phase starts.
+	int64_t start;
+	FaultSettings settings;
+};
+
+/*!
+ * Fault injection script for the simulator, read from a text file. Each line
+ * contains a keyword followed by its arguments. Empty lines and text after
+ * `#` are ignored.
+ *
+ *   crc <percentage>              reply with a corrupted CRC
+ *   drop <percentage>             do not reply
+ *   truncate <percentage>         send the first part of the reply only
+ *   delay <percentage> <ms>       add <ms> to the response latency
+ *   busy <percentage>             reply with a SlaveDeviceBusy exception
+ *   illegal-address <percentage>  reply with an IllegalDataAddress exception
+ *   vanish <address> <seconds>    the slave does not respond at all for the
+ *                                 given time, starting with the current phase
+ *   at <seconds>                  start a new phase
+ *
+ * The settings before the first `at` apply from the start. A new phase
+ * starts with the settings of the previous one.
+ */
+class FaultProfile
+{
+public:
+	FaultProfile();
+
+	/// Returns false (after printing the reason) if the file is invalid.
+	bool load(const char *fileName);
+
+	int phaseCount() const;
+
+	const FaultPhase &phase(int index) const;
+
+	/// Index of the phase active at `elapsed` (µs).
+	int phaseAt(int64_t elapsed) const;
+
+	/// Returns true if `address` does not respond at `elapsed` (µs).
+	bool isVanished(uint8_t address, int64_t elapsed) const;
+
+private:
+	struct Vanish {
+		uint8_t address;
+		int64_t start;
+		int64_t end;
+	};
+
+	std::vector<FaultPhase> mPhases;
+	std::vector<Vanish> mVanished;
+};
+
+#endif // FAULT_PROFILE_H
@@ -0,0 +1,607 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "crc16.h"
+#include "fault_profile.h"
+#include "simulated_battery.h"
+
+// Simulates a serial bus with ZBM batteries on a pseudo terminal. Start it,
+// and pass the name of the terminal it prints to dbus-redflow:
+//
+//   zbm-sim -n 30 -l 15 -j 5
+//   dbus-redflow -b session /dev/pts/3
+//
+// The batteries get consecutive addresses, skipping the default addresses
+// (1 and 99). Batteries created with -u keep a default address, so they are
+// picked up and readdressed by the device scanner. If more than one battery
+// has the same address, they all reply at once, which is simulated by
+// sending a corrupted reply.
+//
+// A pseudo terminal transfers data instantly, so the time needed to send the
+// request and the reply at the configured baud rate is added to the response
+// latency.
+//
+// Faults can be injected using a profile (-f, see fault_profile.h). When a
+// phase of the profile ends, and when the simulator is stopped, a report is
+// printed with the poll rate and data staleness achieved during the phase.
+// Staleness is the time since a battery was last polled, that is the age of
+// the data published by dbus-redflow. The random faults are reproducible for
+// a given seed (-r).
+
+struct Options
+{
+	Options():
+		count(1),
+		firstAddress(2),
+		newCount(0),
+		latency(10),
+		jitter(0),
+		baudRate(19200),
+		link(0),
+		statisticsInterval(10),
+		profile(0),
+		seed(1),
+		verbose(false)
+	{}
+
+	int count;
+	int firstAddress;
+	int newCount;
+	// Time (ms) between receiving a request and sending the reply.
+	int latency;
+	int jitter;
+	int baudRate;
+	const char *link;
+	// Interval (s) at which statistics are printed.
+	int statisticsInterval;
+	const char *profile;
+	unsigned int seed;
+	bool verbose;
+};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onSignal(int)
+{
+	stopRequested = 1;
+}
+
+static int64_t timestamp()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+/// Returns true with the given probability (%).
+static bool roll(double percentage)
+{
+	return percentage > 0 && rand() / (RAND_MAX + 1.0) * 100 < percentage;
+}
+
+static void printFrame(const char *direction, const uint8_t *data, int length)
+{
+	printf("%s", direction);
+	for (int i=0; i<length; ++i)
+		printf(" %02x", data[i]);
+	printf("\n");
+}
+
+class Simulator
+{
+public:
+	Simulator(const Options &options, const FaultProfile &profile):
+		mOptions(options),
+		mProfile(profile),
+		mMaster(-1),
+		mSlave(-1),
+		mSilentInterval(0),
+		mLastReceived(0),
+		mReplyDue(-1),
+		mRequests(0),
+		mIgnored(0),
+		mReplies(0),
+		mCrcErrors(0),
+		mLastRequests(0),
+		mStart(timestamp()),
+		mStatisticsTime(mStart),
+		mPhase(0),
+		mPhaseStart(mStart),
+		mPhaseRequests(0)
+	{
+		int address = options.firstAddress;
+		for (int i=0; i<options.count; ++i) {
+			while (address == 1 || address == 99)
+				++address;
+			mBatteries.push_back(SimulatedBattery(static_cast<uint8_t>(address),
+												  static_cast<uint16_t>(1000 + i)));
+			++address;
+		}
+		for (int i=0; i<options.newCount; ++i) {
+			mBatteries.push_back(SimulatedBattery(i % 2 == 0 ? 1 : 99,
+												  static_cast<uint16_t>(2000 + i)));
+		}
+		mLastPollCounts.resize(mBatteries.size(), 0);
+		Freshness f;
+		f.lastPoll = mStart;
+		f.segmentStart = mStart;
+		f.ageIntegral = 0;
+		f.maxAge = 0;
+		f.polls = 0;
+		f.phasePolls = 0;
+		mFreshness.resize(mBatteries.size(), f);
+		// Same as ModbusRtu: 3.5 characters, but at least 5 ms.
+		if (options.baudRate > 0)
+			mSilentInterval = 35 * 1000000LL / options.baudRate;
+		if (mSilentInterval < 5000)
+			mSilentInterval = 5000;
+	}
+
+	~Simulator()
+	{
+		if (mOptions.link != 0)
+			unlink(mOptions.link);
+		if (mSlave >= 0)
+			close(mSlave);
+		if (mMaster >= 0)
+			close(mMaster);
+	}
+
+	bool open()
+	{
+		mMaster = posix_openpt(O_RDWR | O_NOCTTY);
+		if (mMaster < 0 || grantpt(mMaster) != 0 || unlockpt(mMaster) != 0) {
+			perror("Could not create pseudo terminal");
+			return false;
+		}
+		const char *name = ptsname(mMaster);
+		// Keep the other side open, so reading does not fail while
+		// dbus-redflow is not connected.
+		mSlave = ::open(name, O_RDWR | O_NOCTTY);
+		if (mSlave < 0) {
+			perror(name);
+			return false;
+		}
+		struct termios t;
+		tcgetattr(mSlave, &t);
+		cfmakeraw(&t);
+		tcsetattr(mSlave, TCSANOW, &t);
+		tcgetattr(mMaster, &t);
+		cfmakeraw(&t);
+		tcsetattr(mMaster, TCSANOW, &t);
+		if (mOptions.link != 0) {
+			unlink(mOptions.link);
+			if (symlink(name, mOptions.link) != 0) {
+				perror(mOptions.link);
+				return false;
+			}
+		}
+		printf("Simulating %d batteries on %s\n", static_cast<int>(mBatteries.size()),
+			   mOptions.link != 0 ? mOptions.link : name);
+		fflush(stdout);
+		return true;
+	}
+
+	void run()
+	{
+		int64_t nextStatistics = mStart + mOptions.statisticsInterval * 1000000LL;
+		while (!stopRequested) {
+			int64_t now = timestamp();
+			int64_t wakeUp = nextStatistics;
+			if (mReplyDue >= 0 && mReplyDue < wakeUp)
+				wakeUp = mReplyDue;
+			if (!mRx.empty() && mLastReceived + mSilentInterval < wakeUp)
+				wakeUp = mLastReceived + mSilentInterval;
+			int64_t wait = wakeUp > now ? wakeUp - now : 0;
+			fd_set fds;
+			FD_ZERO(&fds);
+			FD_SET(mMaster, &fds);
+			struct timeval tv;
+			tv.tv_sec = static_cast<long>(wait / 1000000);
+			tv.tv_usec = static_cast<long>(wait % 1000000);
+			int n = select(mMaster + 1, &fds, 0, 0, &tv);
+			now = timestamp();
+			if (n > 0 && FD_ISSET(mMaster, &fds)) {
+				uint8_t buffer[512];
+				ssize_t length = read(mMaster, buffer, sizeof(buffer));
+				if (length > 0)
+					received(now, buffer, static_cast<int>(length));
+			}
+			if (mReplyDue >= 0 && now >= mReplyDue)
+				sendReply();
+			if (!mRx.empty() && now - mLastReceived >= mSilentInterval) {
+				// Incomplete request, or an unsupported function.
+				if (mOptions.verbose)
+					printFrame("discarded", &mRx[0], static_cast<int>(mRx.size()));
+				mRx.clear();
+			}
+			int phase = mProfile.phaseAt(now - mStart);
+			if (phase != mPhase) {
+				printPhaseReport(now);
+				mPhase = phase;
+			}
+			if (now >= nextStatistics) {
+				printStatistics(now);
+				nextStatistics += mOptions.statisticsInterval * 1000000LL;
+			}
+		}
+		int64_t now = timestamp();
+		printStatistics(now);
+		printPhaseReport(now);
+	}
+
+private:
+	void received(int64_t now, const uint8_t *data, int length)
+	{
+		mLastReceived = now;
+		mRx.insert(mRx.end(), data, data + length);
+		for (;;) {
+			int expected = expectedLength();
+			if (expected <= 0 || static_cast<int>(mRx.size()) < expected)
+				return;
+			const uint8_t *frame = &mRx[0];
+			uint16_t crc = static_cast<uint16_t>((frame[expected - 2] << 8) |
+												 frame[expected - 1]);
+			if (Crc16::getValue(frame, expected - 2) != crc) {
+				++mCrcErrors;
+				if (mOptions.verbose)
+					printFrame("CRC error", frame, static_cast<int>(mRx.size()));
+				mRx.clear();
+				return;
+			}
+			handle(now, frame, expected);
+			mRx.erase(mRx.begin(), mRx.begin() + expected);
+		}
+	}
+
+	/// Length of the request in `mRx`, 0 if unknown yet, -1 if unsupported.
+	int expectedLength() const
+	{
+		int length = static_cast<int>(mRx.size());
+		if (length < 2)
+			return 0;
+		switch (mRx[1]) {
+		case 3:
+		case 4:
+		case 6:
+			return 8;
+		case 16:
+			return length < 7 ? 0 : 9 + mRx[6];
+		case 23:
+			return length < 11 ? 0 : 13 + mRx[10];
+		default:
+			return -1;
+		}
+	}
+
+	void handle(int64_t now, const uint8_t *frame, int length)
+	{
+		++mRequests;
+		if (mOptions.verbose)
+			printFrame("request", frame, length);
+		++mPhaseRequests;
+		if (mReplyDue >= 0) {
+			// The bus is half duplex, so the batteries cannot receive a
+			// request while a reply is pending. Replacing the pending reply
+			// would answer the previous request with the wrong data.
+			++mIgnored;
+			if (mOptions.verbose)
+				printf("ignored: reply pending\n");
+			return;
+		}
+		uint8_t address = frame[0];
+		int64_t elapsed = now - mStart;
+		const FaultSettings &faults = mProfile.phase(mPhase).settings;
+		// The exceptions replace the execution of the request.
+		int exception = 0;
+		if (address != 0) {
+			if (roll(faults.busy))
+				exception = 6;
+			else if (roll(faults.illegalAddress))
+				exception = 2;
+		}
+		std::vector<uint8_t> reply;
+		int replyCount = 0;
+		// Battery whose state of charge was read, or -1.
+		int polled = -1;
+		for (size_t i=0; i<mBatteries.size(); ++i) {
+			SimulatedBattery &b = mBatteries[i];
+			if (address != 0 && b.address() != address)
+				continue;
+			if (mProfile.isVanished(b.address(), elapsed)) {
+				++mFaults.vanished;
+				continue;
+			}
+			b.update(now);
+			std::vector<uint8_t> r;
+			if (exception != 0) {
+				r.push_back(address);
+				r.push_back(static_cast<uint8_t>(frame[1] | 0x80));
+				r.push_back(static_cast<uint8_t>(exception));
+			} else {
+				r = b.handle(frame, length - 2);
+				if (b.pollCount() != mFreshness[i].polls) {
+					mFreshness[i].polls = b.pollCount();
+					polled = static_cast<int>(i);
+				}
+			}
+			if (!r.empty()) {
+				reply = r;
+				++replyCount;
+			}
+		}
+		if (replyCount == 0)
+			return;
+		if (exception == 6)
+			++mFaults.busy;
+		else if (exception == 2)
+			++mFaults.illegalAddress;
+		if (roll(faults.drop)) {
+			++mFaults.dropped;
+			return;
+		}
+		uint16_t crc = Crc16::getValue(&reply[0], static_cast<int>(reply.size()));
+		reply.push_back(static_cast<uint8_t>(crc >> 8));
+		reply.push_back(static_cast<uint8_t>(crc & 0xFF));
+		bool corrupted = replyCount > 1;
+		if (corrupted) {
+			for (size_t i=1; i<reply.size(); i+=2)
+				reply[i] ^= 0x5A;
+		}
+		if (roll(faults.crcError)) {
+			++mFaults.crcErrors;
+			reply[reply.size() - 1] ^= 0xFF;
+			corrupted = true;
+		}
+		if (roll(faults.truncate)) {
+			++mFaults.truncated;
+			reply.resize(1 + rand() % (reply.size() - 1));
+			corrupted = true;
+		}
+		// Only intact replies refresh the data in dbus-redflow.
+		if (polled >= 0 && !corrupted)
+			addPoll(mFreshness[polled], now);
+		int64_t delay = mOptions.latency * 1000LL;
+		if (mOptions.jitter > 0)
+			delay += (rand() % (2 * mOptions.jitter + 1) - mOptions.jitter) * 1000LL;
+		if (delay < 0)
+			delay = 0;
+		if (roll(faults.delay)) {
+			++mFaults.delayed;
+			delay += faults.delayTime * 1000LL;
+		}
+		mReply = reply;
+		mReplyDue = now + wireTime(length) + delay + wireTime(static_cast<int>(reply.size()));
+	}
+
+	void sendReply()
+	{
+		mReplyDue = -1;
+		if (mOptions.verbose)
+			printFrame("reply  ", &mReply[0], static_cast<int>(mReply.size()));
+		if (write(mMaster, &mReply[0], mReply.size()) < 0)
+			perror("write");
+		else
+			++mReplies;
+	}
+
+	/// Time (µs) needed to send `length` bytes, using 10 bits per character.
+	int64_t wireTime(int length) const
+	{
+		if (mOptions.baudRate <= 0)
+			return 0;
+		return static_cast<int64_t>(length) * 10 * 1000000 / mOptions.baudRate;
+	}
+
+	void printStatistics(int64_t now)
+	{
+		double interval = (now - mStatisticsTime) / 1e6;
+		mStatisticsTime = now;
+		int requests = mRequests - mLastRequests;
+		mLastRequests = mRequests;
+		// Cycle time: the time between reads of the state of charge.
+		int polled = 0;
+		double cycleTotal = 0;
+		double cycleMax = 0;
+		for (size_t i=0; i<mBatteries.size(); ++i) {
+			int polls = mBatteries[i].pollCount() - mLastPollCounts[i];
+			mLastPollCounts[i] = mBatteries[i].pollCount();
+			if (polls == 0)
+				continue;
+			double cycle = interval / polls;
+			++polled;
+			cycleTotal += cycle;
+			if (cycle > cycleMax)
+				cycleMax = cycle;
+		}
+		printf("%8.1f s: %6.1f requests/s, %d replies, %d CRC errors, %d ignored",
+			   (now - mStart) / 1e6, interval > 0 ? requests / interval : 0,
+			   mReplies, mCrcErrors, mIgnored);
+		if (polled > 0) {
+			printf(", cycle time avg %.2f s max %.2f s (%d/%d batteries polled)",
+				   cycleTotal / polled, cycleMax, polled,
+				   static_cast<int>(mBatteries.size()));
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	// Tracks the age of the data of a battery (the time since it was last
+	// polled) during the current phase. `ageIntegral` is the age integrated
+	// over time (µs²), so dividing it by the duration gives the average age.
+	struct Freshness {
+		int64_t lastPoll;
+		int64_t segmentStart;
+		double ageIntegral;
+		int64_t maxAge;
+		// Value of `SimulatedBattery::pollCount` at the last poll.
+		int polls;
+		int phasePolls;
+	};
+
+	struct FaultCounters {
+		FaultCounters():
+			crcErrors(0),
+			dropped(0),
+			truncated(0),
+			delayed(0),
+			busy(0),
+			illegalAddress(0),
+			vanished(0)
+		{}
+
+		int crcErrors;
+		int dropped;
+		int truncated;
+		int delayed;
+		int busy;
+		int illegalAddress;
+		int vanished;
+	};
+
+	static void addAge(Freshness &f, int64_t until)
+	{
+		double start = static_cast<double>(f.segmentStart - f.lastPoll);
+		double end = static_cast<double>(until - f.lastPoll);
+		f.ageIntegral += (end * end - start * start) / 2;
+		if (until - f.lastPoll > f.maxAge)
+			f.maxAge = until - f.lastPoll;
+		f.segmentStart = until;
+	}
+
+	static void addPoll(Freshness &f, int64_t now)
+	{
+		addAge(f, now);
+		f.lastPoll = now;
+		++f.phasePolls;
+	}
+
+	void printPhaseReport(int64_t now)
+	{
+		double duration = (now - mPhaseStart) / 1e6;
+		if (duration <= 0)
+			return;
+		int polls = 0;
+		double ageTotal = 0;
+		int64_t maxAge = 0;
+		for (size_t i=0; i<mFreshness.size(); ++i) {
+			Freshness &f = mFreshness[i];
+			addAge(f, now);
+			ageTotal += f.ageIntegral / (now - mPhaseStart);
+			if (f.maxAge > maxAge)
+				maxAge = f.maxAge;
+			polls += f.phasePolls;
+			f.phasePolls = 0;
+			f.ageIntegral = 0;
+			f.maxAge = 0;
+		}
+		int batteries = static_cast<int>(mFreshness.size());
+		printf("phase %d (%.1f s): %.1f requests/s, %.2f polls/s per battery, "
+			   "staleness avg %.2f s max %.2f s\n",
+			   mPhase + 1, duration, mPhaseRequests / duration,
+			   batteries > 0 ? polls / duration / batteries : 0,
+			   batteries > 0 ? ageTotal / batteries / 1e6 : 0, maxAge / 1e6);
+		printf("  faults: %d CRC errors, %d dropped, %d truncated, %d delayed, "
+			   "%d busy, %d illegal address, %d vanished\n",
+			   mFaults.crcErrors, mFaults.dropped, mFaults.truncated,
+			   mFaults.delayed, mFaults.busy, mFaults.illegalAddress,
+			   mFaults.vanished);
+		fflush(stdout);
+		mFaults = FaultCounters();
+		mPhaseStart = now;
+		mPhaseRequests = 0;
+	}
+
+	Options mOptions;
+	FaultProfile mProfile;
+	std::vector<SimulatedBattery> mBatteries;
+	int mMaster;
+	int mSlave;
+	int64_t mSilentInterval;
+	std::vector<uint8_t> mRx;
+	int64_t mLastReceived;
+	std::vector<uint8_t> mReply;
+	// Time (µs) at which mReply should be sent, -1 if there is none.
+	int64_t mReplyDue;
+	int mRequests;
+	// Requests received while a reply was pending.
+	int mIgnored;
+	int mReplies;
+	int mCrcErrors;
+	int mLastRequests;
+	std::vector<int> mLastPollCounts;
+	int64_t mStart;
+	int64_t mStatisticsTime;
+	int mPhase;
+	int64_t mPhaseStart;
+	int mPhaseRequests;
+	std::vector<Freshness> mFreshness;
+	FaultCounters mFaults;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  -n count    number of batteries (default 1)\n"
+			"  -a address  address of the first battery (default 2)\n"
+			"  -u count    number of batteries with a default address (1 or 99)\n"
+			"  -l ms       response latency (default 10)\n"
+			"  -j ms       maximum deviation of the latency (default 0)\n"
+			"  -b rate     baud rate used to compute transfer times, 0 for none\n"
+			"              (default 19200)\n"
+			"  -s path     create a symbolic link to the pseudo terminal\n"
+			"  -i seconds  statistics interval (default 10)\n"
+			"  -f file     fault profile (see fault_profile.h)\n"
+			"  -r seed     seed used for random faults and jitter (default 1)\n"
+			"  -v          print all frames\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	Options options;
+	int c;
+	while ((c = getopt(argc, argv, "n:a:u:l:j:b:s:i:f:r:vh")) != -1) {
+		switch (c) {
+		case 'n': options.count = atoi(optarg); break;
+		case 'a': options.firstAddress = atoi(optarg); break;
+		case 'u': options.newCount = atoi(optarg); break;
+		case 'l': options.latency = atoi(optarg); break;
+		case 'j': options.jitter = atoi(optarg); break;
+		case 'b': options.baudRate = atoi(optarg); break;
+		case 's': options.link = optarg; break;
+		case 'i': options.statisticsInterval = atoi(optarg); break;
+		case 'f': options.profile = optarg; break;
+		case 'r': options.seed = static_cast<unsigned int>(atoi(optarg)); break;
+		case 'v': options.verbose = true; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	int available = 247 - options.firstAddress + 1 -
+		(options.firstAddress <= 99 ? 1 : 0);
+	if (options.count < 0 || options.newCount < 0 || options.firstAddress < 2 ||
+		options.count > available || options.statisticsInterval <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+	FaultProfile profile;
+	if (options.profile != 0 && !profile.load(options.profile))
+		return 1;
+	srand(options.seed);
+	Simulator simulator(options, profile);
+	if (!simulator.open())
+		return 1;
+	simulator.run();
+	return 0;
+}
@@ -0,0 +1,240 @@
+#include <math.h>
+#include <string.h>
+#include "simulated_battery.h"
+#include "zbm_registers.h"
+
+static const uint16_t FirstRegister = RegStatusSummary;
+static const uint16_t LastRegister = RegImmediateSelfMaintenance;
+static const uint16_t FirmwareVersionMajor = 0x0001;
+static const uint16_t FirmwareVersionMinor = 0x0017;
+// Capacity (Ah) used to compute the state of charge.
+static const double Capacity = 200;
+// Period (s) of the simulated charge/discharge cycle, and its peak current.
+static const double CyclePeriod = 600;
+static const double PeakCurrent = 40;
+
+static uint16_t toUInt16(const uint8_t *data)
+{
+	return static_cast<uint16_t>((data[0] << 8) | data[1]);
+}
+
+static void append(std::vector<uint8_t> &frame, uint16_t value)
+{
+	frame.push_back(static_cast<uint8_t>(value >> 8));
+	frame.push_back(static_cast<uint8_t>(value & 0xFF));
+}
+
+SimulatedBattery::SimulatedBattery(uint8_t address, uint16_t serial):
+	mAddress(address),
+	mNewAddress(address),
+	mSerial(serial),
+	mSoc(50 + (serial % 40)),
+	mLastUpdate(-1),
+	mPollCount(0),
+	mLastPoll(-1)
+{
+	memset(mRegisters, 0, sizeof(mRegisters));
+	mRegisters[RegOperationalMode - FirstRegister] = 1;
+	mRegisters[RegSerial - FirstRegister] = serial;
+	mRegisters[RegStateOfHealth - FirstRegister] = 100;
+	mRegisters[RegBatteryState - FirstRegister] = 1;
+}
+
+uint8_t SimulatedBattery::address() const
+{
+	return mAddress;
+}
+
+void SimulatedBattery::update(int64_t now)
+{
+	// Each battery runs the same cycle, shifted by its serial number.
+	double t = now / 1e6;
+	double phase = 2 * M_PI * (t / CyclePeriod + (mSerial % 10) / 10.0);
+	double current = PeakCurrent * sin(phase);
+	if (mLastUpdate >= 0) {
+		double hours = (now - mLastUpdate) / 3.6e9;
+		mSoc += 100 * current * hours / Capacity;
+		mSoc = mSoc < 0 ? 0 : (mSoc > 100 ? 100 : mSoc);
+	}
+	mLastUpdate = now;
+	double voltage = 48 + 0.08 * mSoc + 0.02 * current;
+	double temperature = 25 + 0.1 * fabs(current);
+	// Registers with a negative divisor (see zbm_registers.cpp) are stored
+	// negated.
+	mRegisters[RegStateOfCharge - FirstRegister] = static_cast<uint16_t>(mSoc * 100);
+	mRegisters[RefAmpHours - FirstRegister] =
+		static_cast<uint16_t>(static_cast<int16_t>(Capacity * (mSoc - 100) / 10));
+	mRegisters[RegBatteryVoltage - FirstRegister] = static_cast<uint16_t>(voltage * 10);
+	mRegisters[RegBatteryCurrent - FirstRegister] =
+		static_cast<uint16_t>(static_cast<int16_t>(-current * 10));
+	mRegisters[RegBatteryTemperature - FirstRegister] =
+		static_cast<uint16_t>(static_cast<int16_t>(temperature * 10));
+	mRegisters[RegAirTemperature - FirstRegister] = 230;
+	mRegisters[RegBusVoltage - FirstRegister] = static_cast<uint16_t>(voltage * 10);
+}
+
+std::vector<uint8_t> SimulatedBattery::handle(const uint8_t *request, int length)
+{
+	std::vector<uint8_t> reply;
+	int function = request[1];
+	bool broadcast = request[0] == 0;
+	switch (function) {
+	case 3:
+	case 4:
+		if (length != 6)
+			return exception(request, 3);
+		reply = readReply(request, function, toUInt16(request + 2),
+						  toUInt16(request + 4));
+		break;
+	case 6:
+		if (length != 6)
+			return exception(request, 3);
+		if (!writeRegister(toUInt16(request + 2), toUInt16(request + 4)))
+			return exception(request, 2);
+		reply.assign(request, request + 6);
+		break;
+	case 16:
+	{
+		uint16_t start = toUInt16(request + 2);
+		int count = toUInt16(request + 4);
+		if (length < 7 || count < 1 || count > 123 || request[6] != 2 * count ||
+			length != 7 + 2 * count)
+			return exception(request, 3);
+		for (int i=0; i<count; ++i) {
+			if (!isWritable(static_cast<uint16_t>(start + i)))
+				return exception(request, 2);
+		}
+		for (int i=0; i<count; ++i)
+			writeRegister(static_cast<uint16_t>(start + i), toUInt16(request + 7 + 2 * i));
+		reply.assign(request, request + 6);
+		break;
+	}
+	case 23:
+	{
+		uint16_t writeStart = toUInt16(request + 6);
+		int writeCount = toUInt16(request + 8);
+		if (length < 11 || writeCount < 1 || writeCount > 121 ||
+			request[10] != 2 * writeCount || length != 11 + 2 * writeCount)
+			return exception(request, 3);
+		for (int i=0; i<writeCount; ++i) {
+			if (!isWritable(static_cast<uint16_t>(writeStart + i)))
+				return exception(request, 2);
+		}
+		for (int i=0; i<writeCount; ++i) {
+			writeRegister(static_cast<uint16_t>(writeStart + i),
+						  toUInt16(request + 11 + 2 * i));
+		}
+		reply = readReply(request, function, toUInt16(request + 2),
+						  toUInt16(request + 4));
+		break;
+	}
+	default:
+		return exception(request, 1);
+	}
+	// The reply is sent from the old address.
+	mAddress = mNewAddress;
+	if (broadcast)
+		reply.clear();
+	return reply;
+}
+
+int SimulatedBattery::pollCount() const
+{
+	return mPollCount;
+}
+
+int64_t SimulatedBattery::lastPoll() const
+{
+	return mLastPoll;
+}
+
+bool SimulatedBattery::readRegister(uint16_t reg, uint16_t &value) const
+{
+	if (reg >= FirstRegister && reg <= LastRegister) {
+		value = mRegisters[reg - FirstRegister];
+		return true;
+	}
+	switch (reg) {
+	case 0x0000:
+	case 0x0001:
+	case 0x0002:
+		value = 0;
+		return true;
+	case RegFirmwareVersion:
+		value = FirmwareVersionMajor;
+		return true;
+	case RegFirmwareVersion + 1:
+		value = FirmwareVersionMinor;
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool SimulatedBattery::writeRegister(uint16_t reg, uint16_t value)
+{
+	if (!isWritable(reg))
+		return false;
+	switch (reg) {
+	case RegDeviceAddress:
+		if (value < 1 || value > 247)
+			return false;
+		mNewAddress = static_cast<uint8_t>(value);
+		break;
+	case RegClearStatusFlags:
+		if (value != 0) {
+			mRegisters[RegStatusSummary - FirstRegister] = 0;
+			mRegisters[RegHardwareFailure - FirstRegister] = 0;
+			mRegisters[RegOperationalFailure - FirstRegister] = 0;
+			mRegisters[RegWarningIndicator - FirstRegister] = 0;
+		}
+		break;
+	case RegEnterRunCommand:
+		// The requested mode is reported in the operational mode register.
+		mRegisters[RegOperationalMode - FirstRegister] = value;
+		break;
+	default:
+		break;
+	}
+	mRegisters[reg - FirstRegister] = value;
+	return true;
+}
+
+bool SimulatedBattery::isWritable(uint16_t reg) const
+{
+	return reg == RegOperationalMode ||
+		(reg >= RegDeviceAddress && reg <= RegImmediateSelfMaintenance);
+}
+
+std::vector<uint8_t> SimulatedBattery::readReply(const uint8_t *request,
+												 int function, uint16_t start,
+												 int count)
+{
+	if (count < 1 || count > 125)
+		return exception(request, 3);
+	std::vector<uint8_t> reply(request, request + 2);
+	reply.push_back(static_cast<uint8_t>(2 * count));
+	for (int i=0; i<count; ++i) {
+		uint16_t value = 0;
+		uint16_t reg = static_cast<uint16_t>(start + i);
+		if (!readRegister(reg, value))
+			return exception(request, 2);
+		if (reg == RegStateOfCharge && function != 23) {
+			++mPollCount;
+			mLastPoll = mLastUpdate;
+		}
+		append(reply, value);
+	}
+	return reply;
+}
+
+std::vector<uint8_t> SimulatedBattery::exception(const uint8_t *request, int code)
+{
+	std::vector<uint8_t> reply;
+	if (request[0] == 0)
+		return reply;
+	reply.push_back(request[0]);
+	reply.push_back(static_cast<uint8_t>(request[1] | 0x80));
+	reply.push_back(static_cast<uint8_t>(code));
+	return reply;
+}
@@ -0,0 +1,60 @@
+#ifndef SIMULATED_BATTERY_H
+#define SIMULATED_BATTERY_H
+
+#include <stdint.h>
+#include <vector>
+
+/*!
+ * Emulates the modbus interface of a single ZBM: the identity registers
+ * (0x0000-0x0004) and the 0x9001-0x9034 block, using function codes 3, 4, 6,
+ * 16 and 23. Writing `RegDeviceAddress` changes the address once the reply
+ * has been sent, like the real device does.
+ */
+class SimulatedBattery
+{
+public:
+	SimulatedBattery(uint8_t address, uint16_t serial);
+
+	uint8_t address() const;
+
+	/*!
+	 * Updates the measured values (state of charge, voltage, current,
+	 * temperatures) for the given time (µs).
+	 */
+	void update(int64_t now);
+
+	/*!
+	 * Handles a request with a valid CRC, addressed to this battery or
+	 * broadcast. `length` excludes the CRC. Returns the reply without CRC,
+	 * which is empty for broadcasts.
+	 */
+	std::vector<uint8_t> handle(const uint8_t *request, int length);
+
+	/// Number of reads of `RegStateOfCharge`, and the time (µs) of the last.
+	int pollCount() const;
+	int64_t lastPoll() const;
+
+private:
+	bool readRegister(uint16_t reg, uint16_t &value) const;
+
+	bool writeRegister(uint16_t reg, uint16_t value);
+
+	bool isWritable(uint16_t reg) const;
+
+	std::vector<uint8_t> readReply(const uint8_t *request, int function,
+								   uint16_t start, int count);
+
+	static std::vector<uint8_t> exception(const uint8_t *request, int code);
+
+	uint8_t mAddress;
+	uint8_t mNewAddress;
+	uint16_t mSerial;
+	// Registers 0x9001 up to and including 0x9034.
+	uint16_t mRegisters[0x34];
+	double mSoc;
+	int64_t mLastUpdate;
+	int mPollCount;
+	int64_t mLastPoll;
+};
+
+#endif // SIMULATED_BATTERY_H
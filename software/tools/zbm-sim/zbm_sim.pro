@@ -0,0 +1,28 @@
+# Simulates ZBM batteries on a pseudo terminal, so dbus-redflow can be tested
+# without hardware. Not part of the application build.
+
+QT += core
+QT -= gui
+
+TARGET = zbm-sim
+CONFIG += console release
+CONFIG -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+SOURCES += \
+    main.cpp \
+    simulated_battery.cpp \
+    fault_profile.cpp \
+    ../../src/crc16.cpp
+
+HEADERS += \
+    simulated_battery.h \
+    fault_profile.h \
+    ../../src/crc16.h \
+    ../../src/zbm_registers.h
+
+OTHER_FILES += \
+    example.profile